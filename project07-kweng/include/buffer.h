@@ -21,5 +21,7 @@ size_t buffer_length(buffer_t *);
 void buffer_append_char(buffer_t *, char c);
 /* Append byte array to buffer */
 void buffer_append_bytes(buffer_t *, uint8_t *bytes, size_t length);
+/* Empty the buffer, keeping its memory for reuse */
+void buffer_clear(buffer_t *);
 
 #endif // BUFFER_H
@@ -8,7 +8,9 @@
 #include <assert.h>
 #include <string.h>
 #include <pthread.h>
+#include <time.h>
 #include "buffer.h"
+#include "disk_cache.h"
 
 /* Structs */
 typedef struct node_t node_t;
@@ -16,33 +18,62 @@ typedef struct queue_t queue_t;
 typedef struct hash_table_t hash_table_t;
 typedef struct cache_t cache_t;
 
-int hash(char *s);
+/* How each shard chooses what to evict */
+typedef enum {
+	CACHE_LRU,     // evict the least recently used entry
+	CACHE_SLRU,    // segmented LRU: entries hit since insertion outlive the rest
+	CACHE_TINYLFU  // segmented LRU that only admits a new entry if it is
+	               // looked up more often than the entries it would evict
+} cache_policy_t;
+
+uint64_t hash(char *s);
 
 /* Initialization methods */
-node_t *init_node(char *key, buffer_t *value);
 queue_t *init_queue();
 hash_table_t *init_hash_table();
-cache_t *init_cache();
+cache_t *init_cache(size_t num_shards, size_t capacity,
+	size_t max_object_size, cache_policy_t policy, disk_cache_t *disk);
+
+/* Queue methods -- callers must hold the lock of the shard owning the queue */
+bool is_empty(queue_t *queue);
+node_t *dequeue(queue_t *queue);
+void enqueue(queue_t *queue, node_t *node);
+void queue_remove(queue_t *queue, node_t *node);
+void queue_update(queue_t *queue, node_t *node);
 
 /*
- * Queue methods -- some of these have the cache as a parameter, but that's
- * just to ensure that client_thread.c only deals with the cache itself. You
- * can obviously call the queue given the cache easily enough.
+ * Cache methods -- the cache is shared by every client thread and striped
+ * into shards that are locked independently. Nodes returned by cache_lookup()
+ * stay valid (even if evicted) until cache_release().
+ *
+ * An entry is filled while its response streams in: cache_reserve() returns
+ * a node private to the caller, cache_append() adds body bytes to it (which
+ * cache_replace_value() may swap for a smaller encoding of them), and
+ * cache_commit() makes it visible to lookups (or cache_abort() drops it).
+ * Lookups return entries whether or not they are still fresh; callers
+ * compare node_expires() with the time.
  */
-bool is_empty(queue_t *queue);
-node_t *dequeue(queue_t *queue, pthread_rwlock_t lock);
-void enqueue(queue_t *queue, node_t *node, pthread_rwlock_t lock);
-void queue_update(cache_t *cache, node_t *node);
-buffer_t *peek(cache_t *cache);
-
-/* Cache methods*/
-node_t *cache_insert(cache_t *cache, char *key, buffer_t *value);
-buffer_t *cache_remove(cache_t *cache);
-node_t *contains(cache_t *cache, char *key, pthread_rwlock_t lock);
-
-/* Getter methods */
-pthread_rwlock_t get_lock(cache_t *cache);
-queue_t *get_queue(cache_t *cache);
+node_t *cache_reserve(cache_t *cache, char *key, size_t size_hint);
+bool cache_append(node_t *node, uint8_t *data, size_t length);
+void cache_replace_value(node_t *node, uint8_t *data, size_t length,
+	size_t room);
+bool cache_commit(cache_t *cache, node_t *node, buffer_t *head, time_t date,
+	time_t expires);
+void cache_abort(node_t *node);
+node_t *cache_revalidate(cache_t *cache, node_t *node, buffer_t *head,
+	time_t date, time_t expires);
+node_t *cache_lookup(cache_t *cache, char *key);
+void cache_release(node_t *node);
+uint8_t *node_head(node_t *node);
+size_t node_head_length(node_t *node);
+uint8_t *node_value(node_t *node);
+size_t node_value_length(node_t *node);
+time_t node_date(node_t *node);
+time_t node_expires(node_t *node);
+
+/* Statistics methods -- each takes every shard's lock in turn */
+size_t cache_size(cache_t *cache);
+size_t cache_evictions(cache_t *cache);
 
 /* Free methods */
 void free_hash_table(hash_table_t *hash_table);
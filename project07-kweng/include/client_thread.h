@@ -2,6 +2,12 @@
 #define CLIENT_THREAD_H
 
 #include "cache.h"
+#include "dns_cache.h"
+#include "flight.h"
+#include "idle_clients.h"
+#include "origin_pool.h"
+#include "stats.h"
+#include "throttle.h"
 
 /* If you want verbose output on error,
  * #define VERBOSE. */
@@ -12,8 +18,32 @@
 # define verbose_printf(...)
 #endif
 
-/* Given a clientfd, handles the HTTP request sent on
- * cfd and sends the result back on cfd */
-void *handle_request(void *cfd);
+/* Seconds a client may take to send its next request, or to finish sending
+ * one */
+#define CLIENT_IDLE_TIMEOUT 15
+
+/* Sends a status message to client with the status line specified by
+ * status with a message body described by msg.
+ * Returns whether successful */
+bool send_status_code(int client_fd, char *status, char *msg);
+
+/* State shared by every connection handler */
+typedef struct {
+    cache_t *cache;
+    origin_pool_t *pool;
+    dns_cache_t *dns;
+    flight_table_t *flights;
+    stats_t *stats;
+    throttle_t *throttle;
+    idle_clients_t *idle;  /* where idle connections are parked, or NULL */
+    bool compress;  /* store text bodies gzip-compressed */
+} proxy_context_t;
+
+/* Handles the HTTP requests sent on client_fd and sends the results back on
+ * it, then closes client_fd, unless it goes idle between requests and is
+ * parked with ctx->idle instead.  resumed is set for a connection that was
+ * parked.  The response is served from (and stored in) the shared cache
+ * where possible, and fetched over a pooled server connection otherwise. */
+void handle_request(int client_fd, proxy_context_t *ctx, bool resumed);
 
 #endif
@@ -0,0 +1,35 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "buffer.h"
+#include "cache.h"
+#include "http.h"
+
+/* gzip compression of cached response bodies, with zlib.  Text bodies can
+ * be stored compressed, and are sent that way to clients that accept gzip.
+ * Other clients get any gzip-compressed cached body decompressed. */
+
+/* Most bytes a cached body is decompressed to, so a tiny compressed body
+ * can't make the proxy allocate without bound */
+#define MAX_DECOMPRESSED_SIZE (64L * 1024 * 1024)
+
+/* Returns the length bytes at data compressed in the gzip format, or NULL
+ * if compressing them wouldn't save at least an eighth of them.  Must be
+ * freed by the user. */
+buffer_t *gzip_compress(uint8_t *data, size_t length);
+/* Returns the gzip-compressed length bytes at data decompressed, or NULL if
+ * they are malformed or decompress to more than limit bytes.  Must be freed
+ * by the user. */
+buffer_t *gzip_decompress(uint8_t *data, size_t length, size_t limit);
+
+/* Gets a filled cache entry for a response with the given head ready to be
+ * committed, replacing its body with a gzip-compressed copy if the response
+ * is text that isn't compressed already and compressing it is worth it.
+ * Returns the head to commit the entry with, as made by make_cached_head()
+ * or, if the body was compressed, make_compressed_head(). */
+buffer_t *compress_entry(node_t *entry, uint8_t *head_data,
+    response_head_t *head);
+
+#endif // COMPRESS_H
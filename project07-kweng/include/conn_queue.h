@@ -0,0 +1,26 @@
+#ifndef CONN_QUEUE_H
+#define CONN_QUEUE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Bounded queue of client file descriptors waiting for a worker, shared by
+ * the accept loop and the idle connection waiter (producers) and the worker
+ * pool (consumers).  Besides newly accepted connections, it holds resumed
+ * ones, which a worker already served and parked while they were idle. */
+typedef struct conn_queue_t conn_queue_t;
+
+/* Allocate a queue that holds at most capacity connections */
+conn_queue_t *conn_queue_create(size_t capacity);
+/* Free the queue.  No thread may be using it. */
+void conn_queue_free(conn_queue_t *queue);
+/* Add a new connection without blocking.  Returns false if the queue is
+ * full. */
+bool conn_queue_try_push(conn_queue_t *queue, int client_fd);
+/* Add a resumed connection, blocking until there is room for it */
+void conn_queue_push_resumed(conn_queue_t *queue, int client_fd);
+/* Remove the oldest connection, blocking until there is one, and set
+ * *resumed to whether it is a resumed one */
+int conn_queue_pop(conn_queue_t *queue, bool *resumed);
+
+#endif // CONN_QUEUE_H
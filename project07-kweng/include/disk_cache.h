@@ -0,0 +1,49 @@
+#ifndef DISK_CACHE_H
+#define DISK_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/* Second cache tier for objects evicted from memory, in append-only segment
+ * files in a directory.  Segments are mapped into memory for reads, and an
+ * in-memory index maps each key to its latest record.  Once the segments
+ * outgrow the tier's capacity, the oldest is deleted whole.  The index is
+ * rebuilt from the segments left by an earlier run, so a restarted proxy
+ * starts warm. */
+typedef struct disk_cache_t disk_cache_t;
+
+/* An object found on disk.  Its bytes stay mapped until
+ * disk_cache_release(), even if its segment is deleted in the meantime. */
+typedef struct {
+    uint8_t *head;
+    size_t head_length;
+    uint8_t *value;
+    size_t value_length;
+    time_t date;
+    time_t expires;
+    void *segment;
+} disk_object_t;
+
+/* Opens (creating it if needed) a tier in directory dir holding at most
+ * about capacity bytes, and loads whatever an earlier run left there.
+ * Returns NULL and sets errno if the directory can't be used. */
+disk_cache_t *disk_cache_create(char *dir, size_t capacity);
+/* Closes the tier, leaving its segments on disk for the next run */
+void disk_cache_free(disk_cache_t *disk);
+/* Appends an object to the tier, replacing any older record for key.
+ * key_hash is the cache's hash of key, stored to rebuild the index.  date
+ * and expires are the object's freshness, kept along with it.  Returns false
+ * if it couldn't be written. */
+bool disk_cache_store(disk_cache_t *disk, char *key, uint64_t key_hash,
+    uint8_t *head, size_t head_length, uint8_t *value, size_t value_length,
+    time_t date, time_t expires);
+/* Looks up key, filling in *object if it is found, in which case it must be
+ * released with disk_cache_release() */
+bool disk_cache_lookup(disk_cache_t *disk, char *key, uint64_t key_hash,
+    disk_object_t *object);
+/* Lets go of an object returned by disk_cache_lookup() */
+void disk_cache_release(disk_cache_t *disk, disk_object_t *object);
+
+#endif // DISK_CACHE_H
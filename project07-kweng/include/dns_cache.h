@@ -0,0 +1,43 @@
+#ifndef DNS_CACHE_H
+#define DNS_CACHE_H
+
+#include <stddef.h>
+#include <sys/socket.h>
+
+/* Resolved addresses of origin servers, keyed by 'host:port'.  Lookups run
+ * on a few background resolver threads, concurrent lookups of the same name
+ * share one getaddrinfo() call, and answers are remembered for ttl seconds.
+ * An expired answer is still used while it is refreshed in the background,
+ * so only the first request to a host waits for the resolver. */
+typedef struct dns_cache_t dns_cache_t;
+
+/* Most addresses remembered per name */
+#define DNS_MAX_ADDRS 4
+
+/* Returned instead of a getaddrinfo() error code while the lookup is still
+ * running.  getaddrinfo() error codes are all negative. */
+#define DNS_PENDING 1
+
+/* The IPv4 addresses a name resolved to, in the resolver's order */
+typedef struct {
+    size_t count;
+    struct sockaddr_storage addrs[DNS_MAX_ADDRS];
+    socklen_t lengths[DNS_MAX_ADDRS];
+} dns_addrs_t;
+
+/* Allocate a cache with num_threads resolver threads that remembers answers
+ * for ttl seconds */
+dns_cache_t *dns_cache_create(size_t num_threads, int ttl);
+/* Stop the resolver threads and free the cache */
+void dns_cache_free(dns_cache_t *cache);
+/* Resolves host and port into *addrs, waiting for the lookup if the name
+ * isn't cached.  Returns 0 or a getaddrinfo() error code. */
+int dns_cache_resolve(dns_cache_t *cache, char *host, int port,
+    dns_addrs_t *addrs);
+/* Like dns_cache_resolve(), but never waits.  If the lookup is still running
+ * it returns DNS_PENDING, and writes to the eventfd notify_fd once the
+ * lookup finishes. */
+int dns_cache_try_resolve(dns_cache_t *cache, char *host, int port,
+    dns_addrs_t *addrs, int notify_fd);
+
+#endif // DNS_CACHE_H
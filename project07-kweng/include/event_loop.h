@@ -0,0 +1,12 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include "client_thread.h"
+
+/* Runs an epoll event loop on the calling thread.  Accepts connections on
+ * listen_fd, which must be non-blocking and may be shared by several loops,
+ * and serves them with non-blocking sockets, so one thread can juggle many
+ * slow clients and servers at once.  Never returns. */
+void run_event_loop(int listen_fd, proxy_context_t *ctx);
+
+#endif // EVENT_LOOP_H
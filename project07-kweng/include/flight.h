@@ -0,0 +1,70 @@
+#ifndef FLIGHT_H
+#define FLIGHT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include "buffer.h"
+#include "http.h"
+
+/* Fetches from origin servers that are in flight, keyed by cache key, so
+ * concurrent misses on one URL make a single request to the server.  The
+ * first request to miss becomes the flight's leader and fetches the
+ * response.  Requests that miss while it waits for the server follow it,
+ * and are sent the same bytes as they arrive. */
+typedef struct flight_table_t flight_table_t;
+typedef struct flight_t flight_t;
+
+/* Returned by the follower functions below instead of a byte count.
+ * FLIGHT_FAILED means the follower must fetch the response itself, or give
+ * up if it has already started sending it. */
+#define FLIGHT_FAILED (-1)
+#define FLIGHT_PENDING (-2)
+
+/* Allocate an empty table of flights */
+flight_table_t *flight_table_create(void);
+/* Free the table, which must have no flights left */
+void flight_table_free(flight_table_t *table);
+
+/* Joins the flight for key, or starts one if there is none, in which case
+ * *leader is set and the caller must fetch the response and publish it.
+ * Clients that accept gzip and clients that don't join separate flights,
+ * since the server may answer them differently.  The returned flight must be
+ * released with flight_release(). */
+flight_t *flight_join(flight_table_t *table, char *key, bool accepts_gzip,
+    bool *leader);
+/* Drops the caller's reference to the flight */
+void flight_release(flight_t *flight);
+
+/* Leader: publishes the status line and headers of the response (the first
+ * head->header_length bytes of head_data).  Returns whether followers will
+ * be sent it.  Only responses a cache could hand to anyone are shared: not
+ * ones that are uncacheable, private or set a cookie, nor ones encoded in a
+ * way the followers may not accept.  Responses known to be too big aren't
+ * buffered for them either.  Nor is any response if nobody has joined the
+ * flight by now, and later misses start a flight of their own. */
+bool flight_publish_head(flight_t *flight, uint8_t *head_data,
+    response_head_t *head);
+/* Leader: publishes the next length bytes of the body, still in the
+ * server's framing.  A body that grows too big to buffer stops being shared,
+ * and the followers fetch the response themselves. */
+void flight_publish_body(flight_t *flight, uint8_t *data, size_t length);
+/* Leader: ends the flight, successfully if the whole response has been
+ * published.  Does nothing if the flight has already ended. */
+void flight_finish(flight_t *flight, bool complete);
+
+/* Follower: waits for the status line and headers of the response (and for
+ * all of its body if its length wasn't known in advance), then appends them
+ * to head_data and fills in *head.  Returns 0 or FLIGHT_FAILED.  If
+ * notify_fd isn't -1, returns FLIGHT_PENDING instead of waiting, and writes
+ * to the eventfd notify_fd when there is news. */
+int flight_get_head(flight_t *flight, buffer_t *head_data,
+    response_head_t *head, int notify_fd);
+/* Follower: copies up to length bytes of the body, starting offset bytes
+ * in, into buf, waiting for them to arrive if needed.  Returns the number of
+ * bytes copied, 0 at the end of the body, or FLIGHT_FAILED.  notify_fd works
+ * as for flight_get_head(). */
+ssize_t flight_read(flight_t *flight, size_t offset, uint8_t *buf,
+    size_t length, int notify_fd);
+
+#endif // FLIGHT_H
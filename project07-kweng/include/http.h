@@ -0,0 +1,272 @@
+#ifndef HTTP_H
+#define HTTP_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include <time.h>
+#include "buffer.h"
+
+/* Request and response parsing and rewriting shared by the
+ * thread-per-connection and event loop front ends.  None of these functions
+ * do any I/O. */
+
+/* Outcome of parsing a request line */
+typedef enum {
+    REQUEST_OK,
+    REQUEST_MALFORMED,       /* answer with 400 Bad Request */
+    REQUEST_NOT_IMPLEMENTED  /* answer with 501 Not Implemented */
+} request_status_t;
+
+/* Longest If-Range validator kept; longer ones never match */
+#define MAX_VALIDATOR_SIZE 128
+
+/* The single range of bytes a Range header asks for.  The proxy only serves
+ * ranges of cached responses itself, and leaves requests for several ranges
+ * (or other units) to the server. */
+typedef struct {
+    bool requested;          /* the request has a Range header */
+    bool valid;              /* it asks for one range of bytes */
+    bool suffix;             /* it asks for the last `last` bytes */
+    size_t first;
+    size_t last;             /* SIZE_MAX if the range runs to the end */
+    bool if_range;           /* the request has an If-Range header */
+    char validator[MAX_VALIDATOR_SIZE];  /* its entity tag or date */
+} byte_range_t;
+
+/* How a request's Range header applies to a cached response */
+typedef enum {
+    RANGE_NONE,              /* send the whole response */
+    RANGE_PARTIAL,           /* send part of its body with a 206 */
+    RANGE_UNSATISFIABLE      /* none of its body is in range: send a 416 */
+} range_result_t;
+
+/* Which of the headers the proxy must send have been seen so far, and what
+ * the client asked for its own connection.  Set keep_alive to ask the server
+ * to keep the connection open afterwards.  accepts_chunked is left for the
+ * caller to set from the request line. */
+typedef struct {
+    bool keep_alive;
+    bool sent_host_header;
+    bool sent_connection_header;
+    bool client_close;
+    bool client_keep_alive;
+    bool conditional;        /* the client sent If-None-Match and the like */
+    bool accepts_gzip;       /* the client's Accept-Encoding includes gzip */
+    bool accepts_chunked;    /* the client's HTTP version has chunked coding */
+    bool credentials;        /* the client sent Cookie or Authorization */
+    byte_range_t range;      /* what the client's Range header asks for */
+} header_filter_t;
+
+/* How the end of a response body is found */
+typedef enum {
+    BODY_NONE,     /* there is no body (1xx, 204 and 304 responses) */
+    BODY_LENGTH,   /* the body is Content-Length bytes long */
+    BODY_CHUNKED,  /* the body uses chunked transfer coding */
+    BODY_CLOSE     /* the body runs until the server closes the connection */
+} body_framing_t;
+
+/* Status line and headers of a response */
+typedef struct {
+    int status;
+    size_t header_length;    /* bytes up to and including the blank line */
+    body_framing_t framing;
+    size_t content_length;   /* only meaningful for BODY_LENGTH */
+    bool keep_alive;         /* whether the server will keep the connection */
+
+    /* What the headers say about caching the response.  Times are seconds
+     * since the epoch, and are -1 where the header is missing. */
+    bool cacheable;          /* the status may be cached, and neither
+                              * no-store nor private forbid it */
+    bool no_cache;           /* must be revalidated before every use */
+    time_t max_age;          /* s-maxage, or else max-age */
+    time_t expires;          /* 0 if invalid, which means already expired */
+    time_t date;
+    time_t last_modified;
+    time_t age;              /* the Age header, or 0 */
+
+    bool sets_cookie;        /* there is a Set-Cookie header */
+    bool encoded;            /* the body has a Content-Encoding */
+    bool gzip;               /* the body is compressed with just gzip */
+    bool compressible;       /* the body is text with no Content-Encoding */
+} response_head_t;
+
+/* Where a chunked body parser is within the chunk framing */
+typedef enum {
+    CHUNK_SIZE,
+    CHUNK_EXTENSION,
+    CHUNK_SIZE_LF,
+    CHUNK_DATA,
+    CHUNK_DATA_CR,
+    CHUNK_DATA_LF,
+    CHUNK_TRAILER,
+    CHUNK_TRAILER_LINE,
+    CHUNK_TRAILER_LF,
+    CHUNK_DONE
+} chunk_state_t;
+
+/* Finds the end of a response body as its bytes arrive */
+typedef struct {
+    body_framing_t framing;
+    bool done;
+    size_t remaining;        /* BODY_LENGTH: body bytes still to come */
+    chunk_state_t chunk_state;
+    size_t chunk_size;       /* BODY_CHUNKED: data left in the current chunk */
+    bool chunk_size_seen;
+} body_reader_t;
+
+/* Returns whether str starts with prefix */
+bool starts_with(char *str, char *prefix);
+
+/* Parses a request line (which is modified in the process).
+ * On REQUEST_OK, sets *full_host to the 'host:port' string and *path to the
+ * path (at least "/"), which must both be freed by the user, and sets
+ * *keep_alive to whether the client's HTTP version keeps connections open by
+ * default. */
+request_status_t parse_request_line(char *line, char **full_host, char **path,
+    bool *keep_alive);
+
+/* Builds the cache key for a request, the 'host[:port]' string followed
+ * by the path.  The returned string must be freed by the user. */
+char *make_cache_key(char *host, char *path);
+
+/* Splits the port off of a 'host[:port]' string in place, defaulting to 80.
+ * Returns false if the port is invalid. */
+bool split_host_port(char *full_host, int *port);
+
+/* Returns the message to send with a 502 when getaddrinfo() fails with err,
+ * or NULL if the failure isn't the server's fault */
+char *dns_error_message(int err);
+
+/* Rewrites one request header line on its way to the server:
+ *
+ * All Keep-Alive headers are dropped
+ * Connection headers have their value replaced with 'close' (or
+ * 'keep-alive' if filter->keep_alive)
+ * Proxy-Connection headers have their value replaced with 'close' (or are
+ * dropped if filter->keep_alive)
+ * Range and If-Range headers are passed on as they are, and noted in
+ * filter->range
+ *
+ * Returns the line to send (line itself or a constant), or NULL to drop it. */
+char *filter_header(header_filter_t *filter, char *line);
+
+/* Works out which of the total bytes of the body of a cached response with
+ * the given head the range asks for.  Only ranges of a 200's body are
+ * served, and only if any If-Range validator matches the response: a strong
+ * entity tag equal to its ETag, or a date equal to its Last-Modified.  An
+ * entity tag never matches if the body is sent decompressed.  On
+ * RANGE_PARTIAL, sets *first and *length to the bytes to send. */
+range_result_t resolve_range(byte_range_t *range, uint8_t *head_data,
+    response_head_t *head, bool decompressed, size_t total, size_t *first,
+    size_t *length);
+
+/* Appends the headers that must be sent but were not seen by filter_header,
+ * followed by the blank line that ends the request */
+void finish_headers(header_filter_t *filter, buffer_t *out, char *host);
+
+/* Returns whether the client's connection should stay open for another
+ * request, given its headers as seen by filter_header and whether its HTTP
+ * version keeps connections open by default */
+bool request_keep_alive(header_filter_t *filter, bool by_default);
+
+/* Parses the status line and headers at the start of the length bytes of
+ * data.  Returns 1 and fills in *head once they are complete, 0 if more data
+ * is needed, or -1 if they are malformed. */
+int parse_response_head(uint8_t *data, size_t length, response_head_t *head);
+
+/* Prepares to find the end of the body of a response with the given head */
+void body_reader_init(body_reader_t *body, response_head_t *head);
+
+/* Feeds the next length bytes read from the server to the body reader.
+ * Returns how many of them belong to the body, which is fewer than length
+ * only once the body has ended (body->done), or -1 if the body is malformed.
+ * If decoded is not NULL, the body's payload (without chunk framing) is
+ * appended to it.  For BODY_CLOSE, the caller sets body->done on EOF. */
+ssize_t body_reader_feed(body_reader_t *body, uint8_t *data, size_t length,
+    buffer_t *decoded);
+
+/* Works out, for a response with the given head that arrived at time now,
+ * when it was generated (now less its age) and when it stops being fresh.
+ * The lifetime comes from Cache-Control or Expires, or else is guessed from
+ * Last-Modified. */
+void response_freshness(response_head_t *head, time_t now, time_t *date,
+    time_t *expires);
+
+/* Builds the status line and headers to send the client for a response with
+ * the given head: the end-to-end headers from head_data, its framing headers,
+ * and a Connection header saying whether the client's connection stays open.
+ * A response from the cache also gets an Age header, if age isn't negative.
+ * Must be freed by the user. */
+buffer_t *make_client_head(uint8_t *head_data, response_head_t *head,
+    bool keep_alive, time_t age);
+
+/* Builds the status line and headers to send a client that can't take a
+ * chunked body (an HTTP/1.0 one) for a response with the given head whose
+ * body is chunked: as make_client_head(), but without the framing headers
+ * and closing the connection, so the decoded body runs until the close.
+ * Must be freed by the user. */
+buffer_t *make_dechunked_head(uint8_t *head_data, response_head_t *head);
+
+/* Builds the head of a response as it is stored in the cache: the status
+ * line and end-to-end headers from head_data, and an explicit Content-Length
+ * of body_length for its decoded payload.  Must be freed by the user. */
+buffer_t *make_cached_head(uint8_t *head_data, response_head_t *head,
+    size_t body_length);
+
+/* Builds the head of a response stored in the cache with its body
+ * compressed: as make_cached_head(), but saying the body is gzip-compressed,
+ * and that its encoding depends on the request if no Vary header says what
+ * it depends on already.  body_length is the length compressed.  Must be
+ * freed by the user. */
+buffer_t *make_compressed_head(uint8_t *head_data, response_head_t *head,
+    size_t body_length);
+
+/* Builds the status line and headers to send the client for a cached
+ * response with the given head whose gzip-compressed body has been
+ * decompressed to body_length bytes: as make_client_head(), but without the
+ * Content-Encoding and with a Content-Length of body_length.  Must be freed
+ * by the user. */
+buffer_t *make_decompressed_head(uint8_t *head_data, response_head_t *head,
+    bool keep_alive, time_t age, size_t body_length);
+
+/* Builds the status line and headers to send the client for length bytes
+ * of the total bytes of the body of a cached response with the given head,
+ * starting first bytes in: a 206 with the end-to-end headers from head_data
+ * (less its Content-Encoding if the body has been decompressed), and
+ * headers saying which bytes these are, how old the response is, and
+ * whether the connection stays open.  Must be freed by the user. */
+buffer_t *make_partial_head(uint8_t *head_data, response_head_t *head,
+    bool keep_alive, time_t age, bool decompressed, size_t first,
+    size_t length, size_t total);
+
+/* Returns a complete 416 response saying the body of the cached response a
+ * range was asked of is only total bytes long, and a Connection header
+ * saying whether the client's connection stays open.  Must be freed by the
+ * user. */
+buffer_t *make_unsatisfiable_response(size_t total, bool keep_alive);
+
+/* Builds the head to store for a cached response with the given head (as
+ * made by make_cached_head()) once a 304 with head update_data has confirmed
+ * it is unchanged: its status line and headers, with those the 304 sends
+ * replaced by the 304's.  Must be freed by the user. */
+buffer_t *make_revalidated_head(uint8_t *head_data, response_head_t *head,
+    uint8_t *update_data, response_head_t *update);
+
+/* Builds a request revalidating a cached response with the given head: the
+ * request head in request (ending with its blank line), asking with
+ * If-None-Match and If-Modified-Since for a 304 if the response still
+ * matches its ETag and Last-Modified.  Returns NULL if it has neither.  Must
+ * be freed by the user. */
+buffer_t *make_conditional_request(buffer_t *request, uint8_t *head_data,
+    response_head_t *head);
+
+/* Returns a complete 200 response with body as its plain text body, and a
+ * Connection header saying whether the client's connection stays open.  Must
+ * be freed by the user. */
+buffer_t *make_text_response(buffer_t *body, bool keep_alive);
+
+/* Returns a complete response with the given status line and a message
+ * body described by msg.  Must be freed by the user. */
+buffer_t *make_status_response(char *status, char *msg);
+
+#endif // HTTP_H
@@ -0,0 +1,22 @@
+#ifndef IDLE_CLIENTS_H
+#define IDLE_CLIENTS_H
+
+#include <stdbool.h>
+#include "conn_queue.h"
+
+/* Keep-alive client connections parked between requests in threads mode, so
+ * an idle client doesn't hold a worker thread.  A thread of its own watches
+ * them with epoll, and hands each back to the workers as a resumed
+ * connection once it has more to read, or once it has been idle too long,
+ * in which case its read side is shut down first so the worker just closes
+ * it.  It runs for the life of the process. */
+typedef struct idle_clients_t idle_clients_t;
+
+/* Starts watching parked connections, handing them back on queue, and
+ * giving each idle_timeout seconds to send its next request */
+idle_clients_t *idle_clients_create(conn_queue_t *queue, int idle_timeout);
+/* Parks client_fd until it is readable.  Returns false if it can't be
+ * watched, in which case the caller keeps it. */
+bool idle_clients_park(idle_clients_t *idle, int client_fd);
+
+#endif // IDLE_CLIENTS_H
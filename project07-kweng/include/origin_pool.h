@@ -0,0 +1,22 @@
+#ifndef ORIGIN_POOL_H
+#define ORIGIN_POOL_H
+
+#include <stddef.h>
+
+/* Idle keep-alive connections to origin servers, keyed by their
+ * 'host[:port]' string, so cache misses can skip the TCP handshake */
+typedef struct origin_pool_t origin_pool_t;
+
+/* Allocate a pool keeping at most max_idle idle connections per origin, each
+ * for at most idle_timeout seconds.  A max_idle of 0 disables pooling. */
+origin_pool_t *origin_pool_create(size_t max_idle, int idle_timeout);
+/* Close every idle connection and free the pool */
+void origin_pool_free(origin_pool_t *pool);
+/* Returns an idle connection to origin that still looks open, or -1 if
+ * there is none.  The caller owns the returned connection. */
+int origin_pool_get(origin_pool_t *pool, char *origin);
+/* Hands a connection to origin that is ready for another request back to the
+ * pool, which closes it if the origin already has max_idle idle ones */
+void origin_pool_put(origin_pool_t *pool, char *origin, int server_fd);
+
+#endif // ORIGIN_POOL_H
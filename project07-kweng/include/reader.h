@@ -0,0 +1,30 @@
+#ifndef READER_H
+#define READER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Buffered reader over a blocking file descriptor.  It pulls large chunks
+ * from the descriptor and hands out lines that point into its own buffer,
+ * so parsing headers costs a few read() calls instead of one per byte.
+ * Bytes past the last line handed out stay buffered for the next call. */
+typedef struct reader_t reader_t;
+
+/* Allocate a reader for fd, which remains owned by the caller */
+reader_t *reader_create(int fd);
+/* Free the reader */
+void reader_free(reader_t *reader);
+/* Reads a line ending in \r\n.  Returns a pointer into the reader's buffer to
+ * the '\0'-terminated line (including the \r\n) and sets *length to its
+ * length.  The line is only valid until the next call on the reader.
+ * Returns NULL on error, on EOF, or if the line is unreasonably long. */
+char *reader_read_line(reader_t *reader, size_t *length);
+/* Waits until at least one unread byte is buffered, so a connection closed
+ * between requests can be told apart from one cut off mid-request.
+ * Returns false on EOF or error. */
+bool reader_wait(reader_t *reader);
+/* Returns whether any unread bytes are buffered */
+bool reader_has_data(reader_t *reader);
+
+#endif // READER_H
@@ -0,0 +1,29 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+
+/* A fixed region of memory carved into equally sized pages.  A page is split
+ * into chunks of one size class when it is first needed, and chunks bigger
+ * than a page take a run of whole pages.  Chunks up to a page are handed out
+ * and returned in constant time, and a page goes back to the region once all
+ * of its chunks have been returned, so memory freed by one size class can be
+ * reused by another.  Nothing is allocated once the region exists, so the
+ * memory it uses is fixed up front. */
+typedef struct slab_t slab_t;
+
+/* Allocate a region of at least region_size bytes */
+slab_t *slab_create(size_t region_size);
+/* Free the region, along with any chunks still handed out */
+void slab_free(slab_t *slab);
+/* Returns a chunk of at least size bytes, or NULL if no chunk of its class
+ * (or run of pages) is left.  Safe to call from any thread. */
+void *slab_get(slab_t *slab, size_t size);
+/* Returns a chunk from slab_get() to the slab.  Safe to call from any
+ * thread. */
+void slab_put(slab_t *slab, void *chunk);
+/* Returns how many bytes the chunk can hold, which may be more than were
+ * asked for */
+size_t slab_chunk_size(slab_t *slab, void *chunk);
+
+#endif // SLAB_H
@@ -0,0 +1,57 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "buffer.h"
+#include "cache.h"
+
+/* Counters and latency histograms describing what the proxy has been doing.
+ * Every thread updates its own copy, without locks or atomic
+ * read-modify-writes, and a report sums the copies of every thread. */
+typedef struct stats_t stats_t;
+
+/* The report is served to clients asking the proxy for this URL, which is
+ * never forwarded */
+#define STATS_HOST "proxy.local"
+#define STATS_PATH "/stats"
+
+typedef enum {
+    STAT_REQUESTS,       /* requests read from clients */
+    STAT_HITS,           /* answered from a fresh cache entry */
+    STAT_MISSES,         /* answered by (or after asking) an origin server */
+    STAT_REVALIDATED,    /* misses the server answered with a 304 */
+    STAT_COALESCED,      /* misses that followed another request's fetch */
+    STAT_CACHE_BYTES,    /* response bytes sent from the cache */
+    STAT_ORIGIN_BYTES,   /* response bytes relayed from origin servers */
+    STAT_CONNECTIONS,    /* client connections open right now */
+    STAT_THROTTLED,      /* connections and requests turned away by a limit */
+    NUM_STAT_COUNTERS
+} stat_counter_t;
+
+typedef enum {
+    LATENCY_FIRST_BYTE,  /* from reading a request to sending its first byte */
+    LATENCY_TOTAL,       /* from reading a request to sending its last byte */
+    NUM_STAT_LATENCIES
+} stat_latency_t;
+
+/* Allocate zeroed statistics */
+stats_t *stats_create(void);
+
+/* Adds delta (which may be negative) to the calling thread's counter */
+void stats_add(stats_t *stats, stat_counter_t counter, int64_t delta);
+
+/* Returns the time on a monotonic clock, in microseconds */
+uint64_t stats_now(void);
+/* Records the time since start (from stats_now()) in the calling thread's
+ * histogram of latency */
+void stats_record(stats_t *stats, stat_latency_t latency, uint64_t start);
+
+/* Returns whether a request for host (its 'host[:port]' string) and path
+ * asks for the report */
+bool stats_is_request(char *host, char *path);
+/* Returns a plain text report of every thread's counters and histograms,
+ * along with the cache's.  Must be freed by the user. */
+buffer_t *stats_report(stats_t *stats, cache_t *cache);
+
+#endif // STATS_H
@@ -0,0 +1,49 @@
+#ifndef THROTTLE_H
+#define THROTTLE_H
+
+#include <netinet/in.h>
+#include <stdbool.h>
+
+/* Caps on how many connections or fetches a single client address or
+ * origin server may have open at once, and on how many requests per second
+ * it may make, so no one client or slow server can take up every thread.
+ * Each kind of key has a fixed table of slots, and keys are hashed to a
+ * slot.  Every slot is just atomic counters, so checking a limit takes no
+ * locks.  Keys that share a slot share its limits, which only ever makes
+ * them stricter. */
+typedef struct throttle_t throttle_t;
+
+typedef enum {
+    THROTTLE_CLIENT,  /* keyed by the client's address */
+    THROTTLE_ORIGIN,  /* keyed by the server's 'host[:port]' string */
+    NUM_THROTTLE_KINDS
+} throttle_kind_t;
+
+/* Room for a client key: the client's address as text */
+#define CLIENT_KEY_SIZE INET6_ADDRSTRLEN
+
+/* Writes the key of the client connected on client_fd to key, which has
+ * room for CLIENT_KEY_SIZE bytes.  Returns false if the client isn't
+ * connected over IP (like the proxy's own warm-up requests), in which case
+ * it isn't limited. */
+bool throttle_client_key(int client_fd, char *key);
+
+/* Allocate a throttle with no limits */
+throttle_t *throttle_create(void);
+
+/* Limits each key of a kind to max_active at a time and rate per second,
+ * with bursts of up to a second's worth.  0 means no limit. */
+void throttle_set(throttle_t *throttle, throttle_kind_t kind, long max_active,
+    long rate);
+
+/* Takes one of key's max_active places.  Returns whether there was one
+ * free, in which case it must be given back with throttle_release(). */
+bool throttle_acquire(throttle_t *throttle, throttle_kind_t kind, char *key);
+/* Gives back a place taken by throttle_acquire() */
+void throttle_release(throttle_t *throttle, throttle_kind_t kind, char *key);
+
+/* Takes a token from key's bucket, which refills at rate per second.
+ * Returns whether there was one. */
+bool throttle_take(throttle_t *throttle, throttle_kind_t kind, char *key);
+
+#endif // THROTTLE_H
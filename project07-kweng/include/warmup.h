@@ -0,0 +1,19 @@
+#ifndef WARMUP_H
+#define WARMUP_H
+
+#include <stdio.h>
+#include "client_thread.h"
+
+/* Warms up the cache before the proxy takes any traffic, by requesting every
+ * URL in a file the way a client would.  Each line of the file is a URL
+ * like those in tests/http-sites ('host[:port][/path]', optionally starting
+ * with 'http://'); blank lines and lines starting with '#' are skipped, as
+ * are repeats. */
+
+/* Requests every URL listed in file (which is closed afterwards) through
+ * ctx, up to parallelism of them at a time, and prints how many of them
+ * ended up cached and how many bytes that took.  A response that stalls for
+ * more than a few seconds is left to finish in the background. */
+void warm_cache(FILE *file, long parallelism, proxy_context_t *ctx);
+
+#endif // WARMUP_H
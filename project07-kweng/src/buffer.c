@@ -79,3 +79,9 @@ void buffer_append_bytes(buffer_t *buf, uint8_t *bytes, size_t length) {
     memcpy(buf->data + buf->length, bytes, length);
     buf->length += length;
 }
+
+void buffer_clear(buffer_t *buf) {
+    assert(buf != NULL);
+
+    buf->length = 0;
+}
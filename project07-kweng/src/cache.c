@@ -1,10 +1,26 @@
 #include "buffer.h"
 #include "cache.h"
+#include "slab.h"
 #include <pthread.h>
+#include <stdatomic.h>
 
-const size_t BINS = 1024;
-const size_t MAX_CACHE_SIZE = 1024 * 1024;
-const size_t MAX_OBJECT_SIZE = 1024 * 100;
+const size_t BINS = 1024; // initial number of bins, always a power of 2
+
+/* Share of a segmented shard's capacity its protected segment may hold */
+#define PROTECTED_PERCENT 80
+
+/* Rows of the TinyLFU frequency sketch, and the largest count it keeps */
+#define SKETCH_DEPTH 4
+#define SKETCH_MAX_COUNT 15
+
+/* Memory preallocated for each shard's slab, as a share of its capacity, to
+ * leave room for the chunk rounding and for entries still being filled */
+#define SLAB_PERCENT 125
+
+/* How many bytes of entries an allocation from a full slab may evict, as a
+ * multiple of its size, and the size a smaller allocation counts as */
+#define ALLOC_EVICTION_FACTOR 2
+#define ALLOC_EVICTION_MIN (64 * 1024)
 
 struct node_t {
 	// for use in the queue
@@ -15,9 +31,35 @@ struct node_t {
 	node_t *hash_table_prev;
 	node_t *hash_table_next;
 
-	// for storing the (key, value) pair
+	// for storing the (key, value) pair. The key, the value (the response
+	// body), and the head (its status line and headers, only set once
+	// committed) are stored one after another in data, a chunk of the
+	// shard's slab that can hold data_capacity bytes. key_hash caches
+	// hash(key).
 	char *key;
-	buffer_t *value;
+	uint64_t key_hash;
+	uint8_t *data;
+	size_t data_capacity;
+	size_t value_offset;
+	size_t value_length;
+	size_t head_length;
+
+	// when the response was generated, going by our clock, and when it
+	// stops being fresh
+	time_t date;
+	time_t expires;
+
+	// the shard whose slab the node lives in, the cache's largest object
+	// size at the time the node was reserved, which segment of a segmented
+	// shard the node is in, and whether the disk tier already has a copy
+	struct shard_t *shard;
+	size_t limit;
+	bool is_protected;
+	bool on_disk;
+
+	// one reference belongs to the cache while the node is linked in; every
+	// caller of cache_lookup() holds another until cache_release()
+	atomic_size_t refs;
 };
 
 struct queue_t {
@@ -26,39 +68,78 @@ struct queue_t {
 	node_t *back;
 };
 
+/*
+ * Chained hash table that doubles once it holds more nodes than bins. The
+ * nodes are moved into the bigger array a few bins at a time by each later
+ * operation, so no single insertion pays for the whole rehash. Until then,
+ * bins below old_next have been moved and the rest still live in old_arr.
+ */
 struct hash_table_t {
 	size_t capacity;
+	size_t size;
 	node_t **arr;
+
+	size_t old_capacity;
+	size_t old_next;
+	node_t **old_arr;
 };
 
-struct cache_t {
+/*
+ * Count-min sketch estimating how often each key has been looked up lately,
+ * for TinyLFU admission. Every counter is halved once the sketch has counted
+ * ten lookups per column, so old popularity fades.
+ */
+typedef struct sketch_t {
+	size_t width; // columns per row, a power of 2
+	uint8_t *counts;
+	size_t additions;
+} sketch_t;
+
+/*
+ * The cache is striped into independently locked shards, each of which owns
+ * a slice of the total budget, a hash table, and its eviction queues. A key
+ * always maps to the same shard, so threads only contend when they touch keys
+ * in the same shard.
+ *
+ * Under plain LRU, every node lives in queue. The segmented policies put new
+ * nodes in queue (the probation segment) and move them to protected_queue
+ * once they are hit, so a scan of one-hit URLs only churns probation.
+ */
+typedef struct shard_t {
 	size_t size;
-	pthread_rwlock_t lock;
+	size_t capacity;
+	pthread_mutex_t lock;
 	queue_t *queue;
+	queue_t *protected_queue;
+	size_t protected_size;
+	size_t protected_capacity;
 	hash_table_t *hash_table;
+	sketch_t sketch;
+	slab_t *slab;
+	disk_cache_t *disk;
+	size_t evictions;
+} shard_t;
+
+struct cache_t {
+	cache_policy_t policy;
+	size_t max_object_size;
+	size_t num_shards;
+	shard_t *shards;
 };
 
-/* Hash a string. */
-int hash(char *s) {
-	uint8_t hash = (uint8_t)5381;
-	int c;
-	while ((c = *s++)) {
-		hash = ((hash << 5) + hash) + c;
-	}
-	return (int)hash % BINS;
-}
+/* Number of old bins moved into the new array by each operation on a table
+ * that is being rehashed */
+#define REHASH_STEP 4
 
-/* Initialize a node with the given value. */
-node_t *init_node(char *key, buffer_t *value) {
-	node_t *node = (node_t *)malloc(sizeof(node_t));
-	assert(node != NULL);
-	node->key = key;
-	node->value = value;
-	node->prev = NULL;
-	node->next = NULL;
-	node->hash_table_prev = NULL;
-	node->hash_table_next = NULL;
-	return node;
+/* Hash a string with 64-bit FNV-1a. */
+uint64_t hash(char *s) {
+	uint64_t hash = 14695981039346656037ULL;
+	uint8_t c;
+	while ((c = (uint8_t)*s++)) {
+		hash ^= c;
+		hash *= 1099511628211ULL;
+	}
+	return hash;
 }
 
 /* Initialize a queue with the given capacity. */
@@ -76,195 +157,848 @@ hash_table_t *init_hash_table() {
 	hash_table_t *hash_table = (hash_table_t *)malloc(sizeof(hash_table_t));
 	assert(hash_table != NULL);
 	hash_table->capacity = BINS;
-	hash_table->arr = (node_t **)malloc(BINS * sizeof(node_t *));
+	hash_table->size = 0;
+	hash_table->arr = (node_t **)calloc(BINS, sizeof(node_t *));
 	assert(hash_table->arr != NULL);
-	for (size_t i = 0; i < hash_table->capacity; i++) {
-		hash_table->arr[i] = NULL;
-	}
+	hash_table->old_capacity = 0;
+	hash_table->old_next = 0;
+	hash_table->old_arr = NULL;
 	return hash_table;
 }
 
-/* Initialize the cache. */
-cache_t *init_cache() {
+/*
+ * Initialize a frequency sketch for a shard of the given capacity, with
+ * about one column per KB of it.
+ */
+static void init_sketch(sketch_t *sketch, size_t capacity) {
+	sketch->width = 256;
+	while (sketch->width < capacity / 1024 && sketch->width < (1 << 24)) {
+		sketch->width *= 2;
+	}
+	sketch->counts = (uint8_t *)calloc(SKETCH_DEPTH * sketch->width,
+		sizeof(uint8_t));
+	assert(sketch->counts != NULL);
+	sketch->additions = 0;
+}
+
+/*
+ * Initialize the cache, splitting capacity bytes evenly across num_shards.
+ * Objects of max_object_size bytes or more are never cached. If disk isn't
+ * NULL, evicted entries are demoted to it, and misses are looked up in it.
+ */
+cache_t *init_cache(size_t num_shards, size_t capacity, size_t max_object_size,
+		cache_policy_t policy, disk_cache_t *disk) {
+	assert(num_shards > 0);
 	cache_t *cache = (cache_t *)malloc(sizeof(cache_t));
 	assert(cache != NULL);
-	queue_t *queue = init_queue();
-	hash_table_t *hash_table = init_hash_table();
-	pthread_rwlock_init(&cache->lock, NULL);
-	cache->size = 0;
-	cache->queue = queue;
-	cache->hash_table = hash_table;
+	cache->policy = policy;
+	cache->max_object_size = max_object_size;
+	cache->num_shards = num_shards;
+	cache->shards = (shard_t *)malloc(num_shards * sizeof(shard_t));
+	assert(cache->shards != NULL);
+	for (size_t i = 0; i < num_shards; i++) {
+		shard_t *shard = &cache->shards[i];
+		pthread_mutex_init(&shard->lock, NULL);
+		shard->size = 0;
+		shard->capacity = capacity / num_shards;
+		shard->queue = init_queue();
+		shard->protected_queue = init_queue();
+		shard->protected_size = 0;
+		shard->protected_capacity =
+			shard->capacity / 100 * PROTECTED_PERCENT;
+		shard->hash_table = init_hash_table();
+		shard->sketch.counts = NULL;
+		if (policy == CACHE_TINYLFU) {
+			init_sketch(&shard->sketch, shard->capacity);
+		}
+		shard->slab = slab_create(shard->capacity / 100 * SLAB_PERCENT);
+		shard->disk = disk;
+		shard->evictions = 0;
+	}
 	return cache;
 }
 
-bool is_empty(queue_t *queue) {
-	return queue->back == NULL;
+/* Return the number of bytes the node counts against its shard's capacity. */
+static size_t node_size(node_t *node) {
+	return node->value_length + node->head_length;
 }
 
-/* Dequeue from the given queue and return the dequeued node. */
-node_t *dequeue(queue_t *queue, pthread_rwlock_t lock) {
-	if (is_empty(queue)) {
-		return NULL;
-	}
-
-	pthread_rwlock_wrlock(&lock);
+/*
+ * Return the shard responsible for a key with the given hash. Shards are
+ * picked by the high bits, since the bins within a shard use the low ones.
+ */
+static shard_t *get_shard(cache_t *cache, uint64_t key_hash) {
+	return &cache->shards[(key_hash >> 32) % cache->num_shards];
+}
 
-	// if there is only one item in the queue, set the front to NULL and return
-	// the item
-	if (queue->front == queue->back) {
-		node_t *temp = queue->front;
-		queue->front = NULL;
-		pthread_rwlock_unlock(&lock);
-		return temp;
-	}
-	
-	node_t *temp = queue->back;
-	temp = temp->prev;
+/* Return a node's chunks to its shard's slab. */
+static void free_node(node_t *node) {
+	slab_t *slab = node->shard->slab;
+	slab_put(slab, node->data);
+	slab_put(slab, node);
+}
 
-	if (temp != NULL) {
-		temp->next = NULL;
-	}
-	queue->size--;
-	pthread_rwlock_unlock(&lock);
-	return temp;
+bool is_empty(queue_t *queue) {
+	return queue->back == NULL;
 }
 
-/* Move the given node to the front of the given queue. */
-void queue_update(cache_t *cache, node_t *node) {
-	pthread_rwlock_wrlock(&cache->lock);
-	if (node == cache->queue->front) {
-		// no updating necessary
-		pthread_rwlock_unlock(&cache->lock);
-		return;
+/*
+ * Unlink the given node from wherever it is in the queue. The caller must
+ * hold the shard's lock.
+ */
+void queue_remove(queue_t *queue, node_t *node) {
+	if (node->prev != NULL) {
+		node->prev->next = node->next;
+	}
+	else {
+		queue->front = node->next;
 	}
-	node->prev->next = node->next;
 	if (node->next != NULL) {
 		node->next->prev = node->prev;
 	}
-	if (node == cache->queue->back) {
-		cache->queue->back = node->prev;
-		cache->queue->back->next = NULL;
+	else {
+		queue->back = node->prev;
 	}
-	node->next = cache->queue->front;
 	node->prev = NULL;
-	node->next->prev = node;
-	cache->queue->front = node;
-	pthread_rwlock_unlock(&cache->lock);
+	node->next = NULL;
+	queue->size--;
 }
 
-/* Return the value of the node at the front of the queue. */
-buffer_t *peek(cache_t *cache) {
-	return cache->queue->front->value;
+/*
+ * Dequeue from the back of the given queue and return the dequeued node. The
+ * caller must hold the shard's lock.
+ */
+node_t *dequeue(queue_t *queue) {
+	if (is_empty(queue)) {
+		return NULL;
+	}
+	node_t *node = queue->back;
+	queue_remove(queue, node);
+	return node;
 }
 
-/* Enqueue a node on the queue. */
-void enqueue(queue_t *queue, node_t *node, pthread_rwlock_t lock) {
-	pthread_rwlock_wrlock(&lock);
+/*
+ * Enqueue a node at the front of the queue. The caller must hold the shard's
+ * lock.
+ */
+void enqueue(queue_t *queue, node_t *node) {
+	node->prev = NULL;
 	node->next = queue->front;
 	if (is_empty(queue)) {
 		queue->back = node;
-		queue->front = node;
 	}
 	else {
 		queue->front->prev = node;
-		queue->front = node;
 	}
+	queue->front = node;
 	queue->size++;
-	pthread_rwlock_unlock(&lock);
 }
 
-/* Insert a node into the hash table and enqueue it. */
-node_t *cache_insert(cache_t *cache, char *key, buffer_t *value) {
-	pthread_rwlock_wrlock(&cache->lock);
-	node_t *node = init_node(key, value);
-	uint8_t hashed_key = hash(key);
-	node_t *head = cache->hash_table->arr[(int)hashed_key];
+/*
+ * Move the given node to the front of the given queue. The caller must hold
+ * the shard's lock.
+ */
+void queue_update(queue_t *queue, node_t *node) {
+	if (node != queue->front) {
+		queue_remove(queue, node);
+		enqueue(queue, node);
+	}
+}
 
-	// if the buffer is too big, don't cache it
-	if (buffer_length(value) >= MAX_OBJECT_SIZE) {
-		return NULL;
+/* Return the bin of the given array for a key with the given hash. */
+static node_t **bin_for(node_t **arr, size_t capacity, uint64_t key_hash) {
+	return &arr[key_hash & (capacity - 1)];
+}
+
+/* Chain a node onto the front of the given bin. */
+static void bin_push(node_t **bin, node_t *node) {
+	node->hash_table_prev = NULL;
+	node->hash_table_next = *bin;
+	if (*bin != NULL) {
+		(*bin)->hash_table_prev = node;
 	}
-	
-	// if the cache would be over capacity after the insertion, evict
-	// repeat as necessary
-	while (cache->size + buffer_length(value) >= MAX_CACHE_SIZE) { 
-		buffer_t *removed_buffer = cache_remove(cache);
-		cache->size -= buffer_length(removed_buffer);
+	*bin = node;
+}
+
+/*
+ * Move the next few bins of the old array into the new one, freeing the old
+ * array once it is empty. Does nothing unless the table is being rehashed.
+ */
+static void rehash_step(hash_table_t *hash_table) {
+	for (size_t i = 0; i < REHASH_STEP && hash_table->old_arr != NULL; i++) {
+		node_t *node = hash_table->old_arr[hash_table->old_next];
+		while (node != NULL) {
+			node_t *next = node->hash_table_next;
+			bin_push(bin_for(hash_table->arr, hash_table->capacity,
+				node->key_hash), node);
+			node = next;
+		}
+		hash_table->old_arr[hash_table->old_next] = NULL;
+
+		if (++hash_table->old_next == hash_table->old_capacity) {
+			free(hash_table->old_arr);
+			hash_table->old_arr = NULL;
+			hash_table->old_capacity = 0;
+			hash_table->old_next = 0;
+		}
 	}
+}
 
-	if (head == NULL) {
-		cache->hash_table->arr[hashed_key] = node;
+/*
+ * Return the bin a key with the given hash currently lives in: its old bin
+ * if that hasn't been moved yet, or else its bin in the current array.
+ */
+static node_t **hash_table_bin(hash_table_t *hash_table, uint64_t key_hash) {
+	if (hash_table->old_arr != NULL) {
+		size_t old_index = key_hash & (hash_table->old_capacity - 1);
+		if (old_index >= hash_table->old_next) {
+			return &hash_table->old_arr[old_index];
+		}
+	}
+	return bin_for(hash_table->arr, hash_table->capacity, key_hash);
+}
+
+/*
+ * Start doubling the table once it holds more nodes than bins, finishing any
+ * rehash still in progress first.
+ */
+static void hash_table_grow(hash_table_t *hash_table) {
+	if (hash_table->size <= hash_table->capacity) {
+		return;
+	}
+	while (hash_table->old_arr != NULL) {
+		rehash_step(hash_table);
+	}
+
+	hash_table->old_arr = hash_table->arr;
+	hash_table->old_capacity = hash_table->capacity;
+	hash_table->old_next = 0;
+	hash_table->capacity *= 2;
+	hash_table->arr = (node_t **)calloc(hash_table->capacity,
+		sizeof(node_t *));
+	assert(hash_table->arr != NULL);
+}
+
+/* Chain a node into the hash table, growing it if it has gotten too full. */
+static void hash_table_insert(hash_table_t *hash_table, node_t *node) {
+	rehash_step(hash_table);
+	bin_push(hash_table_bin(hash_table, node->key_hash), node);
+	hash_table->size++;
+	hash_table_grow(hash_table);
+}
+
+/* Unlink the given node from the hash table chain it lives in. */
+static void hash_table_remove(hash_table_t *hash_table, node_t *node) {
+	if (node->hash_table_prev != NULL) {
+		node->hash_table_prev->hash_table_next = node->hash_table_next;
 	}
 	else {
-		// collision handling-- we create a chain
-		node_t *head_prev;
-		while (head != NULL) {
-			head_prev = head;
-			head = head->hash_table_next;
+		*hash_table_bin(hash_table, node->key_hash) = node->hash_table_next;
+	}
+	if (node->hash_table_next != NULL) {
+		node->hash_table_next->hash_table_prev = node->hash_table_prev;
+	}
+	node->hash_table_prev = NULL;
+	node->hash_table_next = NULL;
+	hash_table->size--;
+}
+
+/*
+ * Look up the node for the given key in the shard's hash table, comparing
+ * the cached hashes before the keys themselves. The caller must hold the
+ * shard's lock.
+ */
+static node_t *find(shard_t *shard, char *key, uint64_t key_hash) {
+	rehash_step(shard->hash_table);
+	node_t *node = *hash_table_bin(shard->hash_table, key_hash);
+	while (node != NULL &&
+			(node->key_hash != key_hash || strcmp(node->key, key) != 0)) {
+		node = node->hash_table_next;
+	}
+	return node; // NULL if the key is not present
+}
+
+/* Return the sketch counter for a key's hash in the given row. */
+static uint8_t *sketch_count(sketch_t *sketch, uint64_t key_hash, size_t row) {
+	uint64_t step = (key_hash >> 32) | 1;
+	size_t column = (key_hash + row * step) & (sketch->width - 1);
+	return &sketch->counts[row * sketch->width + column];
+}
+
+/* Count a lookup of a key with the given hash, aging the sketch as needed. */
+static void sketch_add(sketch_t *sketch, uint64_t key_hash) {
+	for (size_t row = 0; row < SKETCH_DEPTH; row++) {
+		uint8_t *count = sketch_count(sketch, key_hash, row);
+		if (*count < SKETCH_MAX_COUNT) {
+			(*count)++;
 		}
-		head_prev->hash_table_next = node;
 	}
-	cache->size += buffer_length(value);
-	pthread_rwlock_unlock(&cache->lock);
 
-	enqueue(cache->queue, node, cache->lock);
-	return node;
+	if (++sketch->additions >= 10 * sketch->width) {
+		for (size_t i = 0; i < SKETCH_DEPTH * sketch->width; i++) {
+			sketch->counts[i] /= 2;
+		}
+		sketch->additions /= 2;
+	}
 }
 
-buffer_t *cache_remove(cache_t *cache) {
-	buffer_t *value = cache->queue->back->value;
-	char *key_to_remove = cache->queue->back->key;
-	uint8_t hashed_key = hash(key_to_remove);
-	node_t *node = dequeue(cache->queue, cache->lock);
-	(void)node;
-	free(cache->hash_table->arr[hashed_key]);
-	cache->hash_table->arr[hashed_key] = NULL;
-	return value;
+/* Estimate how often a key with the given hash has been looked up lately. */
+static uint8_t sketch_estimate(sketch_t *sketch, uint64_t key_hash) {
+	uint8_t estimate = SKETCH_MAX_COUNT;
+	for (size_t row = 0; row < SKETCH_DEPTH; row++) {
+		uint8_t count = *sketch_count(sketch, key_hash, row);
+		if (count < estimate) {
+			estimate = count;
+		}
+	}
+	return estimate;
 }
 
 /*
- * If the cache contains the given value, return the corresponding node.
- * Else, return NULL.
+ * Return the queue the node lives in: its segment's queue in a segmented
+ * shard, or the only queue under LRU.
  */
-node_t *contains(cache_t *cache, char *key, pthread_rwlock_t lock) {
-	pthread_rwlock_rdlock(&lock);
+static queue_t *node_queue(shard_t *shard, node_t *node) {
+	return node->is_protected ? shard->protected_queue : shard->queue;
+}
 
-	uint8_t hashed_key = hash(key);
-	node_t *node = cache->hash_table->arr[(int)hashed_key];
-	while (node != NULL) {
-		if (node->key == key) {
-			pthread_rwlock_unlock(&lock);
-			return node;
+/*
+ * Record a hit on the node, which moves it to the front of its queue. In a
+ * segmented shard a hit on probation promotes the node to the protected
+ * segment, demoting that segment's least recently used nodes back to
+ * probation to make room. The caller must hold the shard's lock.
+ */
+static void touch_node(cache_t *cache, shard_t *shard, node_t *node) {
+	if (cache->policy == CACHE_LRU || node->is_protected) {
+		queue_update(node_queue(shard, node), node);
+		return;
+	}
+
+	queue_remove(shard->queue, node);
+	enqueue(shard->protected_queue, node);
+	node->is_protected = true;
+	shard->protected_size += node_size(node);
+	while (shard->protected_size > shard->protected_capacity) {
+		node_t *demoted = dequeue(shard->protected_queue);
+		demoted->is_protected = false;
+		shard->protected_size -= node_size(demoted);
+		enqueue(shard->queue, demoted);
+	}
+}
+
+/*
+ * Return the node to evict after the given one (or the first to evict, if
+ * node is NULL): probation from its back, then the protected segment.
+ */
+static node_t *next_victim(shard_t *shard, node_t *node) {
+	if (node == NULL) {
+		node = shard->queue->back;
+		return node != NULL ? node : shard->protected_queue->back;
+	}
+	if (node->prev != NULL) {
+		return node->prev;
+	}
+	return node->is_protected ? NULL : shard->protected_queue->back;
+}
+
+/*
+ * Decide whether a new node is worth the nodes that would be evicted to make
+ * room for it. Under TinyLFU it is only admitted if it has been looked up
+ * more often than every one of them; the other policies admit everything.
+ * old is the entry the node would replace, or NULL; its room counts as free,
+ * and it is never weighed against the node. The caller must hold the shard's
+ * lock.
+ */
+static bool admit(cache_t *cache, shard_t *shard, node_t *node, size_t size,
+		node_t *old) {
+	if (cache->policy != CACHE_TINYLFU) {
+		return true;
+	}
+
+	uint8_t frequency = sketch_estimate(&shard->sketch, node->key_hash);
+	size_t freed = old != NULL ? node_size(old) : 0;
+	node_t *victim = NULL;
+	while (shard->size - freed + size >= shard->capacity &&
+			(victim = next_victim(shard, victim)) != NULL) {
+		if (victim == old) {
+			continue;
 		}
-		else {
-			node = node->hash_table_next;
+		if (sketch_estimate(&shard->sketch, victim->key_hash) >= frequency) {
+			return false;
 		}
+		freed += node_size(victim);
+	}
+	return true;
+}
+
+/*
+ * Unlink the node from both the hash table and its queue and drop the
+ * cache's reference to it. The caller must hold the shard's lock.
+ */
+static void unlink_node(shard_t *shard, node_t *node) {
+	hash_table_remove(shard->hash_table, node);
+	queue_remove(node_queue(shard, node), node);
+	if (node->is_protected) {
+		shard->protected_size -= node_size(node);
+	}
+	shard->size -= node_size(node);
+	cache_release(node);
+}
+
+/*
+ * Evict the node the shard's policy picks: the least recently used node, on
+ * probation first in a segmented shard. If there is a disk tier and it has no
+ * copy of the node yet, the node is pushed onto *demoted (linked through its
+ * next field) with a reference held, so it can be written out by demote()
+ * once the shard's lock is released. The caller must hold the shard's lock.
+ * The node is only freed once the last reader releases it. Returns how many
+ * bytes were evicted, or 0 if the shard is empty.
+ */
+static size_t shard_remove(shard_t *shard, node_t **demoted) {
+	node_t *node = next_victim(shard, NULL);
+	if (node == NULL) {
+		return 0;
+	}
+	size_t size = node_size(node);
+	shard->evictions++;
+	bool demote = shard->disk != NULL && !node->on_disk;
+	if (demote) {
+		atomic_fetch_add(&node->refs, 1);
+	}
+	unlink_node(shard, node);
+	if (demote) {
+		node->next = *demoted;
+		*demoted = node;
+	}
+	return size;
+}
+
+/*
+ * Write the nodes evicted by shard_remove() to the disk tier, then drop their
+ * references. This blocks on the disk, so the caller must not hold the
+ * shard's lock.
+ */
+static void demote(shard_t *shard, node_t *demoted) {
+	while (demoted != NULL) {
+		node_t *node = demoted;
+		demoted = node->next;
+		node->next = NULL;
+		disk_cache_store(shard->disk, node->key, node->key_hash,
+			node_head(node), node->head_length, node_value(node),
+			node->value_length, node->date, node->expires);
+		cache_release(node);
+	}
+}
+
+/*
+ * Get a chunk of at least size bytes from the shard's slab, evicting entries
+ * while none is free. A chunk bigger than a page needs a run of free pages
+ * next to each other, which evicting in LRU order may take a long time to
+ * open up, so one allocation may only evict entries adding up to
+ * ALLOC_EVICTION_FACTOR times its size, counting a smaller chunk as
+ * ALLOC_EVICTION_MIN bytes. Returns NULL if that doesn't free one up, or the
+ * memory is held by entries being filled or read, in which case the caller
+ * doesn't cache the response. An entry being demoted only frees its memory
+ * once it has been written out, so the shard's lock is dropped for each one.
+ */
+static void *shard_alloc(shard_t *shard, size_t size) {
+	void *chunk = slab_get(shard->slab, size);
+	size_t budget = ALLOC_EVICTION_FACTOR *
+		(size > ALLOC_EVICTION_MIN ? size : ALLOC_EVICTION_MIN);
+	size_t evicted = 0;
+	while (chunk == NULL && evicted < budget) {
+		node_t *demoted = NULL;
+		pthread_mutex_lock(&shard->lock);
+		size_t removed = shard_remove(shard, &demoted);
+		pthread_mutex_unlock(&shard->lock);
+		demote(shard, demoted);
+		if (removed == 0) {
+			break;
+		}
+		evicted += removed;
+		chunk = slab_get(shard->slab, size);
+	}
+	return chunk;
+}
+
+/*
+ * Initialize a node for the given key from the shard's slab, with room for
+ * capacity bytes of value and head. Returns NULL if the slab is out of room.
+ */
+static node_t *init_node(shard_t *shard, char *key, uint64_t key_hash,
+		size_t capacity) {
+	node_t *node = (node_t *)shard_alloc(shard, sizeof(node_t));
+	if (node == NULL) {
+		return NULL;
+	}
+	size_t key_size = strlen(key) + 1;
+	node->data = (uint8_t *)shard_alloc(shard, key_size + capacity);
+	if (node->data == NULL) {
+		slab_put(shard->slab, node);
+		return NULL;
+	}
+	memcpy(node->data, key, key_size);
+	node->key = (char *)node->data;
+	node->key_hash = key_hash;
+	node->data_capacity = slab_chunk_size(shard->slab, node->data);
+	node->value_offset = key_size;
+	node->value_length = 0;
+	node->head_length = 0;
+	node->date = 0;
+	node->expires = 0;
+	node->shard = shard;
+	node->limit = 0;
+	node->is_protected = false;
+	node->on_disk = false;
+	node->prev = NULL;
+	node->next = NULL;
+	node->hash_table_prev = NULL;
+	node->hash_table_next = NULL;
+	atomic_init(&node->refs, 1);
+	return node;
+}
+
+/*
+ * Make room for length more bytes after a reserved node's value and head,
+ * moving them to a chunk at least twice as big if they don't fit. Returns
+ * false if the slab has no such chunk.
+ */
+static bool make_room(node_t *node, size_t length) {
+	size_t used = node->value_offset + node->value_length + node->head_length;
+	if (used + length <= node->data_capacity) {
+		return true;
+	}
+
+	size_t wanted = node->data_capacity * 2;
+	if (wanted < used + length) {
+		wanted = used + length;
 	}
-	pthread_rwlock_unlock(&lock);
-	return node; // NULL in this case
+	slab_t *slab = node->shard->slab;
+	uint8_t *data = (uint8_t *)shard_alloc(node->shard, wanted);
+	if (data == NULL) {
+		return false;
+	}
+	memcpy(data, node->data, used);
+	slab_put(slab, node->data);
+	node->data = data;
+	node->key = (char *)data;
+	node->data_capacity = slab_chunk_size(slab, data);
+	return true;
 }
 
-pthread_rwlock_t get_lock(cache_t *cache) {
-	return cache->lock;
+/*
+ * Reserve a node for the given key, to be filled with cache_append() as the
+ * response body arrives. Lookups don't see the node until cache_commit(), so
+ * the shard's lock is only taken once per response. Returns NULL if a
+ * response of size_hint bytes is too big to cache, or there is no room for
+ * it.
+ */
+node_t *cache_reserve(cache_t *cache, char *key, size_t size_hint) {
+	uint64_t key_hash = hash(key);
+	shard_t *shard = get_shard(cache, key_hash);
+	if (size_hint >= cache->max_object_size || size_hint >= shard->capacity) {
+		return NULL;
+	}
+	node_t *node = init_node(shard, key, key_hash, size_hint);
+	if (node != NULL) {
+		node->limit = cache->max_object_size;
+	}
+	return node;
 }
 
-queue_t *get_queue(cache_t *cache) {
-	return cache->queue;
+/*
+ * Append the next length bytes of the body to a reserved node. Returns false
+ * if the node has grown too big to cache, in which case the caller must
+ * cache_abort() it.
+ */
+bool cache_append(node_t *node, uint8_t *data, size_t length) {
+	if (node->value_length + length >= node->limit ||
+			!make_room(node, length)) {
+		return false;
+	}
+	memcpy(node->data + node->value_offset + node->value_length, data, length);
+	node->value_length += length;
+	return true;
 }
 
-/* 
+/*
+ * Replace the body appended to a reserved node so far with the length bytes
+ * at data, which must be no more than it had (such as a compressed copy),
+ * leaving room for room more bytes, such as the head. If a smaller chunk of
+ * the slab will do, the node moves there, so the memory it no longer needs
+ * can hold other entries.
+ */
+void cache_replace_value(node_t *node, uint8_t *data, size_t length,
+		size_t room) {
+	assert(length <= node->value_length);
+	slab_t *slab = node->shard->slab;
+	uint8_t *smaller = (uint8_t *)slab_get(slab,
+		node->value_offset + length + room);
+	if (smaller != NULL &&
+			slab_chunk_size(slab, smaller) < node->data_capacity) {
+		memcpy(smaller, node->data, node->value_offset);
+		slab_put(slab, node->data);
+		node->data = smaller;
+		node->key = (char *)smaller;
+		node->data_capacity = slab_chunk_size(slab, smaller);
+	}
+	else if (smaller != NULL) {
+		slab_put(slab, smaller);
+	}
+	memcpy(node->data + node->value_offset, data, length);
+	node->value_length = length;
+}
+
+/*
+ * Insert a filled node into its shard's hash table and enqueue it, replacing
+ * any existing entry for its key and evicting entries as the shard's policy
+ * sees fit. Returns false, leaving the node to the caller and any existing
+ * entry in place, if the policy doesn't admit it.
+ */
+static bool link_node(cache_t *cache, shard_t *shard, node_t *node) {
+	size_t size = node_size(node);
+	pthread_mutex_lock(&shard->lock);
+	node_t *old = find(shard, node->key, node->key_hash);
+	if (!admit(cache, shard, node, size, old)) {
+		pthread_mutex_unlock(&shard->lock);
+		return false;
+	}
+	if (old != NULL) {
+		unlink_node(shard, old);
+	}
+
+	// if the shard would be over capacity after the insertion, evict
+	// repeat as necessary, writing the victims to disk after unlocking
+	node_t *demoted = NULL;
+	while (shard->size + size >= shard->capacity) {
+		shard_remove(shard, &demoted);
+	}
+
+	hash_table_insert(shard->hash_table, node);
+	enqueue(shard->queue, node);
+	shard->size += size;
+	pthread_mutex_unlock(&shard->lock);
+	demote(shard, demoted);
+	return true;
+}
+
+/*
+ * Give a reserved node its head and its freshness (see node_date() and
+ * node_expires()), insert it into its shard's hash table, and enqueue it,
+ * evicting entries as the shard's policy sees fit. Any existing entry for the
+ * key is replaced. The cache takes ownership of the node and head either way;
+ * returns false if they were too big to cache or not worth admitting, and
+ * have been freed.
+ */
+bool cache_commit(cache_t *cache, node_t *node, buffer_t *head, time_t date,
+		time_t expires) {
+	shard_t *shard = node->shard;
+	size_t size = node_size(node) + buffer_length(head);
+
+	// if the entry is too big, don't cache it
+	if (size >= cache->max_object_size || size >= shard->capacity ||
+			!make_room(node, buffer_length(head))) {
+		buffer_free(head);
+		free_node(node);
+		return false;
+	}
+	memcpy(node->data + node->value_offset + node->value_length,
+		buffer_data(head), buffer_length(head));
+	node->head_length = buffer_length(head);
+	node->date = date;
+	node->expires = expires;
+	buffer_free(head);
+
+	if (!link_node(cache, shard, node)) {
+		free_node(node);
+		return false;
+	}
+	return true;
+}
+
+/* Drop a reserved node that will not be committed. */
+void cache_abort(node_t *node) {
+	free_node(node);
+}
+
+/*
+ * Replace a committed node, which the server has confirmed is unchanged, with
+ * a copy that has the given head and freshness, and return the copy with a
+ * reference held for the caller. Committed nodes are never modified, since
+ * readers may be sending them. As with promote(), the copy is only linked in
+ * if the shard's policy admits it. Returns NULL if there is no room for the
+ * copy. The cache takes ownership of head either way.
+ */
+node_t *cache_revalidate(cache_t *cache, node_t *node, buffer_t *head,
+		time_t date, time_t expires) {
+	node_t *copy = cache_reserve(cache, node->key,
+		node->value_length + buffer_length(head));
+	if (copy == NULL) {
+		buffer_free(head);
+		return NULL;
+	}
+	if (!cache_append(copy, node_value(node), node->value_length) ||
+			!make_room(copy, buffer_length(head))) {
+		buffer_free(head);
+		cache_abort(copy);
+		return NULL;
+	}
+	memcpy(node_head(copy), buffer_data(head), buffer_length(head));
+	copy->head_length = buffer_length(head);
+	copy->date = date;
+	copy->expires = expires;
+	buffer_free(head);
+
+	atomic_fetch_add(&copy->refs, 1);
+	if (!link_node(cache, copy->shard, copy)) {
+		atomic_fetch_sub(&copy->refs, 1);
+	}
+	return copy;
+}
+
+/*
+ * Copy an entry found in the disk tier back into memory, and return its node
+ * with a reference held for the caller. If the shard's policy doesn't admit
+ * it, the node isn't linked in, and is freed once the caller releases it.
+ * Returns NULL if the key isn't on disk or there is no room for it.
+ */
+static node_t *promote(cache_t *cache, shard_t *shard, char *key,
+		uint64_t key_hash) {
+	disk_object_t object;
+	if (!disk_cache_lookup(shard->disk, key, key_hash, &object)) {
+		return NULL;
+	}
+	size_t size = object.head_length + object.value_length;
+	node_t *node = NULL;
+	if (size < cache->max_object_size && size < shard->capacity) {
+		node = init_node(shard, key, key_hash, size);
+	}
+	if (node != NULL) {
+		memcpy(node_value(node), object.value, object.value_length);
+		node->value_length = object.value_length;
+		memcpy(node_head(node), object.head, object.head_length);
+		node->head_length = object.head_length;
+		node->date = object.date;
+		node->expires = object.expires;
+		node->on_disk = true;
+	}
+	disk_cache_release(shard->disk, &object);
+	if (node == NULL) {
+		return NULL;
+	}
+
+	atomic_fetch_add(&node->refs, 1);
+	if (!link_node(cache, shard, node)) {
+		atomic_fetch_sub(&node->refs, 1);
+	}
+	return node;
+}
+
+/*
+ * If the cache contains the given key, record the hit with the shard's
+ * policy and return its node with a reference held, which must be dropped
+ * with cache_release(). Else, return NULL. Under TinyLFU, misses are counted
+ * too, so a URL that keeps missing earns its way in. A key missing from
+ * memory is looked up in the disk tier, if there is one.
+ */
+node_t *cache_lookup(cache_t *cache, char *key) {
+	uint64_t key_hash = hash(key);
+	shard_t *shard = get_shard(cache, key_hash);
+	pthread_mutex_lock(&shard->lock);
+	node_t *node = find(shard, key, key_hash);
+	if (cache->policy == CACHE_TINYLFU) {
+		sketch_add(&shard->sketch, key_hash);
+	}
+	if (node != NULL) {
+		atomic_fetch_add(&node->refs, 1);
+		touch_node(cache, shard, node);
+	}
+	pthread_mutex_unlock(&shard->lock);
+	if (node == NULL && shard->disk != NULL) {
+		node = promote(cache, shard, key, key_hash);
+	}
+	return node;
+}
+
+/* Drop a reference to the node, freeing it if it was the last one. */
+void cache_release(node_t *node) {
+	if (atomic_fetch_sub(&node->refs, 1) == 1) {
+		free_node(node);
+	}
+}
+
+/* Return the status line and headers stored in the node. */
+uint8_t *node_head(node_t *node) {
+	return node->data + node->value_offset + node->value_length;
+}
+
+/* Return the length of the status line and headers stored in the node. */
+size_t node_head_length(node_t *node) {
+	return node->head_length;
+}
+
+/* Return the value (response body) stored in the node. */
+uint8_t *node_value(node_t *node) {
+	return node->data + node->value_offset;
+}
+
+/* Return the length of the value stored in the node. */
+size_t node_value_length(node_t *node) {
+	return node->value_length;
+}
+
+/*
+ * Return when the response stored in the node was generated, going by our
+ * clock, so its age is the time since then.
+ */
+time_t node_date(node_t *node) {
+	return node->date;
+}
+
+/* Return when the response stored in the node stops being fresh. */
+time_t node_expires(node_t *node) {
+	return node->expires;
+}
+
+/* Return how many bytes the entries in the cache take up. */
+size_t cache_size(cache_t *cache) {
+	size_t size = 0;
+	for (size_t i = 0; i < cache->num_shards; i++) {
+		shard_t *shard = &cache->shards[i];
+		pthread_mutex_lock(&shard->lock);
+		size += shard->size;
+		pthread_mutex_unlock(&shard->lock);
+	}
+	return size;
+}
+
+/* Return how many entries have been evicted from the cache so far. */
+size_t cache_evictions(cache_t *cache) {
+	size_t evictions = 0;
+	for (size_t i = 0; i < cache->num_shards; i++) {
+		shard_t *shard = &cache->shards[i];
+		pthread_mutex_lock(&shard->lock);
+		evictions += shard->evictions;
+		pthread_mutex_unlock(&shard->lock);
+	}
+	return evictions;
+}
+
+/*
  * Iterate through the hash table, freeing each node in the linked list/chain
- * at each index (if it exists). Then, free the hash_table array and then
- * the struct.
+ * at each index (if it exists), finishing any rehash first so every node is
+ * in the current array. Then, free the hash_table array and then the struct.
  */
 void free_hash_table(hash_table_t *hash_table) {
+	while (hash_table->old_arr != NULL) {
+		rehash_step(hash_table);
+	}
 	for (size_t i = 0; i < hash_table->capacity; i++) {
 		node_t *node_to_free = hash_table->arr[i];
 		node_t *next_node_to_free = NULL;
 		while (node_to_free != NULL) {
 			next_node_to_free = node_to_free->hash_table_next;
-			buffer_free(node_to_free->value);
-			free(node_to_free);
+			cache_release(node_to_free);
 			node_to_free = next_node_to_free;
 		}
 	}
@@ -272,10 +1006,20 @@ void free_hash_table(hash_table_t *hash_table) {
 	free(hash_table);
 }
 
-/* Free the hash table, queue, cache, and destroy the lock. */
+/*
+ * Free every shard's hash table, queues, sketch, slab, and lock, then the
+ * cache.
+ */
 void free_cache(cache_t *cache) {
-	free_hash_table(cache->hash_table);
-	free(cache->queue);
-	pthread_rwlock_destroy(&cache->lock);
+	for (size_t i = 0; i < cache->num_shards; i++) {
+		shard_t *shard = &cache->shards[i];
+		free_hash_table(shard->hash_table);
+		slab_free(shard->slab);
+		free(shard->queue);
+		free(shard->protected_queue);
+		free(shard->sketch.counts);
+		pthread_mutex_destroy(&shard->lock);
+	}
+	free(cache->shards);
 	free(cache);
-}
\ No newline at end of file
+}
@@ -2,6 +2,7 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <stdbool.h>
@@ -9,7 +10,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <pthread.h>
@@ -17,101 +21,93 @@
 #include "client_thread.h"
 #include "buffer.h"
 #include "cache.h"
+#include "compress.h"
+#include "dns_cache.h"
+#include "flight.h"
+#include "http.h"
+#include "reader.h"
+#include "stats.h"
 
 #define BUFFER_SIZE 8192
 
-static int open_client_fd(char *hostname, int port, int *err) {
-    int client_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (client_fd < 0) {
-        return -1;
+/* Most bytes moved through the pipe by one splice() call */
+#define SPLICE_SIZE 65536
+
+/* Largest response status line plus headers we are willing to buffer */
+#define MAX_HEAD_SIZE (64 * 1024)
+
+/* When the request the calling worker is serving was read, and whether the
+ * time to its first response byte has been recorded yet.  A worker serves
+ * one request at a time. */
+static _Thread_local uint64_t request_start;
+static _Thread_local bool first_byte_timed;
+
+/* Records the time to the first byte of the current request's response,
+ * unless that has already been done */
+static void time_first_byte(stats_t *stats) {
+    if (!first_byte_timed) {
+        first_byte_timed = true;
+        stats_record(stats, LATENCY_FIRST_BYTE, request_start);
     }
+}
 
-    /* Fill in the server's IP address and port */
-    struct addrinfo *address;
-    char port_str[sizeof("65535")];
-    sprintf(port_str, "%d", port);
-    *err = getaddrinfo(hostname, port_str, NULL, &address);
+static int open_client_fd(dns_cache_t *dns, char *hostname, int port,
+        int *err) {
+    /* Fill in the server's IP addresses, from the cache if possible */
+    dns_addrs_t addrs;
+    *err = dns_cache_resolve(dns, hostname, port, &addrs);
     if (*err != 0) {
         return -2;
     }
 
-    /* Establish a connection with the server */
-    bool success = connect(client_fd, address->ai_addr, address->ai_addrlen) >= 0;
-    freeaddrinfo(address);
-    return success ? client_fd : -1;
-}
-
-/* Writes a string to a file descriptor, returns whether successful */
-static bool write_string(int fd, char *str) {
-    return write(fd, str, strlen(str)) >= 0;
+    /* Establish a connection with the server, trying each address in turn */
+    for (size_t i = 0; i < addrs.count; i++) {
+        int client_fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (client_fd < 0) {
+            return -1;
+        }
+        if (connect(client_fd, (struct sockaddr *) &addrs.addrs[i],
+                addrs.lengths[i]) >= 0) {
+            return client_fd;
+        }
+        close(client_fd);
+    }
+    return -1;
 }
 
-/* Sends a status message to client with the status line specified by
- * status with a message body described by msg.
- * Returns whether successful */
-static bool send_status_code(int client_fd, char *status, char *msg) {
-    char *format =
-        "HTTP/1.0 %s\r\n"
-        "Content-Type: text/html\r\n"
-        "Connection: close\r\n"
-        "\r\n"
-        "<html>"
-            "<head><title>%s</title></head>"
-            "<body>%s</body>"
-        "</html>";
-
-    /* Fill out the response template and send it to the client */
-    char response[strlen(format) + 2 * strlen(status) + strlen(msg)];
-    sprintf(response, format, status, status, msg);
-    return write_string(client_fd, response);
+bool send_status_code(int client_fd, char *status, char *msg) {
+    buffer_t *response = make_status_response(status, msg);
+    bool success = write(client_fd, buffer_data(response),
+        buffer_length(response)) >= 0;
+    buffer_free(response);
+    return success;
 }
 
 /* Opens connection to full_host and returns the file descriptor or
  * returns -1 on error */
-static int open_server_connection(int client_fd, char *full_host) {
+static int open_server_connection(int client_fd, dns_cache_t *dns,
+        char *full_host) {
+    /* Split a copy, so full_host can still name the origin afterwards */
+    char host[strlen(full_host) + 1];
+    strcpy(host, full_host);
     int port;
-    char *port_str = strchr(full_host, ':');
-    if (port_str == NULL) {
-        port = 80;
-    }
-    else {
-        /* Host string was separated into hostname and port */
-        full_host[port_str - full_host] = '\0';
-        port = atoi(port_str + 1);
-        if (port <= 0 || port > 65535) {
-            verbose_printf("Malformed request string: Invalid port\n");
-            return -1;
-        }
+    if (!split_host_port(host, &port)) {
+        return -1;
     }
 
     /* Open connection to requested server */
     int server_error;
-    int server_fd = open_client_fd(full_host, port, &server_error);
+    int server_fd = open_client_fd(dns, host, port, &server_error);
     if (server_fd == -1) {
         verbose_printf("open_client_fd error: %s\n", strerror(errno));
         return -1;
     }
     if (server_fd == -2) {
-        switch (server_error) {
-            case EAI_FAIL:
-            case EAI_NONAME:
-                /* Don't bother checking exit code, since we are returning error
-                 * afterwards anyway */
-                send_status_code(client_fd, "502 Bad Gateway",
-                    "DNS could not resolve address.");
-                return -1;
-            case EAI_AGAIN:
-                /* Don't bother checking exit code, since we are returning error
-                 * afterwards anyway */
-                send_status_code(client_fd, "502 Bad Gateway",
-                    "DNS temporarily could not resolve address.");
-                return -1;
-            case EAI_NODATA:
-                /* Don't bother checking exit code, since we are returning error
-                 * afterwards anyway */
-                send_status_code(client_fd, "502 Bad Gateway",
-                    "DNS could has no network addresses for host.");
-                return -1;
+        char *msg = dns_error_message(server_error);
+        if (msg != NULL) {
+            /* Don't bother checking exit code, since we are returning error
+             * afterwards anyway */
+            send_status_code(client_fd, "502 Bad Gateway", msg);
         }
         verbose_printf("getaddrinfo error: %s\n", gai_strerror(server_error));
         return -1;
@@ -120,112 +116,49 @@ static int open_server_connection(int client_fd, char *full_host) {
     return server_fd;
 }
 
-/* Send get request to server, returns whether successful */
-static bool send_get_header(int server_fd, char *path) {
-    return write_string(server_fd, "GET ") &&
-        write_string(server_fd, path) &&
-        write_string(server_fd, " HTTP/1.0\r\n");
-}
-
-/* Reads a line from fd until a \r\n is reached.  Returns an allocated
- * buffer that must be freed by the user containing the line read in upon
- * success.  Returns NULL on error. */
-static buffer_t *read_full_line(int fd) {
-    buffer_t *line = buffer_create(BUFFER_SIZE);
-
-    /* Read until we reach \r\n */
-    char c = '\0', last_c;
-    do {
-        last_c = c;
-        ssize_t chars_read = read(fd, &c, sizeof(c));
-        if (chars_read <= 0) {
-            if (chars_read < 0) {
-                /* Error occurred */
-                verbose_printf("Read error: %s\n", strerror(errno));
-            }
-            buffer_free(line);
-            return NULL;
-        }
-
-        buffer_append_char(line, c);
-    } while (!(last_c == '\r' && c == '\n'));
-
+/* Reads a line ending in \r\n from the client through its reader.
+ * Returns the '\0'-terminated line, which is only valid until the next
+ * read from the reader, or NULL on error. */
+static char *read_full_line(reader_t *reader) {
+    size_t length;
+    errno = 0;
+    char *line = reader_read_line(reader, &length);
+    if (line == NULL && errno != 0) {
+        verbose_printf("Read error: %s\n", strerror(errno));
+    }
     return line;
 }
 
-static bool starts_with(char *str, char *prefix) {
-    return strncmp(str, prefix, strlen(prefix)) == 0;
-}
-
 /* Produces a GET header from client's GET header
  * Sets *full_host to the 'host:port' string specified in the GET
  * Sets *path to the part of the GET request after the port, excluding
  * the leading /
+ * Sets *keep_alive to whether the client's HTTP version keeps connections
+ * open by default
  * *full_host and *path must be freed by the user if function returns 0.
  * Returns whether successful. */
-static bool make_get_header(int client_fd, char **full_host, char **path) {
+static bool make_get_header(int client_fd, reader_t *reader, char **full_host,
+        char **path, bool *keep_alive) {
     *full_host = NULL;
     *path = NULL;
 
     /* Read the first line (with the GET request) separately */
-    buffer_t *buf = read_full_line(client_fd);
-    if (buf == NULL) {
+    char *line = read_full_line(reader);
+    if (line == NULL) {
         verbose_printf("No request string\n");
         goto MALFORMED_ERROR;
     }
 
-    /* Parse first line.  We are expecting one of a few cases:
-     * GET http://<HOST>/[<PATH>[/]] HTTP/..
-     * GET http://<HOST>:#..#/[<PATH>[/]] HTTP/..
-     *
-     * We reject any other request (and terminate the connection),
-     * because we believe it to be malformed.
-     */
-    char *data = buffer_string(buf);
-	char *saveptr;
-
-	char *prefix = strtok_r(data, " ", &saveptr);
-    char *url     = strtok_r(NULL, " ", &saveptr);
-    char *version = strtok_r(NULL, " ", &saveptr);
-
-	if (prefix == NULL || url == NULL || version == NULL || strtok_r(NULL, " ", &saveptr) != NULL) {
-        verbose_printf("Malformed request string: GET requests have"
-                       " three parts\n");
-        goto MALFORMED_ERROR;
-    }
-    if (strcmp(prefix, "GET") != 0) {
-        verbose_printf("Unsupported request string: This proxy only"
-               " handles GET requests\n");
-        goto NOT_IMPLEMENTED_ERROR;
-    }
-    if (!starts_with(version, "HTTP/")) {
-        verbose_printf("Malformed request string: The third part of the"
-               " GET request should be an HTTP version\n");
-        goto MALFORMED_ERROR;
-    }
-    if (!starts_with(url, "http://")) {
-        verbose_printf("Malformed request string: The URL of the request"
-               " should start with 'http://'\n");
-        goto MALFORMED_ERROR;
-    }
-
-    char *host = url + strlen("http://");
-    /* Allocate path separately so we can free line buffer.
-     * The path starts at the first '/' in the URL.
-     * If there is no '/' (e.g. "http://ucla.edu"), the path is just "/". */
-    char *path_start = strchr(host, '/');
-    *path = strdup(path_start == NULL ? "/" : path_start);
-    assert(*path != NULL);
-
-    /* Copy host, so that we have a separate copy for later */
-    if (path_start != NULL) {
-        *path_start = '\0';
+    /* Parse first line */
+    switch (parse_request_line(line, full_host, path, keep_alive)) {
+        case REQUEST_OK:
+            break;
+        case REQUEST_MALFORMED:
+            goto MALFORMED_ERROR;
+        case REQUEST_NOT_IMPLEMENTED:
+            goto NOT_IMPLEMENTED_ERROR;
     }
-    *full_host = strdup(host);
-    assert(*full_host != NULL);
-    printf("Handling Request: %s%s\n", *full_host, *path);
-
-    buffer_free(buf);
+    verbose_printf("Handling Request: %s%s\n", *full_host, *path);
     return true;
 
     MALFORMED_ERROR:
@@ -243,179 +176,871 @@ static bool make_get_header(int client_fd, char **full_host, char **path) {
         goto ERROR;
 
     ERROR:
-        buffer_free(buf);
         free(*path);
         free(*full_host);
         return false;
 }
 
 /* To be called after make_get_header.  Reads the remaining headers from
- * clientfd and sends them to serverfd after modification as follows:
- *
- * All Keep-Alive headers are dropped
- * Connection headers have their value replaced with 'close'
- * Proxy-Connection headers have their value replaced with 'close'
- * If a Host header is not found, a Host header is added
+ * the client's reader and appends them to headers after modification by
+ * filter_header(), asking the server to keep the connection open and ensuring
+ * the presence of a Host header.  Header lines only live in the reader until
+ * its next read, so they are collected here to be sent in one go by
+ * send_request().  Updates *keep_alive (the default for the client's HTTP
+ * version) to whether the client asked to keep its connection open, and
+ * leaves what else the headers said (such as whether the request is
+ * conditional) in *filter.
  *
  * Returns whether successful
 */
-static bool filter_rest_headers(int client_fd, int server_fd, char *host) {
-    bool sent_host_header = false, sent_connection_header = false;
+static bool filter_rest_headers(reader_t *reader, buffer_t *headers, char *host,
+        bool *keep_alive, header_filter_t *filter) {
+    memset(filter, 0, sizeof(*filter));
+    filter->keep_alive = true;
+    /* The clients whose connections stay open by default are the HTTP/1.1
+     * ones, which can also take a chunked body */
+    filter->accepts_chunked = *keep_alive;
     while (true) {
-        buffer_t *buf = read_full_line(client_fd);
+        char *line = read_full_line(reader);
 
         /* read_full_line() errored out */
-        if (buf == NULL) {
+        if (line == NULL) {
             verbose_printf("Malformed header: Not terminated by new line\n");
             return false;
         }
 
-        char *line = buffer_string(buf);
         /* Detect end of header (make sure we sent host line) */
         if (strcmp(line, "\r\n") == 0) {
-            buffer_free(buf);
             break;
         }
 
-        /* Remove Keep-Alive line */
-        if (starts_with(line, "Keep-Alive:")) {
-            buffer_free(buf);
-            continue;
+        line = filter_header(filter, line);
+        if (line != NULL) {
+            buffer_append_bytes(headers, (uint8_t *) line, strlen(line));
         }
+    }
 
-        /* Deal with host line (if we recieve one */
-        if (starts_with(line, "Host:")) {
-            sent_host_header = true;
-        }
-        /* Connection: * -> Connection: close */
-        else if (starts_with(line, "Connection:")) {
-            line = "Connection: close\r\n";
-            sent_connection_header = 1;
-        }
-        /* Proxy-Connection: * -> Proxy-Connection: close */
-        else if (starts_with(line, "Proxy-Connection:")) {
-            line = "Proxy-Connection: close\r\n";
-        }
+    /* Done with the client's headers. Make sure the necessary headers are
+     * sent */
+    finish_headers(filter, headers, host);
+    *keep_alive = request_keep_alive(filter, *keep_alive);
+    return true;
+}
 
-        /* Send line to server */
-        bool success = write_string(server_fd, line);
-        buffer_free(buf);
-        if (!success) {
+/* Writes length bytes to a file descriptor, retrying on short writes.
+ * Returns whether successful */
+static bool write_all(int fd, uint8_t *data, size_t length) {
+    while (length > 0) {
+        ssize_t bytes_written = write(fd, data, length);
+        if (bytes_written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
             return false;
         }
+        data += bytes_written;
+        length -= bytes_written;
     }
+    return true;
+}
 
-    /* Done sending headers. Make sure the necessary headers were sent */
-    if (!sent_host_header) {
-        bool success = write_string(server_fd, "Host: ") &&
-            write_string(server_fd, host) &&
-            write_string(server_fd, "\r\n");
-        if (!success) {
+/* Writes every byte described by the iovcnt entries of iov to fd, retrying
+ * on short writes.  iov is modified.  Returns whether successful */
+static bool writev_all(int fd, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        ssize_t bytes_written = writev(fd, iov, iovcnt);
+        if (bytes_written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
             return false;
         }
+
+        /* Skip past the fully written entries, then into the partial one */
+        while (iovcnt > 0 && (size_t) bytes_written >= iov->iov_len) {
+            bytes_written -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (uint8_t *) iov->iov_base + bytes_written;
+            iov->iov_len -= bytes_written;
+        }
+    }
+    return true;
+}
+
+/* Sends the GET request line and the filtered headers to the server with a
+ * single writev(), so the whole request leaves in one segment instead of a
+ * syscall per fragment.  Returns whether successful */
+static bool send_request(int server_fd, char *path, buffer_t *headers) {
+    char *get = "GET ";
+    char *version = " HTTP/1.1\r\n";
+    struct iovec iov[] = {
+        { .iov_base = get, .iov_len = strlen(get) },
+        { .iov_base = path, .iov_len = strlen(path) },
+        { .iov_base = version, .iov_len = strlen(version) },
+        { .iov_base = buffer_data(headers), .iov_len = buffer_length(headers) }
+    };
+    return writev_all(server_fd, iov, sizeof(iov) / sizeof(iov[0]));
+}
+
+/* Sends a cached response straight from the cache's memory to the client,
+ * behind headers saying how old it is and whether the connection stays open.
+ * A gzip-compressed body is decompressed first unless the request's headers
+ * (as seen by filter_header()) say the client accepts gzip, and only the
+ * range of the body they ask for, if any, is sent.  Returns whether
+ * successful */
+static bool send_cached_response(int client_fd, stats_t *stats, node_t *node,
+        header_filter_t *request, bool keep_alive) {
+    response_head_t parsed;
+    if (parse_response_head(node_head(node), node_head_length(node),
+            &parsed) <= 0) {
+        return false;
     }
-    if (!sent_connection_header) {
-        if (!write_string(server_fd, "Connection: close\r\n")) {
+
+    time_t age = time(NULL) - node_date(node);
+    if (age < 0) {
+        age = 0;
+    }
+    uint8_t *body = node_value(node);
+    size_t body_length = node_value_length(node);
+    buffer_t *decompressed = NULL;
+    if (parsed.gzip && !request->accepts_gzip) {
+        decompressed = gzip_decompress(body, body_length,
+            MAX_DECOMPRESSED_SIZE);
+        if (decompressed == NULL) {
+            verbose_printf("Malformed compressed body\n");
             return false;
         }
+        body = buffer_data(decompressed);
+        body_length = buffer_length(decompressed);
+    }
+
+    buffer_t *head;
+    size_t first, length;
+    range_result_t range = resolve_range(&request->range, node_head(node),
+        &parsed, decompressed != NULL, body_length, &first, &length);
+    if (range == RANGE_PARTIAL) {
+        head = make_partial_head(node_head(node), &parsed, keep_alive, age,
+            decompressed != NULL, first, length, body_length);
+        body += first;
+        body_length = length;
     }
-    return write_string(server_fd, "\r\n");
+    else if (range == RANGE_UNSATISFIABLE) {
+        head = make_unsatisfiable_response(body_length, keep_alive);
+        body_length = 0;
+    }
+    else if (decompressed != NULL) {
+        head = make_decompressed_head(node_head(node), &parsed, keep_alive,
+            age, body_length);
+    }
+    else {
+        head = make_client_head(node_head(node), &parsed, keep_alive, age);
+    }
+    struct iovec iov[] = {
+        { .iov_base = buffer_data(head), .iov_len = buffer_length(head) },
+        { .iov_base = body, .iov_len = body_length }
+    };
+    time_first_byte(stats);
+    bool success = writev_all(client_fd, iov, sizeof(iov) / sizeof(iov[0]));
+    if (success) {
+        stats_add(stats, STAT_CACHE_BYTES, buffer_length(head) + body_length);
+    }
+    buffer_free(head);
+    buffer_free(decompressed);
+    return success;
 }
 
-/* Sends the server's response to the client.
- * Returns whether successful */
-static bool send_response(int client_fd, int server_fd, char *host, char *path, cache_t *cache) {
-	// construct the key-- the extra bit is for the null terminator
-	char *key = malloc(strlen(host) + strlen(path) + 1);
-	strcpy(key, host);
-	strcat(key, path);
-
-	/*
-	 * If the given value is present in the cache, move it to the front of the
-	 * queue and return true.
-	 */
-	node_t *node = contains(cache, key, get_lock(cache));
-	if (node != NULL) {
-		queue_update(cache, node);
-		buffer_t *buffer = peek(cache);
-		(void)buffer;
-		return true;
-	}
-
-	buffer_t *buffer = buffer_create(BUFFER_SIZE);
-	
-	/* Loop until server sends an EOF */
+/* Copies up to limit bytes (or everything until EOF) from server_fd to
+ * client_fd through a pipe with splice(), so the bytes never leave the
+ * kernel.  Used for responses that can't be cached anyway.  Returns whether
+ * all limit bytes (or everything until EOF) were copied */
+static bool relay_splice(int client_fd, int server_fd, stats_t *stats,
+        size_t limit) {
+    int pipe_fds[2];
+    if (pipe2(pipe_fds, O_CLOEXEC) < 0) {
+        verbose_printf("pipe error: %s\n", strerror(errno));
+        return false;
+    }
+
+    bool success = true;
+    while (limit > 0) {
+        ssize_t bytes_in = splice(server_fd, NULL, pipe_fds[1], NULL,
+            limit < SPLICE_SIZE ? limit : SPLICE_SIZE,
+            SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (bytes_in < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_in <= 0) {
+            /* Server sent EOF, or an error */
+            if (bytes_in < 0) {
+                verbose_printf("splice error: %s\n", strerror(errno));
+            }
+            success = bytes_in == 0 && limit == SIZE_MAX;
+            break;
+        }
+        if (limit != SIZE_MAX) {
+            limit -= bytes_in;
+        }
+
+        /* Drain the pipe into the client before reading more */
+        while (bytes_in > 0) {
+            ssize_t bytes_out = splice(pipe_fds[0], NULL, client_fd, NULL,
+                bytes_in, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (bytes_out < 0 && errno == EINTR) {
+                continue;
+            }
+            if (bytes_out <= 0) {
+                success = false;
+                goto DONE;
+            }
+            bytes_in -= bytes_out;
+            stats_add(stats, STAT_ORIGIN_BYTES, bytes_out);
+        }
+    }
+
+    DONE:
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    return success;
+}
+
+/* Outcome of relaying a response from the server */
+typedef enum {
+    RELAY_REUSABLE,  /* relayed, and the server connection can be reused */
+    RELAY_DONE,      /* relayed, but the server connection must be closed */
+    RELAY_STALE,     /* the server closed the connection without responding */
+    RELAY_ERROR      /* failed partway, so the client must be disconnected */
+} relay_result_t;
+
+/* Reads from server_fd into head until it holds the complete status line
+ * and headers of the response, which are parsed into *parsed */
+static relay_result_t read_response_head(int server_fd, buffer_t *head,
+        response_head_t *parsed) {
     while (true) {
+        int result = parse_response_head(buffer_data(head), buffer_length(head),
+            parsed);
+        if (result > 0) {
+            return RELAY_DONE;
+        }
+        if (result < 0 || buffer_length(head) > MAX_HEAD_SIZE) {
+            verbose_printf("Malformed response headers\n");
+            return RELAY_ERROR;
+        }
+
         uint8_t buf[BUFFER_SIZE];
         ssize_t bytes_read = read(server_fd, buf, sizeof(buf));
+        if (bytes_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read <= 0) {
+            if (bytes_read < 0) {
+                verbose_printf("read error: %s\n", strerror(errno));
+            }
+            /* A pooled connection the server closed before we used it */
+            return buffer_length(head) == 0 ? RELAY_STALE : RELAY_ERROR;
+        }
+        buffer_append_bytes(head, buf, bytes_read);
+    }
+}
+
+/* Relays the body bytes in data to the client and to any followers of the
+ * flight, feeding them to body first so nothing past the end of the body is
+ * sent.  Their payload is appended to *entry (decoded into the scratch
+ * buffer first if the body is chunked), which is aborted and cleared once it
+ * grows too big to cache.  If dechunk, the client is sent the decoded
+ * payload rather than the bytes as they are.  Returns how many bytes
+ * belonged to the body, or -1 on error. */
+static ssize_t relay_body_bytes(int client_fd, flight_t *flight,
+        body_reader_t *body, uint8_t *data, size_t length, node_t **entry,
+        buffer_t *decoded, bool dechunk) {
+    ssize_t used = body_reader_feed(body, data, length, decoded);
+    if (used < 0) {
+        verbose_printf("Malformed response body\n");
+        return -1;
+    }
+    if (*entry != NULL) {
+        bool fits = decoded != NULL
+            ? cache_append(*entry, buffer_data(decoded), buffer_length(decoded))
+            : cache_append(*entry, data, used);
+        if (!fits) {
+            cache_abort(*entry);
+            *entry = NULL;
+        }
+    }
+    if (flight != NULL) {
+        flight_publish_body(flight, data, used);
+    }
+    bool sent = dechunk
+        ? write_all(client_fd, buffer_data(decoded), buffer_length(decoded))
+        : write_all(client_fd, data, used);
+    if (decoded != NULL) {
+        buffer_clear(decoded);
+    }
+    return sent ? used : -1;
+}
+
+/* Answers the client with the stale cache entry the server has just said
+ * is unchanged with a 304 (whose head is in update_data), and stores a copy
+ * with the headers the 304 updated.  If flight isn't NULL, the entry is
+ * published to the requests following it (unless it is compressed, since
+ * their clients may not accept that) and the flight is finished.  request
+ * is what the client's headers asked for.  Returns whether successful */
+static bool send_revalidated(int client_fd, proxy_context_t *ctx,
+        node_t *stale, uint8_t *update_data, response_head_t *update,
+        flight_t *flight, header_filter_t *request, bool keep_alive) {
+    response_head_t cached;
+    if (parse_response_head(node_head(stale), node_head_length(stale),
+            &cached) <= 0) {
+        return false;
+    }
+    buffer_t *head = make_revalidated_head(node_head(stale), &cached,
+        update_data, update);
+    if (parse_response_head(buffer_data(head), buffer_length(head),
+            &cached) <= 0) {
+        buffer_free(head);
+        return false;
+    }
+    time_t date, expires;
+    response_freshness(&cached, time(NULL), &date, &expires);
+
+    /* Without room for the copy, the entry is sent as it was */
+    node_t *node = cache_revalidate(ctx->cache, stale, head, date, expires);
+    stats_add(ctx->stats, STAT_REVALIDATED, 1);
+    if (node == NULL) {
+        node = stale;
+    }
+
+    if (flight != NULL) {
+        if (parse_response_head(node_head(node), node_head_length(node),
+                &cached) > 0 && !cached.gzip &&
+                flight_publish_head(flight, node_head(node), &cached)) {
+            flight_publish_body(flight, node_value(node),
+                node_value_length(node));
+        }
+        flight_finish(flight, true);
+    }
+    bool success = send_cached_response(client_fd, ctx->stats, node,
+        request, keep_alive);
+    if (node != stale) {
+        cache_release(node);
+    }
+    return success;
+}
+
+/* Sends the server's response to the client and stores it in the cache
+ * under key if it is cacheable and small enough.  If stale isn't NULL, the
+ * request asked the server whether that cache entry is still current, and a
+ * 304 is answered with the entry.  If flight isn't NULL, the response is
+ * published to the requests following it too, and the flight is finished
+ * once the response is complete.  The end of the response is found from its
+ * framing, so the server connection can be reused afterwards.  Clears
+ * *keep_alive if the client connection can't stay open after it, because
+ * only closing it will mark the end of the response.  request is what the
+ * client's headers asked for, which decides how a cached entry is sent. */
+static relay_result_t send_response(int client_fd, int server_fd, char *key,
+        proxy_context_t *ctx, node_t *stale, flight_t *flight,
+        header_filter_t *request, bool *keep_alive) {
+    buffer_t *head = buffer_create(BUFFER_SIZE);
+    node_t *entry = NULL;
+    buffer_t *decoded = NULL;
+    response_head_t parsed;
+    relay_result_t result = read_response_head(server_fd, head, &parsed);
+    if (result != RELAY_DONE) {
+        goto DONE;
+    }
+
+    if (stale != NULL && parsed.status == 304) {
+        if (!send_revalidated(client_fd, ctx, stale, buffer_data(head),
+                &parsed, flight, request, *keep_alive)) {
+            result = RELAY_ERROR;
+        }
+        else if (parsed.keep_alive &&
+                buffer_length(head) == parsed.header_length) {
+            result = RELAY_REUSABLE;
+        }
+        goto DONE;
+    }
+
+    /* Forward the status line and headers, with our own say on whether the
+     * client connection stays open.  A client that can't take a chunked body
+     * is sent it decoded, up to the close of its connection. */
+    result = RELAY_ERROR;
+    bool shared = flight != NULL &&
+        flight_publish_head(flight, buffer_data(head), &parsed);
+    bool dechunk = parsed.framing == BODY_CHUNKED && !request->accepts_chunked;
+    *keep_alive &= parsed.framing != BODY_CLOSE && !dechunk;
+    buffer_t *client_head = dechunk
+        ? make_dechunked_head(buffer_data(head), &parsed)
+        : make_client_head(buffer_data(head), &parsed, *keep_alive, -1);
+    time_first_byte(ctx->stats);
+    bool sent = write_all(client_fd, buffer_data(client_head),
+        buffer_length(client_head));
+    stats_add(ctx->stats, STAT_ORIGIN_BYTES, buffer_length(client_head));
+    buffer_free(client_head);
+    if (!sent) {
+        goto DONE;
+    }
+
+    body_reader_t body;
+    body_reader_init(&body, &parsed);
+
+    /*
+     * Fill a cache entry with the payload while relaying it, unless its
+     * headers forbid caching it or it is already known to be too big to.
+     */
+    if (parsed.cacheable) {
+        entry = cache_reserve(ctx->cache, key, parsed.header_length +
+            (parsed.framing == BODY_LENGTH ? parsed.content_length : 0));
+    }
+    if ((entry != NULL || dechunk) && parsed.framing == BODY_CHUNKED) {
+        decoded = buffer_create(BUFFER_SIZE);
+    }
+
+    /* Body bytes that arrived along with the headers */
+    size_t extra = buffer_length(head) - parsed.header_length;
+    ssize_t used = relay_body_bytes(client_fd, flight, &body,
+        buffer_data(head) + parsed.header_length, extra, &entry, decoded,
+        dechunk);
+    if (used < 0) {
+        goto DONE;
+    }
+    stats_add(ctx->stats, STAT_ORIGIN_BYTES, used);
+    bool leftover = (size_t) used < extra;
+
+    /* An uncacheable body that doesn't need parsing and that nobody else
+     * needs a copy of is spliced */
+    if (entry == NULL && !shared && !body.done &&
+            parsed.framing != BODY_CHUNKED) {
+        size_t limit = parsed.framing == BODY_LENGTH ? body.remaining : SIZE_MAX;
+        if (relay_splice(client_fd, server_fd, ctx->stats, limit)) {
+            body.done = true;
+            result = parsed.framing == BODY_LENGTH && parsed.keep_alive
+                ? RELAY_REUSABLE : RELAY_DONE;
+        }
+        goto DONE;
+    }
+
+    /* Loop until the body ends */
+    while (!body.done) {
+        uint8_t buf[BUFFER_SIZE];
+        size_t want = sizeof(buf);
+        if (parsed.framing == BODY_LENGTH && body.remaining < want) {
+            want = body.remaining;
+        }
+        ssize_t bytes_read = read(server_fd, buf, want);
+        if (bytes_read < 0 && errno == EINTR) {
+            continue;
+        }
         if (bytes_read < 0) {
             verbose_printf("read error: %s\n", strerror(errno));
-            return false;
+            goto DONE;
         }
 
-        /* Server sent EOF */
+        /* Server sent EOF, which only ends a body without other framing */
         if (bytes_read == 0) {
-            return true;
+            if (parsed.framing != BODY_CLOSE) {
+                verbose_printf("Response ended early\n");
+                goto DONE;
+            }
+            body.done = true;
+            break;
         }
 
-        ssize_t bytes_written = write(client_fd, buf, bytes_read);
-        if (bytes_written < 0) {
+        used = relay_body_bytes(client_fd, flight, &body, buf, bytes_read,
+            &entry, decoded, dechunk);
+        if (used < 0) {
+            goto DONE;
+        }
+        stats_add(ctx->stats, STAT_ORIGIN_BYTES, used);
+        leftover |= used < bytes_read;
+    }
+
+    /*
+     * The whole response has been read, so commit its entry to the cache,
+     * where every other client thread can see it, compressing it first if
+     * the proxy stores text compressed.
+     */
+    if (entry != NULL) {
+        time_t date, expires;
+        response_freshness(&parsed, time(NULL), &date, &expires);
+        buffer_t *cached_head = ctx->compress
+            ? compress_entry(entry, buffer_data(head), &parsed)
+            : make_cached_head(buffer_data(head), &parsed,
+                node_value_length(entry));
+        cache_commit(ctx->cache, entry, cached_head, date, expires);
+        entry = NULL;
+    }
+    if (flight != NULL) {
+        flight_finish(flight, true);
+    }
+
+    /* A server that sent more than the response can't be trusted with
+     * another request */
+    result = parsed.keep_alive && !leftover ? RELAY_REUSABLE : RELAY_DONE;
+
+    DONE:
+    if (entry != NULL) {
+        cache_abort(entry);
+    }
+    buffer_free(decoded);
+    buffer_free(head);
+    return result;
+}
+
+/* Fetches path from origin over a pooled connection if one is idle, or a new
+ * one otherwise, and relays the response to the client (see
+ * send_response() for stale, flight, request and keep_alive).  A pooled
+ * connection may have been closed by the server in the meantime, in which
+ * case the request is retried once on a new connection.  Returns whether
+ * successful */
+static bool fetch_from_origin(int client_fd, proxy_context_t *ctx,
+        char *origin, char *path, buffer_t *headers, char *key,
+        node_t *stale, flight_t *flight, header_filter_t *request,
+        bool *keep_alive) {
+    for (int attempt = 0; attempt < 2; attempt++) {
+        int server_fd = attempt == 0 ? origin_pool_get(ctx->pool, origin) : -1;
+        bool pooled = server_fd >= 0;
+        if (!pooled) {
+            /* Establish connection with requested server */
+            server_fd = open_server_connection(client_fd, ctx->dns, origin);
+            if (server_fd < 0) {
+                return false;
+            }
+        }
+
+        /* Send GET request to server */
+        if (!send_request(server_fd, path, headers)) {
+            verbose_printf("send_request error: %s\n", strerror(errno));
+            close(server_fd);
+            if (pooled) {
+                continue;
+            }
             return false;
         }
-		else {
-			/*
-			 * If the given value is not present in the hash table, add a 
-			 * corresponding node to the hash table. Then, move the node that
-			 * contains the value to the front of the queue.
-			 */
-			buffer_append_bytes(buffer, buf, bytes_written);
-			node_t *node = cache_insert(cache, key, buffer);
-			if (node != NULL) {
-				queue_update(cache, node);
-				buffer_t *buffer = peek(cache);
-				(void)buffer;
-			}
-		}
+
+        /* Forward response from server to client, and store the response in
+         * the cache if possible */
+        relay_result_t result = send_response(client_fd, server_fd, key,
+            ctx, stale, flight, request, keep_alive);
+        if (result == RELAY_REUSABLE) {
+            origin_pool_put(ctx->pool, origin, server_fd);
+            return true;
+        }
+        close(server_fd);
+        if (result == RELAY_STALE && pooled) {
+            continue;
+        }
+        if (result != RELAY_DONE) {
+            verbose_printf("send_reponse error: %s\n", strerror(errno));
+        }
+        return result == RELAY_DONE;
     }
+    return false;
 }
 
-void *handle_request(void *cfd) {
-	cache_t *cache = init_cache();
+/* Outcome of following another request's fetch */
+typedef enum {
+    FOLLOW_DONE,      /* the whole response was sent */
+    FOLLOW_FALLBACK,  /* nothing was sent, so fetch the response directly */
+    FOLLOW_ERROR      /* failed partway, so the client must be disconnected */
+} follow_result_t;
 
-    int client_fd = *(int *) cfd;
-    free(cfd);
+/* Sends the client the response fetched by the leader of flight, as it
+ * arrives, decoding a chunked body if the client can't take one (see
+ * send_response()).  Clears *keep_alive if the client connection can't stay
+ * open afterwards. */
+static follow_result_t follow_flight(int client_fd, stats_t *stats,
+        flight_t *flight, bool accepts_chunked, bool *keep_alive) {
+    buffer_t *head = buffer_create(BUFFER_SIZE);
+    buffer_t *decoded = NULL;
+    response_head_t parsed;
+    follow_result_t result = FOLLOW_FALLBACK;
+    if (flight_get_head(flight, head, &parsed, -1) != 0) {
+        goto DONE;
+    }
 
-    char *host = NULL, *path = NULL;
-    if (!make_get_header(client_fd, &host, &path)) {
-        goto CLIENT_ERROR;
+    result = FOLLOW_ERROR;
+    body_reader_t body;
+    body_reader_init(&body, &parsed);
+    if (parsed.framing == BODY_CHUNKED && !accepts_chunked) {
+        decoded = buffer_create(BUFFER_SIZE);
+    }
+    *keep_alive &= parsed.framing != BODY_CLOSE && decoded == NULL;
+    buffer_t *client_head = decoded != NULL
+        ? make_dechunked_head(buffer_data(head), &parsed)
+        : make_client_head(buffer_data(head), &parsed, *keep_alive, -1);
+    time_first_byte(stats);
+    bool sent = write_all(client_fd, buffer_data(client_head),
+        buffer_length(client_head));
+    stats_add(stats, STAT_ORIGIN_BYTES, buffer_length(client_head));
+    buffer_free(client_head);
+    if (!sent) {
+        goto DONE;
     }
 
-    /* Establish connection with requested server */
-    int server_fd = open_server_connection(client_fd, host);
-    if (server_fd < 0) {
-        goto CLIENT_ERROR;
+    size_t offset = 0;
+    while (true) {
+        uint8_t buf[BUFFER_SIZE];
+        ssize_t bytes_read = flight_read(flight, offset, buf, sizeof(buf), -1);
+        if (bytes_read == 0) {
+            result = FOLLOW_DONE;
+            break;
+        }
+        if (bytes_read < 0) {
+            break;
+        }
+        bool sent;
+        if (decoded != NULL) {
+            buffer_clear(decoded);
+            sent = body_reader_feed(&body, buf, bytes_read, decoded) >= 0 &&
+                write_all(client_fd, buffer_data(decoded),
+                    buffer_length(decoded));
+        }
+        else {
+            sent = write_all(client_fd, buf, bytes_read);
+        }
+        if (!sent) {
+            break;
+        }
+        stats_add(stats, STAT_ORIGIN_BYTES, bytes_read);
+        offset += bytes_read;
+    }
+
+    DONE:
+    buffer_free(decoded);
+    buffer_free(head);
+    return result;
+}
+
+/* Checks that the server origin may be sent another request: that it has
+ * fewer fetches under way than it may have, and hasn't been asked for
+ * responses faster than it may be.  This way one slow server can't tie up
+ * every worker.  If it may, takes one of its places, which must be given
+ * back with throttle_release().  Otherwise, tells the client to try again
+ * later.  Returns whether the request may be sent */
+static bool admit_fetch(int client_fd, proxy_context_t *ctx, char *origin) {
+    if (throttle_acquire(ctx->throttle, THROTTLE_ORIGIN, origin)) {
+        if (throttle_take(ctx->throttle, THROTTLE_ORIGIN, origin)) {
+            return true;
+        }
+        throttle_release(ctx->throttle, THROTTLE_ORIGIN, origin);
+    }
+    stats_add(ctx->stats, STAT_THROTTLED, 1);
+    send_status_code(client_fd, "503 Service Unavailable",
+        "The server is busy. Try again later.");
+    return false;
+}
+
+/* Reads one request from the client's reader and answers it.  client is
+ * the client's key for the throttle, or NULL if it isn't limited.  Sets
+ * *keep_alive to whether the client connection can stay open for another
+ * request afterwards.  Returns whether successful */
+static bool serve_request(int client_fd, reader_t *reader, proxy_context_t *ctx,
+        char *client, bool *keep_alive) {
+    char *host = NULL, *path = NULL, *key = NULL;
+    buffer_t *headers = NULL;
+    node_t *stale = NULL;
+    bool success = false, timed = false;
+    if (!make_get_header(client_fd, reader, &host, &path, keep_alive)) {
+        return false;
+    }
+    request_start = stats_now();
+    first_byte_timed = false;
+
+    /* Modify the request headers to keep the server connection open for
+     * reuse and ensure the presence of a Host header */
+    headers = buffer_create(BUFFER_SIZE);
+    header_filter_t filter;
+    if (!filter_rest_headers(reader, headers, host, keep_alive, &filter)) {
+        goto DONE;
+    }
+
+    /* The proxy answers requests for its statistics itself, leaving them out
+     * of the statistics */
+    if (stats_is_request(host, path)) {
+        buffer_t *report = stats_report(ctx->stats, ctx->cache);
+        buffer_t *response = make_text_response(report, *keep_alive);
+        success = write_all(client_fd, buffer_data(response),
+            buffer_length(response));
+        buffer_free(response);
+        buffer_free(report);
+        goto DONE;
+    }
+    stats_add(ctx->stats, STAT_REQUESTS, 1);
+
+    /* A client making requests faster than it may is turned away before
+     * they cost anything */
+    if (client != NULL &&
+            !throttle_take(ctx->throttle, THROTTLE_CLIENT, client)) {
+        stats_add(ctx->stats, STAT_THROTTLED, 1);
+        send_status_code(client_fd, "429 Too Many Requests",
+            "Too many requests from your address. Try again later.");
+        goto DONE;
+    }
+    timed = true;
+
+    key = make_cache_key(host, path);
+
+    /* On a fresh cache hit, answer straight from memory without ever
+     * contacting the server */
+    node_t *node = cache_lookup(ctx->cache, key);
+    if (node != NULL && time(NULL) < node_expires(node)) {
+        stats_add(ctx->stats, STAT_HITS, 1);
+        success = send_cached_response(client_fd, ctx->stats, node,
+            &filter, *keep_alive);
+        cache_release(node);
+        goto DONE;
+    }
+    stats_add(ctx->stats, STAT_MISSES, 1);
+
+    /* A stale entry is kept if the server can be asked whether it is still
+     * current, unless the client is asking a question of its own */
+    if (node != NULL && !filter.conditional) {
+        response_head_t cached;
+        buffer_t *revalidation = NULL;
+        if (parse_response_head(node_head(node), node_head_length(node),
+                &cached) > 0) {
+            revalidation = make_conditional_request(headers, node_head(node),
+                &cached);
+        }
+        if (revalidation != NULL) {
+            buffer_free(headers);
+            headers = revalidation;
+            stale = node;
+            node = NULL;
+        }
+    }
+    if (node != NULL) {
+        cache_release(node);
+    }
+
+    /* If another request is already fetching this URL, follow it instead of
+     * asking the server again.  A conditional or range request, or one with
+     * credentials, may get an answer meant only for its client, so it never
+     * shares its fetch. */
+    flight_t *flight = NULL;
+    if (!filter.conditional && !filter.range.requested &&
+            !filter.credentials) {
+        bool leader;
+        flight = flight_join(ctx->flights, key, filter.accepts_gzip, &leader);
+        if (!leader) {
+            follow_result_t result = follow_flight(client_fd, ctx->stats,
+                flight, filter.accepts_chunked, keep_alive);
+            flight_release(flight);
+            if (result != FOLLOW_FALLBACK) {
+                stats_add(ctx->stats, STAT_COALESCED, 1);
+                success = result == FOLLOW_DONE;
+                goto DONE;
+            }
+            flight = NULL;
+        }
     }
 
-    /* Send GET request to server */
-    if (!send_get_header(server_fd, path)) {
-        goto SERVER_ERROR;
+    if (admit_fetch(client_fd, ctx, host)) {
+        success = fetch_from_origin(client_fd, ctx, host, path, headers, key,
+            stale, flight, &filter, keep_alive);
+        throttle_release(ctx->throttle, THROTTLE_ORIGIN, host);
     }
+    if (flight != NULL) {
+        /* Followers must not wait forever if the fetch failed */
+        flight_finish(flight, false);
+        flight_release(flight);
+    }
+
+    DONE:
+    if (success && timed) {
+        stats_record(ctx->stats, LATENCY_TOTAL, request_start);
+    }
+    if (stale != NULL) {
+        cache_release(stale);
+    }
+    buffer_free(headers);
+    free(host);
+    free(path);
+    free(key);
+    return success;
+}
 
-    /* Modify and send request headers to ensure no persistent connections and
-     * ensure the presence of a Host header */
-    if (!filter_rest_headers(client_fd, server_fd, host)) {
-        verbose_printf("filter_rest_headers error: %s\n", strerror(errno));
-        goto SERVER_ERROR;
+void handle_request(int client_fd, proxy_context_t *ctx, bool resumed) {
+    /* Don't let a client that stops partway through a request tie up a
+     * worker for good */
+    if (!resumed) {
+        struct timeval timeout = {
+            .tv_sec = CLIENT_IDLE_TIMEOUT, .tv_usec = 0
+        };
+        if (setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+                sizeof(timeout)) < 0) {
+            verbose_printf("setsockopt error: %s\n", strerror(errno));
+        }
     }
 
-    /* Forward response from server to client, and store the response in the
-     * cache if possible */
-    if (!send_response(client_fd, server_fd, host, path, cache)) {
-        verbose_printf("send_reponse error: %s\n", strerror(errno));
-        /* Fall through, since we're done anyway */
+    /* Buffers everything read from the client, so pipelined requests wait
+     * there until the responses before them have been sent */
+    reader_t *reader = reader_create(client_fd);
+
+    /* A resumed connection is back because its client sent more, closed it,
+     * or was idle too long, in which case its read side was shut down */
+    if (resumed && !reader_wait(reader)) {
+        close(client_fd);
+        reader_free(reader);
+        stats_add(ctx->stats, STAT_CONNECTIONS, -1);
+        return;
     }
 
-    close(server_fd);
+    /* A client with as many connections open as it may have is turned away
+     * right away.  Whatever it has sent is read before closing, so the
+     * answer isn't lost to a reset.  Parked connections don't count, so a
+     * resumed one takes its place again here. */
+    char key[CLIENT_KEY_SIZE];
+    char *client = throttle_client_key(client_fd, key) ? key : NULL;
+    if (client != NULL &&
+            !throttle_acquire(ctx->throttle, THROTTLE_CLIENT, client)) {
+        stats_add(ctx->stats, STAT_THROTTLED, 1);
+        send_status_code(client_fd, "429 Too Many Requests",
+            "Too many connections from your address. Try again later.");
+        uint8_t discard_buffer[BUFFER_SIZE];
+        if (shutdown(client_fd, SHUT_WR) == 0 &&
+                read(client_fd, discard_buffer, sizeof(discard_buffer)) < 0) {
+            verbose_printf("read error: %s\n", strerror(errno));
+        }
+        close(client_fd);
+        reader_free(reader);
+        if (resumed) {
+            stats_add(ctx->stats, STAT_CONNECTIONS, -1);
+        }
+        return;
+    }
+
+    if (!resumed) {
+        stats_add(ctx->stats, STAT_CONNECTIONS, 1);
+    }
+    bool keep_alive = true;
+    for (bool first = true; keep_alive; first = false) {
+        /* Rather than wait here for the next request, hand an idle
+         * connection to ctx->idle, which gives it back to a worker once the
+         * client sends more.  Its place is given back first, since it may be
+         * resumed right away. */
+        if (!first && ctx->idle != NULL && !reader_has_data(reader)) {
+            reader_free(reader);
+            if (client != NULL) {
+                throttle_release(ctx->throttle, THROTTLE_CLIENT, client);
+            }
+            if (!idle_clients_park(ctx->idle, client_fd)) {
+                close(client_fd);
+                stats_add(ctx->stats, STAT_CONNECTIONS, -1);
+            }
+            return;
+        }
+        /* The client closed its persistent connection between requests */
+        if (!first && !reader_wait(reader)) {
+            break;
+        }
+        if (!serve_request(client_fd, reader, ctx, client, &keep_alive)) {
+            goto CLIENT_ERROR;
+        }
+    }
 
     /* Close the write end of the client socket and wait for it to send EOF. */
     if (shutdown(client_fd, SHUT_WR) < 0) {
@@ -428,18 +1053,18 @@ void *handle_request(void *cfd) {
         goto CLIENT_ERROR;
     }
     close(client_fd);
-
-    free(host);
-    free(path);
-    return NULL;
-
-    SERVER_ERROR:
-        verbose_printf("Error in writing to server\n");
-        close(server_fd);
+    reader_free(reader);
+    stats_add(ctx->stats, STAT_CONNECTIONS, -1);
+    if (client != NULL) {
+        throttle_release(ctx->throttle, THROTTLE_CLIENT, client);
+    }
+    return;
 
     CLIENT_ERROR:
         close(client_fd);
-        free(host);
-        free(path);
-        return NULL;
+        reader_free(reader);
+        stats_add(ctx->stats, STAT_CONNECTIONS, -1);
+        if (client != NULL) {
+            throttle_release(ctx->throttle, THROTTLE_CLIENT, client);
+        }
 }
@@ -0,0 +1,105 @@
+#include "compress.h"
+#include <assert.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <zlib.h>
+
+/* zlib's window bits for the gzip format rather than its own */
+#define GZIP_WINDOW_BITS (15 + 16)
+
+/* Bodies smaller than this aren't worth compressing */
+#define MIN_COMPRESS_SIZE 256
+
+/* Bytes decompressed per inflate() call */
+#define INFLATE_CHUNK 65536
+
+buffer_t *gzip_compress(uint8_t *data, size_t length) {
+    if (length < MIN_COMPRESS_SIZE || length > UINT_MAX) {
+        return NULL;
+    }
+
+    z_stream stream = {0};
+    if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+            GZIP_WINDOW_BITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return NULL;
+    }
+
+    /* Compress in one go into room for just what would be worth keeping,
+     * so running out of room means it isn't */
+    size_t limit = length - length / 8;
+    uint8_t *out = malloc(limit);
+    assert(out != NULL);
+    stream.next_in = data;
+    stream.avail_in = length;
+    stream.next_out = out;
+    stream.avail_out = limit;
+    int result = deflate(&stream, Z_FINISH);
+    size_t compressed_length = stream.total_out;
+    deflateEnd(&stream);
+
+    buffer_t *compressed = NULL;
+    if (result == Z_STREAM_END) {
+        compressed = buffer_create(compressed_length);
+        buffer_append_bytes(compressed, out, compressed_length);
+    }
+    free(out);
+    return compressed;
+}
+
+buffer_t *gzip_decompress(uint8_t *data, size_t length, size_t limit) {
+    if (length > UINT_MAX) {
+        return NULL;
+    }
+
+    z_stream stream = {0};
+    if (inflateInit2(&stream, GZIP_WINDOW_BITS) != Z_OK) {
+        return NULL;
+    }
+    stream.next_in = data;
+    stream.avail_in = length;
+
+    /* A truncated body makes inflate() stop with Z_BUF_ERROR once it has
+     * used up the input */
+    buffer_t *out = buffer_create(length * 4);
+    uint8_t *chunk = malloc(INFLATE_CHUNK);
+    assert(chunk != NULL);
+    int result;
+    do {
+        stream.next_out = chunk;
+        stream.avail_out = INFLATE_CHUNK;
+        result = inflate(&stream, Z_NO_FLUSH);
+        if (result != Z_OK && result != Z_STREAM_END) {
+            break;
+        }
+        buffer_append_bytes(out, chunk, INFLATE_CHUNK - stream.avail_out);
+        if (buffer_length(out) > limit) {
+            result = Z_DATA_ERROR;
+            break;
+        }
+    } while (result != Z_STREAM_END);
+    inflateEnd(&stream);
+    free(chunk);
+
+    if (result != Z_STREAM_END) {
+        buffer_free(out);
+        return NULL;
+    }
+    return out;
+}
+
+buffer_t *compress_entry(node_t *entry, uint8_t *head_data,
+        response_head_t *head) {
+    if (head->compressible) {
+        buffer_t *compressed = gzip_compress(node_value(entry),
+            node_value_length(entry));
+        if (compressed != NULL) {
+            buffer_t *stored = make_compressed_head(head_data, head,
+                buffer_length(compressed));
+            cache_replace_value(entry, buffer_data(compressed),
+                buffer_length(compressed), buffer_length(stored));
+            buffer_free(compressed);
+            return stored;
+        }
+    }
+    return make_cached_head(head_data, head, node_value_length(entry));
+}
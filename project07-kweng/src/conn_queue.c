@@ -0,0 +1,93 @@
+#include "conn_queue.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+/* A queued connection */
+typedef struct {
+    int fd;
+    bool resumed;
+} queued_conn_t;
+
+/* Ring buffer of connections guarded by a mutex */
+struct conn_queue_t {
+    queued_conn_t *conns;
+    size_t capacity;
+    size_t head;
+    size_t length;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+};
+
+conn_queue_t *conn_queue_create(size_t capacity) {
+    assert(capacity > 0);
+    conn_queue_t *queue = malloc(sizeof(*queue));
+    assert(queue != NULL);
+    queue->conns = malloc(sizeof(queued_conn_t[capacity]));
+    assert(queue->conns != NULL);
+    queue->capacity = capacity;
+    queue->head = 0;
+    queue->length = 0;
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->not_empty, NULL);
+    pthread_cond_init(&queue->not_full, NULL);
+    return queue;
+}
+
+void conn_queue_free(conn_queue_t *queue) {
+    if (queue == NULL) {
+        return;
+    }
+
+    pthread_cond_destroy(&queue->not_full);
+    pthread_cond_destroy(&queue->not_empty);
+    pthread_mutex_destroy(&queue->lock);
+    free(queue->conns);
+    free(queue);
+}
+
+/* Appends a connection to the queue, which must have room for it.  The
+ * caller must hold the queue's lock. */
+static void append(conn_queue_t *queue, int client_fd, bool resumed) {
+    queued_conn_t *conn =
+        &queue->conns[(queue->head + queue->length) % queue->capacity];
+    conn->fd = client_fd;
+    conn->resumed = resumed;
+    queue->length++;
+    pthread_cond_signal(&queue->not_empty);
+}
+
+bool conn_queue_try_push(conn_queue_t *queue, int client_fd) {
+    pthread_mutex_lock(&queue->lock);
+    if (queue->length == queue->capacity) {
+        pthread_mutex_unlock(&queue->lock);
+        return false;
+    }
+    append(queue, client_fd, false);
+    pthread_mutex_unlock(&queue->lock);
+    return true;
+}
+
+void conn_queue_push_resumed(conn_queue_t *queue, int client_fd) {
+    pthread_mutex_lock(&queue->lock);
+    while (queue->length == queue->capacity) {
+        pthread_cond_wait(&queue->not_full, &queue->lock);
+    }
+    append(queue, client_fd, true);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+int conn_queue_pop(conn_queue_t *queue, bool *resumed) {
+    pthread_mutex_lock(&queue->lock);
+    while (queue->length == 0) {
+        pthread_cond_wait(&queue->not_empty, &queue->lock);
+    }
+    queued_conn_t conn = queue->conns[queue->head];
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->length--;
+    pthread_cond_signal(&queue->not_full);
+    pthread_mutex_unlock(&queue->lock);
+    *resumed = conn.resumed;
+    return conn.fd;
+}
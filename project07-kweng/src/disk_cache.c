@@ -0,0 +1,499 @@
+#include "disk_cache.h"
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/* Size of each segment file.  Objects whose record doesn't fit in one are
+ * never written to disk. */
+#define SEGMENT_SIZE (16 * 1024 * 1024)
+
+/* Initial number of index bins, doubled whenever there are more entries */
+#define INITIAL_BINS 1024
+
+/* Marks the start of every record, so a scan stops at the first byte that
+ * was never written, or at a record in an older layout */
+#define RECORD_MAGIC 0x50584332
+
+/* Records start at multiples of this */
+#define RECORD_ALIGN 8
+
+/* Every record is this header, followed by the key (without its '\0'), the
+ * head, and the value */
+typedef struct {
+    uint32_t magic;
+    uint32_t checksum;      /* FNV-1a of everything after the header */
+    uint64_t key_hash;
+    uint32_t key_length;
+    uint32_t head_length;
+    uint32_t value_length;
+    uint32_t reserved;
+    int64_t date;           /* when the object was generated */
+    int64_t expires;        /* when it stops being fresh */
+} record_header_t;
+
+typedef struct segment_t segment_t;
+typedef struct index_entry_t index_entry_t;
+
+struct segment_t {
+    unsigned id;
+    int fd;
+    uint8_t *map;
+    size_t size;            /* bytes mapped */
+    size_t used;            /* bytes handed out to records so far */
+
+    /* One reference belongs to the tier until the segment is deleted, and
+     * one to every object or write using it */
+    size_t refs;
+    bool deleted;
+    segment_t *next;        /* from oldest to newest */
+};
+
+struct index_entry_t {
+    uint64_t key_hash;
+    segment_t *segment;
+    size_t offset;
+    index_entry_t *next;
+};
+
+/*
+ * One lock covers the index and the list of segments.  It is not held while
+ * a record is written, only while room is made for it and while it is
+ * indexed afterwards.
+ */
+struct disk_cache_t {
+    char *dir;
+    size_t max_segments;
+    pthread_mutex_t lock;
+
+    segment_t *oldest;
+    segment_t *newest;      /* the one records are appended to */
+    size_t num_segments;
+
+    index_entry_t **bins;
+    size_t num_bins;
+    size_t num_entries;
+};
+
+static size_t round_up(size_t size, size_t align) {
+    return (size + align - 1) / align * align;
+}
+
+/* Hash bytes with 32-bit FNV-1a, continuing from hash. */
+static uint32_t checksum(uint32_t hash, uint8_t *data, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        hash ^= data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static record_header_t *record_at(segment_t *segment, size_t offset) {
+    return (record_header_t *) (segment->map + offset);
+}
+
+static size_t record_size(record_header_t *header) {
+    return round_up(sizeof(record_header_t) + (size_t) header->key_length +
+        header->head_length + header->value_length, RECORD_ALIGN);
+}
+
+/* Return whether the record at offset is for key. */
+static bool record_has_key(segment_t *segment, size_t offset, char *key,
+        size_t key_length) {
+    record_header_t *header = record_at(segment, offset);
+    return header->key_length == key_length &&
+        memcmp(header + 1, key, key_length) == 0;
+}
+
+static void segment_path(disk_cache_t *disk, unsigned id, char *path) {
+    snprintf(path, PATH_MAX, "%s/segment-%010u", disk->dir, id);
+}
+
+/* Drop a reference to the segment, unmapping it if it was the last one.
+ * The caller must hold the lock. */
+static void segment_release(segment_t *segment) {
+    if (--segment->refs > 0) {
+        return;
+    }
+    munmap(segment->map, segment->size);
+    close(segment->fd);
+    free(segment);
+}
+
+/* Map the segment file with the given id, creating it if create is set.
+ * Returns NULL on failure. */
+static segment_t *open_segment(disk_cache_t *disk, unsigned id, bool create) {
+    char path[PATH_MAX];
+    segment_path(disk, id, path);
+    int fd = open(path, O_RDWR | O_CLOEXEC | (create ? O_CREAT | O_EXCL : 0),
+        0644);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct stat st;
+    if (create && ftruncate(fd, SEGMENT_SIZE) < 0) {
+        goto ERROR;
+    }
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(record_header_t)) {
+        goto ERROR;
+    }
+    uint8_t *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        goto ERROR;
+    }
+
+    segment_t *segment = calloc(1, sizeof(*segment));
+    assert(segment != NULL);
+    segment->id = id;
+    segment->fd = fd;
+    segment->map = map;
+    segment->size = st.st_size;
+    segment->refs = 1;
+    return segment;
+
+    ERROR:
+    close(fd);
+    if (create) {
+        unlink(path);
+    }
+    return NULL;
+}
+
+/* Return the link pointing at the index entry for the key_length bytes of
+ * key, or at the NULL that ends its bin if there is none.  The caller must
+ * hold the lock. */
+static index_entry_t **find_entry(disk_cache_t *disk, char *key,
+        size_t key_length, uint64_t key_hash) {
+    index_entry_t **link = &disk->bins[key_hash & (disk->num_bins - 1)];
+    while (*link != NULL && ((*link)->key_hash != key_hash ||
+            !record_has_key((*link)->segment, (*link)->offset, key,
+                key_length))) {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+/* Double the number of index bins.  The caller must hold the lock. */
+static void grow_index(disk_cache_t *disk) {
+    size_t num_bins = disk->num_bins * 2;
+    index_entry_t **bins = calloc(num_bins, sizeof(index_entry_t *));
+    assert(bins != NULL);
+    for (size_t i = 0; i < disk->num_bins; i++) {
+        index_entry_t *entry = disk->bins[i];
+        while (entry != NULL) {
+            index_entry_t *next = entry->next;
+            index_entry_t **bin = &bins[entry->key_hash & (num_bins - 1)];
+            entry->next = *bin;
+            *bin = entry;
+            entry = next;
+        }
+    }
+    free(disk->bins);
+    disk->bins = bins;
+    disk->num_bins = num_bins;
+}
+
+/* Point the index entry for the record at offset in segment to it, adding
+ * the entry if there is none.  The caller must hold the lock. */
+static void index_record(disk_cache_t *disk, segment_t *segment,
+        size_t offset) {
+    record_header_t *header = record_at(segment, offset);
+    index_entry_t **link = find_entry(disk, (char *) (header + 1),
+        header->key_length, header->key_hash);
+    bool added = *link == NULL;
+    if (added) {
+        *link = calloc(1, sizeof(index_entry_t));
+        assert(*link != NULL);
+        (*link)->key_hash = header->key_hash;
+    }
+    (*link)->segment = segment;
+    (*link)->offset = offset;
+    if (added && ++disk->num_entries > disk->num_bins) {
+        grow_index(disk);
+    }
+}
+
+/* Delete the oldest segment, along with every index entry pointing into it.
+ * Objects read from it stay mapped until they are released.  The caller
+ * must hold the lock. */
+static void delete_oldest(disk_cache_t *disk) {
+    segment_t *segment = disk->oldest;
+    disk->oldest = segment->next;
+    disk->num_segments--;
+
+    for (size_t i = 0; i < disk->num_bins; i++) {
+        index_entry_t **link = &disk->bins[i];
+        while (*link != NULL) {
+            index_entry_t *entry = *link;
+            if (entry->segment == segment) {
+                *link = entry->next;
+                free(entry);
+                disk->num_entries--;
+            }
+            else {
+                link = &entry->next;
+            }
+        }
+    }
+
+    char path[PATH_MAX];
+    segment_path(disk, segment->id, path);
+    unlink(path);
+    segment->deleted = true;
+    segment_release(segment);
+}
+
+/* Add a segment to the newest end of the list, deleting the oldest ones
+ * while there are too many.  The caller must hold the lock. */
+static void append_segment(disk_cache_t *disk, segment_t *segment) {
+    if (disk->newest != NULL) {
+        disk->newest->next = segment;
+    }
+    else {
+        disk->oldest = segment;
+    }
+    disk->newest = segment;
+    disk->num_segments++;
+    while (disk->num_segments > disk->max_segments) {
+        delete_oldest(disk);
+    }
+}
+
+/* Index every intact record of a segment left by an earlier run.  The scan
+ * stops at the first record that was never (or only partly) written. */
+static void load_segment(disk_cache_t *disk, segment_t *segment) {
+    size_t offset = 0;
+    bool torn = false;
+    while (offset + sizeof(record_header_t) <= segment->size) {
+        record_header_t *header = record_at(segment, offset);
+        if (header->magic == 0) {
+            break;
+        }
+        torn = true;
+        if (header->magic != RECORD_MAGIC ||
+                record_size(header) > segment->size - offset) {
+            break;
+        }
+        size_t length = (size_t) header->key_length + header->head_length +
+            header->value_length;
+        if (checksum(2166136261u, (uint8_t *) (header + 1), length) !=
+                header->checksum) {
+            break;
+        }
+        index_record(disk, segment, offset);
+        offset += record_size(header);
+        torn = false;
+    }
+
+    /* Records can be appended where the scan stopped, unless a torn record
+     * is there */
+    segment->used = torn ? segment->size : offset;
+}
+
+static int compare_ids(const void *a, const void *b) {
+    unsigned x = *(const unsigned *) a, y = *(const unsigned *) b;
+    return x < y ? -1 : x > y;
+}
+
+/* Load the segments an earlier run left in the directory, oldest first.
+ * Returns the id to give the next new segment. */
+static unsigned load_segments(disk_cache_t *disk) {
+    DIR *dir = opendir(disk->dir);
+    if (dir == NULL) {
+        return 0;
+    }
+    unsigned *ids = NULL;
+    size_t num_ids = 0, capacity = 0;
+    struct dirent *dirent;
+    while ((dirent = readdir(dir)) != NULL) {
+        unsigned id;
+        char extra;
+        if (sscanf(dirent->d_name, "segment-%u%c", &id, &extra) != 1) {
+            continue;
+        }
+        if (num_ids == capacity) {
+            capacity = capacity > 0 ? capacity * 2 : 16;
+            ids = realloc(ids, capacity * sizeof(unsigned));
+            assert(ids != NULL);
+        }
+        ids[num_ids++] = id;
+    }
+    closedir(dir);
+    if (num_ids > 0) {
+        qsort(ids, num_ids, sizeof(unsigned), compare_ids);
+    }
+
+    unsigned next_id = 0;
+    for (size_t i = 0; i < num_ids; i++) {
+        segment_t *segment = open_segment(disk, ids[i], false);
+        if (segment != NULL) {
+            load_segment(disk, segment);
+            append_segment(disk, segment);
+        }
+        next_id = ids[i] + 1;
+    }
+    free(ids);
+    return next_id;
+}
+
+disk_cache_t *disk_cache_create(char *dir, size_t capacity) {
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        return NULL;
+    }
+
+    disk_cache_t *disk = calloc(1, sizeof(*disk));
+    assert(disk != NULL);
+    disk->dir = strdup(dir);
+    assert(disk->dir != NULL);
+    disk->max_segments = capacity / SEGMENT_SIZE;
+    if (disk->max_segments < 2) {
+        disk->max_segments = 2;
+    }
+    pthread_mutex_init(&disk->lock, NULL);
+    disk->num_bins = INITIAL_BINS;
+    disk->bins = calloc(disk->num_bins, sizeof(index_entry_t *));
+    assert(disk->bins != NULL);
+
+    /* Keep appending to the newest segment if it has room, so restarts don't
+     * push old segments out */
+    unsigned next_id = load_segments(disk);
+    if (disk->newest != NULL && disk->newest->used < disk->newest->size) {
+        return disk;
+    }
+    segment_t *segment = open_segment(disk, next_id, true);
+    if (segment == NULL) {
+        int err = errno;
+        disk_cache_free(disk);
+        errno = err;
+        return NULL;
+    }
+    append_segment(disk, segment);
+    return disk;
+}
+
+void disk_cache_free(disk_cache_t *disk) {
+    if (disk == NULL) {
+        return;
+    }
+
+    for (size_t i = 0; i < disk->num_bins; i++) {
+        index_entry_t *entry = disk->bins[i];
+        while (entry != NULL) {
+            index_entry_t *next = entry->next;
+            free(entry);
+            entry = next;
+        }
+    }
+    free(disk->bins);
+    segment_t *segment = disk->oldest;
+    while (segment != NULL) {
+        segment_t *next = segment->next;
+        segment_release(segment);
+        segment = next;
+    }
+    pthread_mutex_destroy(&disk->lock);
+    free(disk->dir);
+    free(disk);
+}
+
+bool disk_cache_store(disk_cache_t *disk, char *key, uint64_t key_hash,
+        uint8_t *head, size_t head_length, uint8_t *value, size_t value_length,
+        time_t date, time_t expires) {
+    record_header_t header = {
+        .magic = RECORD_MAGIC,
+        .key_hash = key_hash,
+        .key_length = strlen(key),
+        .head_length = head_length,
+        .value_length = value_length,
+        .date = date,
+        .expires = expires
+    };
+    size_t size = record_size(&header);
+    if (size > SEGMENT_SIZE) {
+        return false;
+    }
+    header.checksum = checksum(checksum(checksum(2166136261u,
+        (uint8_t *) key, header.key_length), head, head_length),
+        value, value_length);
+
+    /* Claim room at the end of the newest segment, starting a new one if it
+     * is full */
+    pthread_mutex_lock(&disk->lock);
+    segment_t *segment = disk->newest;
+    if (segment->used + size > segment->size) {
+        segment_t *next = open_segment(disk, segment->id + 1, true);
+        if (next == NULL) {
+            pthread_mutex_unlock(&disk->lock);
+            return false;
+        }
+        append_segment(disk, next);
+        segment = next;
+    }
+    size_t offset = segment->used;
+    segment->used += size;
+    segment->refs++;
+    pthread_mutex_unlock(&disk->lock);
+
+    struct iovec iov[] = {
+        { .iov_base = &header, .iov_len = sizeof(header) },
+        { .iov_base = key, .iov_len = header.key_length },
+        { .iov_base = head, .iov_len = head_length },
+        { .iov_base = value, .iov_len = value_length }
+    };
+    size_t length = sizeof(header) + header.key_length + head_length +
+        value_length;
+    bool written = pwritev(segment->fd, iov, sizeof(iov) / sizeof(iov[0]),
+        offset) == (ssize_t) length;
+
+    /* Only index the record once all of it is there to be read */
+    pthread_mutex_lock(&disk->lock);
+    if (written && !segment->deleted) {
+        index_record(disk, segment, offset);
+    }
+    else if (!written) {
+        /* A scan of the segment would stop here, so stop appending to it */
+        segment->used = segment->size;
+    }
+    segment_release(segment);
+    pthread_mutex_unlock(&disk->lock);
+    return written;
+}
+
+bool disk_cache_lookup(disk_cache_t *disk, char *key, uint64_t key_hash,
+        disk_object_t *object) {
+    pthread_mutex_lock(&disk->lock);
+    index_entry_t *entry = *find_entry(disk, key, strlen(key), key_hash);
+    if (entry == NULL) {
+        pthread_mutex_unlock(&disk->lock);
+        return false;
+    }
+
+    segment_t *segment = entry->segment;
+    segment->refs++;
+    record_header_t *header = record_at(segment, entry->offset);
+    object->head = (uint8_t *) (header + 1) + header->key_length;
+    object->head_length = header->head_length;
+    object->value = object->head + header->head_length;
+    object->value_length = header->value_length;
+    object->date = header->date;
+    object->expires = header->expires;
+    object->segment = segment;
+    pthread_mutex_unlock(&disk->lock);
+    return true;
+}
+
+void disk_cache_release(disk_cache_t *disk, disk_object_t *object) {
+    pthread_mutex_lock(&disk->lock);
+    segment_release(object->segment);
+    pthread_mutex_unlock(&disk->lock);
+}
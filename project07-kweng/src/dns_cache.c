@@ -0,0 +1,338 @@
+#define _GNU_SOURCE
+
+#include "dns_cache.h"
+#include <assert.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Number of hash bins */
+#define DNS_BINS 256
+
+/* Names remembered before expired ones start being forgotten */
+#define MAX_ENTRIES 4096
+
+/* Seconds a failed lookup is remembered, so a bad name doesn't send every
+ * request to the resolver */
+#define NEGATIVE_TTL 5
+
+typedef struct dns_entry_t dns_entry_t;
+
+struct dns_entry_t {
+    char *name;                 /* 'host:port', the key */
+    char *host;
+    char port[sizeof("65535")];
+
+    /* Whether a lookup has finished at least once, and its latest answer,
+     * which stands until expires */
+    bool resolved;
+    int err;
+    dns_addrs_t addrs;
+    time_t expires;
+
+    /* Whether a lookup is queued or running, and the eventfds to write to
+     * when it finishes */
+    bool resolving;
+    int *notify_fds;
+    size_t num_notify;
+    size_t notify_capacity;
+
+    dns_entry_t *next;          /* hash chain */
+    dns_entry_t *next_job;      /* queue of lookups for the resolver threads */
+};
+
+/*
+ * One lock covers the whole cache.  It is only held to copy an answer in or
+ * out, never across a getaddrinfo() call.
+ */
+struct dns_cache_t {
+    int ttl;
+    pthread_mutex_t lock;
+    pthread_cond_t work;        /* signalled when a lookup is queued */
+    pthread_cond_t done;        /* broadcast when a lookup finishes */
+    dns_entry_t *bins[DNS_BINS];
+    size_t num_entries;
+
+    dns_entry_t *first_job;
+    dns_entry_t *last_job;
+    size_t num_threads;
+    pthread_t *threads;
+    bool stopping;
+};
+
+/* Hash a name into a bin. */
+static size_t name_hash(char *name) {
+    size_t hash = 5381;
+    int c;
+    while ((c = *name++)) {
+        hash = ((hash << 5) + hash) + c;
+    }
+    return hash % DNS_BINS;
+}
+
+static time_t now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+static void free_entry(dns_entry_t *entry) {
+    free(entry->name);
+    free(entry->host);
+    free(entry->notify_fds);
+    free(entry);
+}
+
+/* Queues a lookup of the entry for the resolver threads.  The caller must
+ * hold the lock. */
+static void queue_lookup(dns_cache_t *cache, dns_entry_t *entry) {
+    entry->resolving = true;
+    entry->next_job = NULL;
+    if (cache->last_job != NULL) {
+        cache->last_job->next_job = entry;
+    }
+    else {
+        cache->first_job = entry;
+    }
+    cache->last_job = entry;
+    pthread_cond_signal(&cache->work);
+}
+
+/* Forgets expired names nobody is waiting on, to make room for new ones.
+ * The caller must hold the lock. */
+static void forget_expired(dns_cache_t *cache) {
+    time_t cutoff = now();
+    for (size_t i = 0; i < DNS_BINS; i++) {
+        dns_entry_t **link = &cache->bins[i];
+        while (*link != NULL) {
+            dns_entry_t *entry = *link;
+            if (!entry->resolving && entry->expires <= cutoff) {
+                *link = entry->next;
+                free_entry(entry);
+                cache->num_entries--;
+            }
+            else {
+                link = &entry->next;
+            }
+        }
+    }
+}
+
+/* Finds the entry for host and port, creating it and queuing its first
+ * lookup if it doesn't exist.  The caller must hold the lock. */
+static dns_entry_t *find_entry(dns_cache_t *cache, char *host, int port) {
+    char name[strlen(host) + sizeof(":65535")];
+    sprintf(name, "%s:%d", host, port);
+    size_t bin = name_hash(name);
+    dns_entry_t *entry = cache->bins[bin];
+    while (entry != NULL && strcmp(entry->name, name) != 0) {
+        entry = entry->next;
+    }
+    if (entry != NULL) {
+        return entry;
+    }
+
+    if (cache->num_entries >= MAX_ENTRIES) {
+        forget_expired(cache);
+    }
+    entry = calloc(1, sizeof(*entry));
+    assert(entry != NULL);
+    entry->name = strdup(name);
+    entry->host = strdup(host);
+    assert(entry->name != NULL && entry->host != NULL);
+    sprintf(entry->port, "%d", port);
+    entry->next = cache->bins[bin];
+    cache->bins[bin] = entry;
+    cache->num_entries++;
+    queue_lookup(cache, entry);
+    return entry;
+}
+
+/* Looks up host and port without waiting.  Copies the answer into *addrs
+ * and returns it (0 or a getaddrinfo() error code) if it is usable, or
+ * returns DNS_PENDING and sets *entry_out to the entry being resolved.
+ * The caller must hold the lock. */
+static int lookup(dns_cache_t *cache, char *host, int port, dns_addrs_t *addrs,
+        dns_entry_t **entry_out) {
+    dns_entry_t *entry = find_entry(cache, host, port);
+    *entry_out = entry;
+    bool expired = now() >= entry->expires;
+
+    /* A failure is only trusted until it expires, but addresses that once
+     * worked are used while a fresh lookup runs */
+    if (!entry->resolved || (expired && entry->err != 0)) {
+        if (!entry->resolving) {
+            queue_lookup(cache, entry);
+        }
+        return DNS_PENDING;
+    }
+    if (expired && !entry->resolving) {
+        queue_lookup(cache, entry);
+    }
+    *addrs = entry->addrs;
+    return entry->err;
+}
+
+/* Resolves an entry's name into *addrs with getaddrinfo().  Returns 0 or a
+ * getaddrinfo() error code. */
+static int resolve(char *host, char *port, dns_addrs_t *addrs) {
+    /* Only IPv4, since that is all the proxy connects with */
+    struct addrinfo hints, *result;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    int err = getaddrinfo(host, port, &hints, &result);
+    if (err != 0) {
+        return err;
+    }
+
+    addrs->count = 0;
+    for (struct addrinfo *address = result;
+            address != NULL && addrs->count < DNS_MAX_ADDRS;
+            address = address->ai_next) {
+        memcpy(&addrs->addrs[addrs->count], address->ai_addr,
+            address->ai_addrlen);
+        addrs->lengths[addrs->count] = address->ai_addrlen;
+        addrs->count++;
+    }
+    freeaddrinfo(result);
+    return addrs->count > 0 ? 0 : EAI_NODATA;
+}
+
+/* Resolver thread: runs queued lookups until the cache is freed */
+static void *resolver(void *arg) {
+    dns_cache_t *cache = (dns_cache_t *) arg;
+    pthread_mutex_lock(&cache->lock);
+    while (true) {
+        while (cache->first_job == NULL && !cache->stopping) {
+            pthread_cond_wait(&cache->work, &cache->lock);
+        }
+        if (cache->stopping) {
+            break;
+        }
+        dns_entry_t *entry = cache->first_job;
+        cache->first_job = entry->next_job;
+        if (cache->first_job == NULL) {
+            cache->last_job = NULL;
+        }
+
+        /* The entry can't be forgotten while it is resolving, so its name
+         * stays put while the lock is dropped */
+        pthread_mutex_unlock(&cache->lock);
+        dns_addrs_t addrs;
+        int err = resolve(entry->host, entry->port, &addrs);
+        pthread_mutex_lock(&cache->lock);
+
+        /* Keep serving the old addresses if a refresh fails, but try again
+         * soon */
+        if (err == 0) {
+            entry->addrs = addrs;
+        }
+        if (err == 0 || !entry->resolved || entry->err != 0) {
+            entry->err = err;
+        }
+        entry->resolved = true;
+        entry->resolving = false;
+        entry->expires = now() + (err == 0 ? cache->ttl : NEGATIVE_TTL);
+
+        for (size_t i = 0; i < entry->num_notify; i++) {
+            /* Don't bother checking the result, since writing to an eventfd
+             * only fails if its counter is so full the loop wakes anyway */
+            uint64_t one = 1;
+            ssize_t written = write(entry->notify_fds[i], &one, sizeof(one));
+            (void) written;
+        }
+        entry->num_notify = 0;
+        pthread_cond_broadcast(&cache->done);
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return NULL;
+}
+
+dns_cache_t *dns_cache_create(size_t num_threads, int ttl) {
+    assert(num_threads > 0);
+    dns_cache_t *cache = calloc(1, sizeof(*cache));
+    assert(cache != NULL);
+    cache->ttl = ttl;
+    pthread_mutex_init(&cache->lock, NULL);
+    pthread_cond_init(&cache->work, NULL);
+    pthread_cond_init(&cache->done, NULL);
+    cache->num_threads = num_threads;
+    cache->threads = malloc(num_threads * sizeof(pthread_t));
+    assert(cache->threads != NULL);
+    for (size_t i = 0; i < num_threads; i++) {
+        pthread_create(&cache->threads[i], NULL, resolver, cache);
+    }
+    return cache;
+}
+
+void dns_cache_free(dns_cache_t *cache) {
+    if (cache == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    cache->stopping = true;
+    pthread_cond_broadcast(&cache->work);
+    pthread_mutex_unlock(&cache->lock);
+    for (size_t i = 0; i < cache->num_threads; i++) {
+        pthread_join(cache->threads[i], NULL);
+    }
+    free(cache->threads);
+
+    for (size_t i = 0; i < DNS_BINS; i++) {
+        dns_entry_t *entry = cache->bins[i];
+        while (entry != NULL) {
+            dns_entry_t *next = entry->next;
+            free_entry(entry);
+            entry = next;
+        }
+    }
+    pthread_cond_destroy(&cache->done);
+    pthread_cond_destroy(&cache->work);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache);
+}
+
+int dns_cache_resolve(dns_cache_t *cache, char *host, int port,
+        dns_addrs_t *addrs) {
+    pthread_mutex_lock(&cache->lock);
+    dns_entry_t *entry;
+    int result;
+    while ((result = lookup(cache, host, port, addrs, &entry)) == DNS_PENDING) {
+        pthread_cond_wait(&cache->done, &cache->lock);
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return result;
+}
+
+int dns_cache_try_resolve(dns_cache_t *cache, char *host, int port,
+        dns_addrs_t *addrs, int notify_fd) {
+    pthread_mutex_lock(&cache->lock);
+    dns_entry_t *entry;
+    int result = lookup(cache, host, port, addrs, &entry);
+    if (result == DNS_PENDING) {
+        bool listed = false;
+        for (size_t i = 0; i < entry->num_notify; i++) {
+            listed |= entry->notify_fds[i] == notify_fd;
+        }
+        if (!listed) {
+            if (entry->num_notify == entry->notify_capacity) {
+                entry->notify_capacity = entry->notify_capacity > 0
+                    ? entry->notify_capacity * 2 : 4;
+                entry->notify_fds = realloc(entry->notify_fds,
+                    entry->notify_capacity * sizeof(int));
+                assert(entry->notify_fds != NULL);
+            }
+            entry->notify_fds[entry->num_notify++] = notify_fd;
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return result;
+}
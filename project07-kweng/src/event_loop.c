@@ -0,0 +1,1514 @@
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "event_loop.h"
+#include "buffer.h"
+#include "cache.h"
+#include "client_thread.h"
+#include "compress.h"
+#include "dns_cache.h"
+#include "flight.h"
+#include "http.h"
+#include "origin_pool.h"
+#include "stats.h"
+#include "throttle.h"
+
+#define BUFFER_SIZE 8192
+
+/* Most bytes moved through a pipe by one splice() call */
+#define SPLICE_SIZE 65536
+
+/* Most events handled per epoll_wait() call */
+#define MAX_EVENTS 256
+
+/* Largest request line plus headers we are willing to buffer */
+#define MAX_REQUEST_SIZE (64 * 1024)
+
+/* Largest response status line plus headers we are willing to buffer */
+#define MAX_HEAD_SIZE (64 * 1024)
+
+/* Microseconds a client may take to send its whole request, and a
+ * connection may otherwise go without making progress, before it is closed,
+ * as CLIENT_IDLE_TIMEOUT does for the worker threads */
+#define IDLE_TIMEOUT (CLIENT_IDLE_TIMEOUT * 1000000ULL)
+
+/* Where a connection is in the life of its request */
+typedef enum {
+    READ_REQUEST,    /* reading the request line and headers from the client */
+    RESOLVE_SERVER,  /* waiting for the server's name to be resolved */
+    FOLLOW_FLIGHT,   /* relaying a response another connection is fetching */
+    CONNECT_SERVER,  /* waiting for the non-blocking connect to the server */
+    SEND_REQUEST,    /* writing the rewritten request to the server */
+    RELAY_RESPONSE,  /* copying the server's response to the client */
+    SPLICE_RESPONSE, /* splicing an uncacheable response to the client */
+    SEND_RESPONSE    /* writing a complete (cached or error) response */
+} conn_state_t;
+
+/* What the state machine should do after handling a state */
+typedef enum {
+    STEP_CONTINUE,   /* the state changed, so handle the new one */
+    STEP_WAIT,       /* blocked until epoll reports another event */
+    STEP_CLOSE       /* the connection is finished */
+} step_t;
+
+typedef struct conn_t conn_t;
+
+/* One socket of a connection.  A pointer to it is the epoll user data. */
+typedef struct {
+    conn_t *conn;
+    int fd;
+    uint32_t events; /* events currently registered, or 0 if none */
+} endpoint_t;
+
+struct conn_t {
+    conn_state_t state;
+    endpoint_t client;
+    endpoint_t server;
+
+    /* Request line and headers read from the client, followed by any
+     * pipelined requests, and how many bytes belong to the current one */
+    buffer_t *request;
+    size_t request_length;
+    char *key;
+
+    /* The client's key for the throttle if it is limited, and whether it
+     * already had as many connections open as it may have */
+    bool limited;
+    bool refused;
+    char client_key[CLIENT_KEY_SIZE];
+
+    /* Whether the client connection stays open after the current response,
+     * whether the client accepts gzip-compressed and chunked bodies, and
+     * which bytes of the body it asks for */
+    bool keep_alive;
+    bool accepts_gzip;
+    bool accepts_chunked;
+    byte_range_t range;
+
+    /* When the current request was read, whether it counts towards the
+     * statistics, and whether the first byte of its response is out yet */
+    uint64_t start;
+    bool timed;
+    bool first_byte_sent;
+
+    /* The 'host[:port]' string of the server, whether the fetch from it
+     * holds one of its places in the throttle, and the next connection of
+     * the loop waiting for a name to be resolved or a flight to progress */
+    char *origin;
+    bool admitted;
+    conn_t *next_waiting;
+
+    /* The server's addresses and the next one to try connecting to, whether
+     * the server connection came from the pool, and whether the request is
+     * being retried on a new one because the pooled one had been closed */
+    dns_addrs_t addrs;
+    size_t next_addr;
+    bool pooled;
+    bool retried;
+
+    /* The fetch of this URL in flight, which this connection either leads
+     * (and publishes what the server sends to), or follows (having relayed
+     * flight_offset bytes of its body so far).  shared is set once the
+     * leader knows followers are being sent the response. */
+    flight_t *flight;
+    bool leader;
+    bool shared;
+    size_t flight_offset;
+
+    /* Rewritten request being written to the server */
+    buffer_t *upstream;
+    size_t upstream_sent;
+
+    /* The server's status line and headers once they have arrived, where
+     * its response body ends, and whether it sent anything past that end,
+     * which keeps the connection out of the pool.  dechunk is set if the
+     * client is sent a chunked body decoded, since it can't take chunks. */
+    bool head_parsed;
+    response_head_t head;
+    body_reader_t body;
+    bool leftover;
+    bool dechunk;
+
+    /* Bytes of the response not yet written to the client: a chunk read into
+     * relay, or the rewritten headers in out.  head_data collects the
+     * server's status line and headers as they arrive. */
+    uint8_t relay[BUFFER_SIZE];
+    uint8_t *relay_data;
+    size_t relay_length;
+    size_t relay_sent;
+    buffer_t *head_data;
+
+    /* Cache entry being filled with the body while it is still cacheable,
+     * and scratch space for decoding a chunked body into it */
+    node_t *entry;
+    buffer_t *decoded;
+
+    /* Stale cache entry the request asks the server to revalidate */
+    node_t *stale;
+
+    /* Pipe used to splice uncacheable responses, how many bytes are sitting
+     * in it, and how many are still to come from the server */
+    int pipe_fds[2];
+    size_t piped;
+    size_t splice_left;
+
+    /* Complete response being written to the client: a status message or
+     * the headers of a cached response in out, followed by the cached body
+     * in node, or in inflated if it had to be decompressed */
+    node_t *node;
+    buffer_t *out;
+    buffer_t *inflated;
+    struct iovec out_iov[2];
+    int out_iovcnt;
+
+    /* When the connection times out unless it makes progress, its
+     * neighbours in the loop's list of connections by deadline, and whether
+     * it is parked waiting for the resolver or a flight */
+    uint64_t deadline;
+    conn_t *prev_timer;
+    conn_t *next_timer;
+    bool waiting;
+
+    /* Closed connections are freed once the current batch of events has been
+     * handled, since later events in the batch may still point at them */
+    bool closed;
+    conn_t *next_closed;
+};
+
+typedef struct {
+    int epoll_fd;
+    int listen_fd;
+    cache_t *cache;
+    stats_t *stats;
+    throttle_t *throttle;
+    origin_pool_t *pool;
+    bool compress;
+    conn_t *closed;
+
+    /* Open connections from the earliest deadline to the latest.  Every
+     * deadline is IDLE_TIMEOUT after the time it was set, so appending keeps
+     * them in order.  now is when the current batch of events arrived. */
+    conn_t *timers;
+    conn_t *last_timer;
+    uint64_t now;
+
+    /* The resolver and flight leaders write to wake when a lookup or a
+     * flight some connection of the loop is waiting on makes progress */
+    dns_cache_t *dns;
+    flight_table_t *flights;
+    endpoint_t wake;
+    conn_t *waiting;
+} loop_t;
+
+/* Registers interest in exactly the given events on an endpoint */
+static void set_events(loop_t *loop, endpoint_t *endpoint, uint32_t events) {
+    if (endpoint->fd < 0 || endpoint->events == events) {
+        return;
+    }
+
+    struct epoll_event event;
+    event.events = events;
+    event.data.ptr = endpoint;
+    int op = endpoint->events == 0 ? EPOLL_CTL_ADD
+        : events == 0 ? EPOLL_CTL_DEL
+        : EPOLL_CTL_MOD;
+    if (epoll_ctl(loop->epoll_fd, op, endpoint->fd, &event) < 0) {
+        verbose_printf("epoll_ctl error: %s\n", strerror(errno));
+    }
+    endpoint->events = events;
+}
+
+static conn_t *conn_create(int client_fd) {
+    conn_t *conn = calloc(1, sizeof(*conn));
+    assert(conn != NULL);
+    conn->state = READ_REQUEST;
+    conn->client.conn = conn;
+    conn->client.fd = client_fd;
+    conn->server.conn = conn;
+    conn->server.fd = -1;
+    conn->pipe_fds[0] = -1;
+    conn->pipe_fds[1] = -1;
+    conn->request = buffer_create(BUFFER_SIZE);
+    return conn;
+}
+
+/* Takes the connection off the loop's list of deadlines, if it is on it */
+static void disarm_timer(loop_t *loop, conn_t *conn) {
+    if (conn->prev_timer == NULL && loop->timers != conn) {
+        return;
+    }
+
+    if (conn->prev_timer != NULL) {
+        conn->prev_timer->next_timer = conn->next_timer;
+    }
+    else {
+        loop->timers = conn->next_timer;
+    }
+    if (conn->next_timer != NULL) {
+        conn->next_timer->prev_timer = conn->prev_timer;
+    }
+    else {
+        loop->last_timer = conn->prev_timer;
+    }
+    conn->prev_timer = NULL;
+    conn->next_timer = NULL;
+}
+
+/* Gives the connection until IDLE_TIMEOUT from now to make progress */
+static void arm_timer(loop_t *loop, conn_t *conn) {
+    disarm_timer(loop, conn);
+    conn->deadline = loop->now + IDLE_TIMEOUT;
+    conn->prev_timer = loop->last_timer;
+    if (loop->last_timer != NULL) {
+        loop->last_timer->next_timer = conn;
+    }
+    else {
+        loop->timers = conn;
+    }
+    loop->last_timer = conn;
+}
+
+static void close_endpoint(loop_t *loop, endpoint_t *endpoint) {
+    if (endpoint->fd >= 0) {
+        set_events(loop, endpoint, 0);
+        close(endpoint->fd);
+        endpoint->fd = -1;
+    }
+}
+
+/* Closes both sockets and schedules the connection to be freed */
+static void conn_close(loop_t *loop, conn_t *conn) {
+    if (conn->closed) {
+        return;
+    }
+
+    close_endpoint(loop, &conn->server);
+    if (conn->client.fd >= 0) {
+        /* Let the client see EOF right after the last byte of the response */
+        shutdown(conn->client.fd, SHUT_WR);
+    }
+    close_endpoint(loop, &conn->client);
+    disarm_timer(loop, conn);
+    stats_add(loop->stats, STAT_CONNECTIONS, -1);
+    if (conn->limited) {
+        throttle_release(loop->throttle, THROTTLE_CLIENT, conn->client_key);
+    }
+    conn->closed = true;
+    conn->next_closed = loop->closed;
+    loop->closed = conn;
+}
+
+/* Frees everything belonging to the current request */
+static void conn_clear(loop_t *loop, conn_t *conn) {
+    if (conn->pipe_fds[0] >= 0) {
+        close(conn->pipe_fds[0]);
+        close(conn->pipe_fds[1]);
+        conn->pipe_fds[0] = -1;
+        conn->pipe_fds[1] = -1;
+    }
+    buffer_free(conn->upstream);
+    buffer_free(conn->head_data);
+    buffer_free(conn->decoded);
+    buffer_free(conn->out);
+    buffer_free(conn->inflated);
+    if (conn->entry != NULL) {
+        cache_abort(conn->entry);
+    }
+    if (conn->node != NULL) {
+        cache_release(conn->node);
+    }
+    if (conn->stale != NULL) {
+        cache_release(conn->stale);
+    }
+    free(conn->key);
+    if (conn->admitted) {
+        throttle_release(loop->throttle, THROTTLE_ORIGIN, conn->origin);
+        conn->admitted = false;
+    }
+    free(conn->origin);
+    conn->origin = NULL;
+    if (conn->flight != NULL) {
+        /* Followers must not wait forever if the fetch was cut short */
+        if (conn->leader) {
+            flight_finish(conn->flight, false);
+        }
+        flight_release(conn->flight);
+        conn->flight = NULL;
+    }
+    conn->leader = false;
+    conn->shared = false;
+    conn->flight_offset = 0;
+    conn->upstream = NULL;
+    conn->head_data = NULL;
+    conn->entry = NULL;
+    conn->decoded = NULL;
+    conn->out = NULL;
+    conn->inflated = NULL;
+    conn->node = NULL;
+    conn->stale = NULL;
+    conn->key = NULL;
+}
+
+static void conn_free(loop_t *loop, conn_t *conn) {
+    conn_clear(loop, conn);
+    buffer_free(conn->request);
+    free(conn);
+}
+
+/* Gets a persistent connection ready for the client's next request, keeping
+ * any pipelined bytes that followed the last one */
+static step_t next_request(loop_t *loop, conn_t *conn) {
+    close_endpoint(loop, &conn->server);
+    conn_clear(loop, conn);
+    conn->next_addr = 0;
+    conn->pooled = false;
+    conn->retried = false;
+    conn->head_parsed = false;
+    conn->leftover = false;
+    conn->dechunk = false;
+    conn->relay_length = 0;
+    conn->relay_sent = 0;
+    conn->piped = 0;
+
+    buffer_t *rest = buffer_create(BUFFER_SIZE);
+    buffer_append_bytes(rest, buffer_data(conn->request) + conn->request_length,
+        buffer_length(conn->request) - conn->request_length);
+    buffer_free(conn->request);
+    conn->request = rest;
+    conn->request_length = 0;
+    conn->state = READ_REQUEST;
+    arm_timer(loop, conn);
+    return STEP_CONTINUE;
+}
+
+/* Starts writing a status message to the client, after which the connection
+ * is closed */
+static step_t send_status(conn_t *conn, char *status, char *msg) {
+    conn->keep_alive = false;
+    conn->timed = false;
+    conn->out = make_status_response(status, msg);
+    conn->out_iov[0].iov_base = buffer_data(conn->out);
+    conn->out_iov[0].iov_len = buffer_length(conn->out);
+    conn->out_iovcnt = 1;
+    conn->state = SEND_RESPONSE;
+    return STEP_CONTINUE;
+}
+
+/* Starts writing the statistics report to the client */
+static step_t send_report(loop_t *loop, conn_t *conn) {
+    buffer_t *report = stats_report(loop->stats, loop->cache);
+    conn->out = make_text_response(report, conn->keep_alive);
+    buffer_free(report);
+    conn->out_iov[0].iov_base = buffer_data(conn->out);
+    conn->out_iov[0].iov_len = buffer_length(conn->out);
+    conn->out_iovcnt = 1;
+    conn->state = SEND_RESPONSE;
+    return STEP_CONTINUE;
+}
+
+/* Counts bytes of the current response just written to the client, timing
+ * the first of them.  They came from the cache if a cached response is being
+ * sent. */
+static void count_sent(loop_t *loop, conn_t *conn, size_t bytes) {
+    if (!conn->timed) {
+        return;
+    }
+    if (!conn->first_byte_sent) {
+        conn->first_byte_sent = true;
+        stats_record(loop->stats, LATENCY_FIRST_BYTE, conn->start);
+    }
+    stats_add(loop->stats, conn->node != NULL ? STAT_CACHE_BYTES
+        : STAT_ORIGIN_BYTES, bytes);
+}
+
+/* Parks the connection until the loop's wake eventfd fires.  This is safe
+ * because the connection has no events registered while it waits, so nothing
+ * else can close it. */
+static step_t wait_for_wake(loop_t *loop, conn_t *conn) {
+    set_events(loop, &conn->client, 0);
+    conn->waiting = true;
+    conn->next_waiting = loop->waiting;
+    loop->waiting = conn;
+    return STEP_WAIT;
+}
+
+/* Switches a socket between blocking and non-blocking mode.  The loop's
+ * sockets are non-blocking, but the connections it shares with the worker
+ * threads through the origin pool are kept blocking there. */
+static void set_blocking(int fd, bool blocking) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, blocking ? flags & ~O_NONBLOCK
+            : flags | O_NONBLOCK) < 0) {
+        verbose_printf("fcntl error: %s\n", strerror(errno));
+    }
+}
+
+/* Starts a non-blocking connect to the next of the server's addresses,
+ * skipping those that fail right away.  Answers the client with a 502 once
+ * none are left. */
+static step_t connect_next(conn_t *conn) {
+    while (conn->next_addr < conn->addrs.count) {
+        size_t i = conn->next_addr++;
+        int server_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (server_fd < 0) {
+            return STEP_CLOSE;
+        }
+        int result = connect(server_fd,
+            (struct sockaddr *) &conn->addrs.addrs[i], conn->addrs.lengths[i]);
+        if (result < 0 && errno != EINPROGRESS) {
+            verbose_printf("connect error: %s\n", strerror(errno));
+            close(server_fd);
+            continue;
+        }
+        conn->server.fd = server_fd;
+        conn->state = result < 0 ? CONNECT_SERVER : SEND_REQUEST;
+        return STEP_CONTINUE;
+    }
+    return send_status(conn, "502 Bad Gateway",
+        "Could not connect to server.");
+}
+
+/* RESOLVE_SERVER: takes an idle connection to conn->origin from the pool if
+ * there is one, or else opens a non-blocking connection to it once its name
+ * has been resolved */
+static step_t connect_server(loop_t *loop, conn_t *conn) {
+    char host[strlen(conn->origin) + 1];
+    strcpy(host, conn->origin);
+    int port;
+    if (!split_host_port(host, &port)) {
+        return send_status(conn, "400 Bad Request",
+            "Invalid request sent to proxy.");
+    }
+
+    if (!conn->retried) {
+        int server_fd = origin_pool_get(loop->pool, conn->origin);
+        if (server_fd >= 0) {
+            set_blocking(server_fd, false);
+            conn->server.fd = server_fd;
+            conn->pooled = true;
+            conn->state = SEND_REQUEST;
+            return STEP_CONTINUE;
+        }
+    }
+
+    int err = dns_cache_try_resolve(loop->dns, host, port, &conn->addrs,
+        loop->wake.fd);
+    if (err == DNS_PENDING) {
+        return wait_for_wake(loop, conn);
+    }
+    if (err != 0) {
+        verbose_printf("getaddrinfo error: %s\n", gai_strerror(err));
+        char *msg = dns_error_message(err);
+        return msg != NULL ? send_status(conn, "502 Bad Gateway", msg)
+            : STEP_CLOSE;
+    }
+    conn->next_addr = 0;
+    return connect_next(conn);
+}
+
+/* Sends the request again on a new connection, after the server closed the
+ * pooled one it was sent on without answering */
+static step_t retry_unpooled(loop_t *loop, conn_t *conn) {
+    close_endpoint(loop, &conn->server);
+    conn->pooled = false;
+    conn->retried = true;
+    conn->upstream_sent = 0;
+    buffer_clear(conn->head_data);
+    conn->state = RESOLVE_SERVER;
+    return STEP_CONTINUE;
+}
+
+/* Hands the server connection back to the pool once the response has been
+ * read from it, if the server will take another request on it */
+static void release_server(loop_t *loop, conn_t *conn, bool reusable) {
+    if (conn->server.fd < 0 || !reusable) {
+        return;
+    }
+    set_events(loop, &conn->server, 0);
+    set_blocking(conn->server.fd, true);
+    origin_pool_put(loop->pool, conn->origin, conn->server.fd);
+    conn->server.fd = -1;
+}
+
+/* Starts writing the response in conn->node to the client, behind headers
+ * saying how old it is and whether the connection stays open.  A
+ * gzip-compressed body is decompressed first if the client doesn't accept
+ * it, and only the range of the body the client asks for, if any, is
+ * sent. */
+static step_t send_cached(conn_t *conn) {
+    response_head_t head;
+    if (parse_response_head(node_head(conn->node),
+            node_head_length(conn->node), &head) <= 0) {
+        return STEP_CLOSE;
+    }
+    time_t age = time(NULL) - node_date(conn->node);
+    if (age < 0) {
+        age = 0;
+    }
+    uint8_t *body = node_value(conn->node);
+    size_t body_length = node_value_length(conn->node);
+    if (head.gzip && !conn->accepts_gzip) {
+        conn->inflated = gzip_decompress(body, body_length,
+            MAX_DECOMPRESSED_SIZE);
+        if (conn->inflated == NULL) {
+            verbose_printf("Malformed compressed body\n");
+            return STEP_CLOSE;
+        }
+        body = buffer_data(conn->inflated);
+        body_length = buffer_length(conn->inflated);
+    }
+
+    size_t first, length;
+    range_result_t range = resolve_range(&conn->range, node_head(conn->node),
+        &head, conn->inflated != NULL, body_length, &first, &length);
+    if (range == RANGE_PARTIAL) {
+        conn->out = make_partial_head(node_head(conn->node), &head,
+            conn->keep_alive, age, conn->inflated != NULL, first, length,
+            body_length);
+        body += first;
+        body_length = length;
+    }
+    else if (range == RANGE_UNSATISFIABLE) {
+        conn->out = make_unsatisfiable_response(body_length,
+            conn->keep_alive);
+        body_length = 0;
+    }
+    else if (conn->inflated != NULL) {
+        conn->out = make_decompressed_head(node_head(conn->node), &head,
+            conn->keep_alive, age, body_length);
+    }
+    else {
+        conn->out = make_client_head(node_head(conn->node), &head,
+            conn->keep_alive, age);
+    }
+    conn->out_iov[1].iov_base = body;
+    conn->out_iov[1].iov_len = body_length;
+    conn->out_iov[0].iov_base = buffer_data(conn->out);
+    conn->out_iov[0].iov_len = buffer_length(conn->out);
+    conn->out_iovcnt = 2;
+    conn->state = SEND_RESPONSE;
+    return STEP_CONTINUE;
+}
+
+/* Checks that conn->origin may be sent another request: that it has fewer
+ * fetches under way than it may have, and hasn't been asked for responses
+ * faster than it may be, so one slow server can't tie up every connection.
+ * If it may, takes one of its places until the request is done.  Returns
+ * whether the request may be sent */
+static bool admit_fetch(loop_t *loop, conn_t *conn) {
+    if (!throttle_acquire(loop->throttle, THROTTLE_ORIGIN, conn->origin)) {
+        return false;
+    }
+    if (!throttle_take(loop->throttle, THROTTLE_ORIGIN, conn->origin)) {
+        throttle_release(loop->throttle, THROTTLE_ORIGIN, conn->origin);
+        return false;
+    }
+    conn->admitted = true;
+    return true;
+}
+
+/* READ_REQUEST: buffers the client's request until the blank line that ends
+ * its headers, then answers it from the cache or starts contacting the
+ * server */
+static step_t read_request(loop_t *loop, conn_t *conn) {
+    char *end;
+    while ((end = memmem(buffer_data(conn->request),
+            buffer_length(conn->request), "\r\n\r\n", 4)) == NULL) {
+        if (buffer_length(conn->request) > MAX_REQUEST_SIZE) {
+            verbose_printf("Malformed request: Headers too long\n");
+            return send_status(conn, "400 Bad Request",
+                "Invalid request sent to proxy.");
+        }
+
+        uint8_t buf[BUFFER_SIZE];
+        ssize_t bytes_read = read(conn->client.fd, buf, sizeof(buf));
+        if (bytes_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            set_events(loop, &conn->client, EPOLLIN);
+            return STEP_WAIT;
+        }
+        if (bytes_read <= 0) {
+            /* Error, or the client hung up before finishing its request */
+            return STEP_CLOSE;
+        }
+        buffer_append_bytes(conn->request, buf, bytes_read);
+    }
+    set_events(loop, &conn->client, 0);
+    size_t headers_length = end - (char *) buffer_data(conn->request)
+        + strlen("\r\n");
+    conn->request_length = headers_length + strlen("\r\n");
+
+    /* The headers are parsed as strings, so a NUL among them would hide the
+     * line breaks that were found above */
+    if (memchr(buffer_data(conn->request), '\0', headers_length) != NULL) {
+        verbose_printf("Malformed request: NUL in headers\n");
+        return send_status(conn, "400 Bad Request",
+            "Invalid request sent to proxy.");
+    }
+
+    /* Parse the first line (a copy, since parsing modifies it) */
+    char *data = buffer_string(conn->request);
+    char *line_end = strstr(data, "\r\n") + strlen("\r\n");
+    char *request_line = strndup(data, line_end - data);
+    assert(request_line != NULL);
+    char *host, *path;
+    request_status_t status = parse_request_line(request_line, &host, &path,
+        &conn->keep_alive);
+    free(request_line);
+    if (status == REQUEST_MALFORMED) {
+        return send_status(conn, "400 Bad Request",
+            "Invalid request sent to proxy.");
+    }
+    if (status == REQUEST_NOT_IMPLEMENTED) {
+        return send_status(conn, "501 Not Implemented",
+            "Invalid request sent to proxy.");
+    }
+    conn->key = make_cache_key(host, path);
+
+    /* Rewrite the request for the server, filtering the rest of the headers
+     * one line at a time */
+    conn->upstream = buffer_create(BUFFER_SIZE);
+    char *get = "GET ";
+    char *version = " HTTP/1.1\r\n";
+    buffer_append_bytes(conn->upstream, (uint8_t *) get, strlen(get));
+    buffer_append_bytes(conn->upstream, (uint8_t *) path, strlen(path));
+    buffer_append_bytes(conn->upstream, (uint8_t *) version, strlen(version));
+
+    header_filter_t filter = {0};
+    filter.keep_alive = true;
+    char *header = line_end;
+    char *headers_end = data + headers_length;
+    while (header < headers_end) {
+        char *next = strstr(header, "\r\n") + strlen("\r\n");
+        char *line = filter_header(&filter, header);
+        if (line != NULL) {
+            size_t length = line == header ? (size_t) (next - header)
+                : strlen(line);
+            buffer_append_bytes(conn->upstream, (uint8_t *) line, length);
+        }
+        header = next;
+    }
+    finish_headers(&filter, conn->upstream, host);
+    conn->upstream_sent = 0;
+    /* The clients whose connections stay open by default are the HTTP/1.1
+     * ones, which can also take a chunked body */
+    conn->accepts_chunked = conn->keep_alive;
+    conn->keep_alive = request_keep_alive(&filter, conn->keep_alive);
+    conn->accepts_gzip = filter.accepts_gzip;
+    conn->range = filter.range;
+
+    /* The proxy answers requests for its statistics itself, leaving them out
+     * of the statistics */
+    if (stats_is_request(host, path)) {
+        free(host);
+        free(path);
+        return send_report(loop, conn);
+    }
+    stats_add(loop->stats, STAT_REQUESTS, 1);
+
+    /* A client with too many connections open, or making requests faster
+     * than it may, is turned away before they cost anything */
+    if (conn->refused) {
+        free(host);
+        free(path);
+        stats_add(loop->stats, STAT_THROTTLED, 1);
+        return send_status(conn, "429 Too Many Requests",
+            "Too many connections from your address. Try again later.");
+    }
+    if (conn->limited &&
+            !throttle_take(loop->throttle, THROTTLE_CLIENT, conn->client_key)) {
+        free(host);
+        free(path);
+        stats_add(loop->stats, STAT_THROTTLED, 1);
+        return send_status(conn, "429 Too Many Requests",
+            "Too many requests from your address. Try again later.");
+    }
+    conn->start = stats_now();
+    conn->timed = true;
+    conn->first_byte_sent = false;
+
+    /* On a fresh cache hit, answer straight from memory */
+    conn->node = cache_lookup(loop->cache, conn->key);
+    if (conn->node != NULL && time(NULL) < node_expires(conn->node)) {
+        free(host);
+        free(path);
+        stats_add(loop->stats, STAT_HITS, 1);
+        return send_cached(conn);
+    }
+    stats_add(loop->stats, STAT_MISSES, 1);
+
+    /* A stale entry is kept if the server can be asked whether it is still
+     * current, unless the client is asking a question of its own */
+    if (conn->node != NULL && !filter.conditional) {
+        response_head_t cached;
+        buffer_t *revalidation = NULL;
+        if (parse_response_head(node_head(conn->node),
+                node_head_length(conn->node), &cached) > 0) {
+            revalidation = make_conditional_request(conn->upstream,
+                node_head(conn->node), &cached);
+        }
+        if (revalidation != NULL) {
+            buffer_free(conn->upstream);
+            conn->upstream = revalidation;
+            conn->stale = conn->node;
+            conn->node = NULL;
+        }
+    }
+    if (conn->node != NULL) {
+        cache_release(conn->node);
+        conn->node = NULL;
+    }
+
+    conn->origin = host;
+    free(path);
+
+    /* If another connection is already fetching this URL, follow it instead
+     * of asking the server again.  A conditional or range request, or one
+     * with credentials, may get an answer meant only for its client, so it
+     * never shares its fetch. */
+    if (!filter.conditional && !filter.range.requested &&
+            !filter.credentials) {
+        conn->flight = flight_join(loop->flights, conn->key,
+            filter.accepts_gzip, &conn->leader);
+        if (!conn->leader) {
+            conn->state = FOLLOW_FLIGHT;
+            return STEP_CONTINUE;
+        }
+    }
+    if (!admit_fetch(loop, conn)) {
+        stats_add(loop->stats, STAT_THROTTLED, 1);
+        return send_status(conn, "503 Service Unavailable",
+            "The server is busy. Try again later.");
+    }
+    conn->head_data = buffer_create(BUFFER_SIZE);
+    conn->state = RESOLVE_SERVER;
+    return STEP_CONTINUE;
+}
+
+/* CONNECT_SERVER: waits for the non-blocking connect to finish */
+static step_t finish_connect(loop_t *loop, conn_t *conn) {
+    int err;
+    socklen_t length = sizeof(err);
+    if (getsockopt(conn->server.fd, SOL_SOCKET, SO_ERROR, &err, &length) < 0) {
+        err = errno;
+    }
+    if (err == EINPROGRESS) {
+        set_events(loop, &conn->server, EPOLLOUT);
+        return STEP_WAIT;
+    }
+    if (err != 0) {
+        verbose_printf("connect error: %s\n", strerror(err));
+        close_endpoint(loop, &conn->server);
+        return connect_next(conn);
+    }
+
+    conn->state = SEND_REQUEST;
+    return STEP_CONTINUE;
+}
+
+/* SEND_REQUEST: writes the rewritten request to the server */
+static step_t send_request(loop_t *loop, conn_t *conn) {
+    while (conn->upstream_sent < buffer_length(conn->upstream)) {
+        ssize_t bytes_written = write(conn->server.fd,
+            buffer_data(conn->upstream) + conn->upstream_sent,
+            buffer_length(conn->upstream) - conn->upstream_sent);
+        if (bytes_written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            set_events(loop, &conn->server, EPOLLOUT);
+            return STEP_WAIT;
+        }
+        if (bytes_written < 0 && conn->pooled) {
+            return retry_unpooled(loop, conn);
+        }
+        if (bytes_written < 0) {
+            verbose_printf("Error in writing to server\n");
+            return STEP_CLOSE;
+        }
+        conn->upstream_sent += bytes_written;
+    }
+
+    conn->state = RELAY_RESPONSE;
+    return STEP_CONTINUE;
+}
+
+/* Records how long the current request took, once its whole response has
+ * been sent */
+static void time_response(loop_t *loop, conn_t *conn) {
+    if (conn->timed) {
+        stats_record(loop->stats, LATENCY_TOTAL, conn->start);
+        conn->timed = false;
+    }
+}
+
+/* Called once the whole response has been sent to the client.  Commits it
+ * to the cache if it is still cacheable, in the same normalized form as the
+ * thread-per-connection front end, and pools the server connection if it
+ * can be reused, then waits for the next request or closes the
+ * connection. */
+static step_t finish_response(loop_t *loop, conn_t *conn) {
+    time_response(loop, conn);
+    release_server(loop, conn, conn->head.keep_alive && !conn->leftover);
+    if (conn->entry != NULL) {
+        time_t date, expires;
+        response_freshness(&conn->head, time(NULL), &date, &expires);
+        buffer_t *head = loop->compress
+            ? compress_entry(conn->entry, buffer_data(conn->head_data),
+                &conn->head)
+            : make_cached_head(buffer_data(conn->head_data), &conn->head,
+                node_value_length(conn->entry));
+        cache_commit(loop->cache, conn->entry, head, date, expires);
+        conn->entry = NULL;
+    }
+    if (conn->leader) {
+        flight_finish(conn->flight, true);
+    }
+    return conn->keep_alive ? next_request(loop, conn) : STEP_CLOSE;
+}
+
+/* Feeds the next length bytes read from the server to the body reader, and
+ * appends their payload to the cache entry, aborting it once it grows too big
+ * to cache.  The payload of a chunked body is left in conn->decoded until
+ * the next call.  Returns how many of the bytes belong to the body, or -1 if
+ * it is malformed. */
+static ssize_t take_body_bytes(conn_t *conn, uint8_t *data, size_t length) {
+    if (conn->decoded != NULL) {
+        buffer_clear(conn->decoded);
+    }
+    ssize_t used = body_reader_feed(&conn->body, data, length, conn->decoded);
+    if (used < 0) {
+        verbose_printf("Malformed response body\n");
+        return -1;
+    }
+    if (conn->entry != NULL) {
+        bool fits = conn->decoded != NULL
+            ? cache_append(conn->entry, buffer_data(conn->decoded),
+                buffer_length(conn->decoded))
+            : cache_append(conn->entry, data, used);
+        if (!fits) {
+            cache_abort(conn->entry);
+            conn->entry = NULL;
+        }
+    }
+    if (conn->leader) {
+        flight_publish_body(conn->flight, data, used);
+    }
+    return used;
+}
+
+/* Answers the client with the stale cache entry the server has just said
+ * is unchanged with a 304, and stores a copy with the headers the 304
+ * updated.  Followers of the flight are sent the entry too, unless it is
+ * compressed, since their clients may not accept that. */
+static step_t use_revalidated(loop_t *loop, conn_t *conn) {
+    set_events(loop, &conn->server, 0);
+    release_server(loop, conn, conn->head.keep_alive &&
+        buffer_length(conn->head_data) == conn->head.header_length);
+    response_head_t cached;
+    if (parse_response_head(node_head(conn->stale),
+            node_head_length(conn->stale), &cached) <= 0) {
+        return STEP_CLOSE;
+    }
+    buffer_t *head = make_revalidated_head(node_head(conn->stale), &cached,
+        buffer_data(conn->head_data), &conn->head);
+    if (parse_response_head(buffer_data(head), buffer_length(head),
+            &cached) <= 0) {
+        buffer_free(head);
+        return STEP_CLOSE;
+    }
+    time_t date, expires;
+    response_freshness(&cached, time(NULL), &date, &expires);
+
+    /* Without room for the copy, the entry is sent as it was */
+    conn->node = cache_revalidate(loop->cache, conn->stale, head, date,
+        expires);
+    stats_add(loop->stats, STAT_REVALIDATED, 1);
+    if (conn->node == NULL) {
+        conn->node = conn->stale;
+        conn->stale = NULL;
+    }
+
+    if (conn->leader) {
+        if (parse_response_head(node_head(conn->node),
+                node_head_length(conn->node), &cached) > 0 && !cached.gzip &&
+                flight_publish_head(conn->flight, node_head(conn->node),
+                    &cached)) {
+            flight_publish_body(conn->flight, node_value(conn->node),
+                node_value_length(conn->node));
+        }
+        flight_finish(conn->flight, true);
+    }
+    return send_cached(conn);
+}
+
+/* Handles the next length bytes of the response read into conn->relay.
+ * Until the status line and headers are complete they are only buffered.
+ * After that, the client gets rewritten headers, then just the bytes that
+ * belong to the body (or their payload, if it is being dechunked). */
+static step_t take_response_bytes(loop_t *loop, conn_t *conn, size_t length) {
+    if (conn->head_parsed) {
+        ssize_t used = take_body_bytes(conn, conn->relay, length);
+        if (used < 0) {
+            return STEP_CLOSE;
+        }
+        conn->leftover |= (size_t) used < length;
+        conn->relay_data = conn->dechunk ? buffer_data(conn->decoded)
+            : conn->relay;
+        conn->relay_length = conn->dechunk ? buffer_length(conn->decoded)
+            : (size_t) used;
+        conn->relay_sent = 0;
+        return STEP_CONTINUE;
+    }
+
+    buffer_append_bytes(conn->head_data, conn->relay, length);
+    uint8_t *data = buffer_data(conn->head_data);
+    int result = parse_response_head(data, buffer_length(conn->head_data),
+        &conn->head);
+    if (result < 0 || (result == 0 &&
+            buffer_length(conn->head_data) > MAX_HEAD_SIZE)) {
+        verbose_printf("Malformed response headers\n");
+        return STEP_CLOSE;
+    }
+    if (result == 0) {
+        return STEP_CONTINUE;
+    }
+
+    if (conn->stale != NULL && conn->head.status == 304) {
+        return use_revalidated(loop, conn);
+    }
+
+    /* Send our own headers, followed by any body bytes that arrived with the
+     * server's.  A client that can't take a chunked body is sent it decoded,
+     * up to the close of its connection. */
+    conn->head_parsed = true;
+    body_reader_init(&conn->body, &conn->head);
+    conn->shared = conn->leader &&
+        flight_publish_head(conn->flight, data, &conn->head);
+    conn->dechunk = conn->head.framing == BODY_CHUNKED &&
+        !conn->accepts_chunked;
+    conn->keep_alive &= conn->head.framing != BODY_CLOSE && !conn->dechunk;
+    conn->out = conn->dechunk ? make_dechunked_head(data, &conn->head)
+        : make_client_head(data, &conn->head, conn->keep_alive, -1);
+
+    /* Fill a cache entry with the payload while relaying it, unless its
+     * headers forbid caching it or it is already known to be too big to */
+    if (conn->head.cacheable) {
+        conn->entry = cache_reserve(loop->cache, conn->key,
+            conn->head.header_length + (conn->head.framing == BODY_LENGTH
+                ? conn->head.content_length : 0));
+    }
+    if ((conn->entry != NULL || conn->dechunk) &&
+            conn->head.framing == BODY_CHUNKED) {
+        conn->decoded = buffer_create(BUFFER_SIZE);
+    }
+
+    size_t extra = buffer_length(conn->head_data) - conn->head.header_length;
+    ssize_t used = take_body_bytes(conn, data + conn->head.header_length,
+        extra);
+    if (used < 0) {
+        return STEP_CLOSE;
+    }
+    conn->leftover = (size_t) used < extra;
+    if (conn->dechunk) {
+        buffer_append_bytes(conn->out, buffer_data(conn->decoded),
+            buffer_length(conn->decoded));
+    }
+    else {
+        buffer_append_bytes(conn->out, data + conn->head.header_length, used);
+    }
+    conn->relay_data = buffer_data(conn->out);
+    conn->relay_length = buffer_length(conn->out);
+    conn->relay_sent = 0;
+    return STEP_CONTINUE;
+}
+
+/* RELAY_RESPONSE: copies the response from the server to the client a chunk
+ * at a time, only reading more once the client has taken the last chunk */
+static step_t relay_response(loop_t *loop, conn_t *conn) {
+    while (true) {
+        if (conn->relay_sent < conn->relay_length) {
+            ssize_t bytes_written = write(conn->client.fd,
+                conn->relay_data + conn->relay_sent,
+                conn->relay_length - conn->relay_sent);
+            if (bytes_written < 0 && errno == EINTR) {
+                continue;
+            }
+            if (bytes_written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                set_events(loop, &conn->server, 0);
+                set_events(loop, &conn->client, EPOLLOUT);
+                return STEP_WAIT;
+            }
+            if (bytes_written < 0) {
+                return STEP_CLOSE;
+            }
+            count_sent(loop, conn, bytes_written);
+            conn->relay_sent += bytes_written;
+            continue;
+        }
+
+        if (conn->head_parsed && conn->body.done) {
+            return finish_response(loop, conn);
+        }
+
+        /* Once the response is known to be uncacheable and the last chunk is
+         * out, splice the rest so it never gets copied into user space.
+         * Chunked bodies have to be parsed to find their end, and shared
+         * ones have to be published, so they are always copied. */
+        if (conn->head_parsed && conn->entry == NULL && !conn->shared &&
+                conn->head.framing != BODY_CHUNKED) {
+            if (pipe2(conn->pipe_fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+                verbose_printf("pipe error: %s\n", strerror(errno));
+                conn->pipe_fds[0] = conn->pipe_fds[1] = -1;
+                return STEP_CLOSE;
+            }
+            conn->splice_left = conn->head.framing == BODY_LENGTH
+                ? conn->body.remaining : SIZE_MAX;
+            conn->state = SPLICE_RESPONSE;
+            return STEP_CONTINUE;
+        }
+
+        ssize_t bytes_read = read(conn->server.fd, conn->relay,
+            sizeof(conn->relay));
+        if (bytes_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            set_events(loop, &conn->client, 0);
+            set_events(loop, &conn->server, EPOLLIN);
+            return STEP_WAIT;
+        }
+        /* A pooled connection the server closed before we used it */
+        if (bytes_read <= 0 && conn->pooled && !conn->head_parsed &&
+                buffer_length(conn->head_data) == 0) {
+            return retry_unpooled(loop, conn);
+        }
+        if (bytes_read < 0) {
+            verbose_printf("read error: %s\n", strerror(errno));
+            return STEP_CLOSE;
+        }
+
+        /* Server sent EOF, which only ends a body without other framing */
+        if (bytes_read == 0) {
+            if (!conn->head_parsed || conn->head.framing != BODY_CLOSE) {
+                verbose_printf("Response ended early\n");
+                return STEP_CLOSE;
+            }
+            conn->body.done = true;
+            continue;
+        }
+
+        step_t step = take_response_bytes(loop, conn, bytes_read);
+        if (step == STEP_CLOSE || conn->state != RELAY_RESPONSE) {
+            return step;
+        }
+    }
+}
+
+/* SPLICE_RESPONSE: moves the rest of an uncacheable response from the server
+ * to the client through a pipe without copying it into user space */
+static step_t splice_response(loop_t *loop, conn_t *conn) {
+    unsigned int flags = SPLICE_F_MOVE | SPLICE_F_MORE | SPLICE_F_NONBLOCK;
+    while (true) {
+        if (conn->piped > 0) {
+            ssize_t bytes_out = splice(conn->pipe_fds[0], NULL, conn->client.fd,
+                NULL, conn->piped, flags);
+            if (bytes_out < 0 && errno == EINTR) {
+                continue;
+            }
+            if (bytes_out < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                set_events(loop, &conn->server, 0);
+                set_events(loop, &conn->client, EPOLLOUT);
+                return STEP_WAIT;
+            }
+            if (bytes_out <= 0) {
+                return STEP_CLOSE;
+            }
+            count_sent(loop, conn, bytes_out);
+            conn->piped -= bytes_out;
+            continue;
+        }
+
+        if (conn->splice_left == 0) {
+            conn->body.done = true;
+            return finish_response(loop, conn);
+        }
+
+        ssize_t bytes_in = splice(conn->server.fd, NULL, conn->pipe_fds[1],
+            NULL, conn->splice_left < SPLICE_SIZE ? conn->splice_left
+                : SPLICE_SIZE, flags);
+        if (bytes_in < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_in < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            set_events(loop, &conn->client, 0);
+            set_events(loop, &conn->server, EPOLLIN);
+            return STEP_WAIT;
+        }
+        if (bytes_in < 0) {
+            verbose_printf("splice error: %s\n", strerror(errno));
+            return STEP_CLOSE;
+        }
+
+        /* Server sent EOF, which only ends a body without other framing */
+        if (bytes_in == 0) {
+            if (conn->splice_left != SIZE_MAX) {
+                verbose_printf("Response ended early\n");
+                return STEP_CLOSE;
+            }
+            conn->splice_left = 0;
+            continue;
+        }
+        conn->piped += bytes_in;
+        if (conn->splice_left != SIZE_MAX) {
+            conn->splice_left -= bytes_in;
+        }
+    }
+}
+
+/* FOLLOW_FLIGHT: relays the response another connection is fetching, a
+ * chunk at a time as it arrives, decoding a chunked body if the client can't
+ * take one.  Falls back to fetching it directly if the leader can't share
+ * it. */
+static step_t follow_flight(loop_t *loop, conn_t *conn) {
+    while (true) {
+        if (conn->relay_sent < conn->relay_length) {
+            ssize_t bytes_written = write(conn->client.fd,
+                conn->relay_data + conn->relay_sent,
+                conn->relay_length - conn->relay_sent);
+            if (bytes_written < 0 && errno == EINTR) {
+                continue;
+            }
+            if (bytes_written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                set_events(loop, &conn->client, EPOLLOUT);
+                return STEP_WAIT;
+            }
+            if (bytes_written < 0) {
+                return STEP_CLOSE;
+            }
+            count_sent(loop, conn, bytes_written);
+            conn->relay_sent += bytes_written;
+            continue;
+        }
+
+        if (!conn->head_parsed) {
+            buffer_t *head = buffer_create(BUFFER_SIZE);
+            int result = flight_get_head(conn->flight, head, &conn->head,
+                loop->wake.fd);
+            if (result == FLIGHT_PENDING) {
+                buffer_free(head);
+                return wait_for_wake(loop, conn);
+            }
+            if (result == FLIGHT_FAILED) {
+                buffer_free(head);
+                flight_release(conn->flight);
+                conn->flight = NULL;
+                if (!admit_fetch(loop, conn)) {
+                    stats_add(loop->stats, STAT_THROTTLED, 1);
+                    return send_status(conn, "503 Service Unavailable",
+                        "The server is busy. Try again later.");
+                }
+                conn->head_data = buffer_create(BUFFER_SIZE);
+                conn->state = RESOLVE_SERVER;
+                return STEP_CONTINUE;
+            }
+
+            stats_add(loop->stats, STAT_COALESCED, 1);
+            conn->head_parsed = true;
+            conn->dechunk = conn->head.framing == BODY_CHUNKED &&
+                !conn->accepts_chunked;
+            if (conn->dechunk) {
+                body_reader_init(&conn->body, &conn->head);
+                conn->decoded = buffer_create(BUFFER_SIZE);
+            }
+            conn->keep_alive &= conn->head.framing != BODY_CLOSE &&
+                !conn->dechunk;
+            conn->out = conn->dechunk
+                ? make_dechunked_head(buffer_data(head), &conn->head)
+                : make_client_head(buffer_data(head), &conn->head,
+                    conn->keep_alive, -1);
+            buffer_free(head);
+            conn->relay_data = buffer_data(conn->out);
+            conn->relay_length = buffer_length(conn->out);
+            conn->relay_sent = 0;
+            continue;
+        }
+
+        ssize_t bytes_read = flight_read(conn->flight, conn->flight_offset,
+            conn->relay, sizeof(conn->relay), loop->wake.fd);
+        if (bytes_read == FLIGHT_PENDING) {
+            return wait_for_wake(loop, conn);
+        }
+        if (bytes_read == FLIGHT_FAILED) {
+            return STEP_CLOSE;
+        }
+        if (bytes_read == 0) {
+            set_events(loop, &conn->client, 0);
+            return finish_response(loop, conn);
+        }
+        conn->flight_offset += bytes_read;
+        conn->relay_data = conn->relay;
+        conn->relay_length = bytes_read;
+        conn->relay_sent = 0;
+        if (conn->dechunk) {
+            buffer_clear(conn->decoded);
+            if (body_reader_feed(&conn->body, conn->relay, bytes_read,
+                    conn->decoded) < 0) {
+                verbose_printf("Malformed response body\n");
+                return STEP_CLOSE;
+            }
+            conn->relay_data = buffer_data(conn->decoded);
+            conn->relay_length = buffer_length(conn->decoded);
+        }
+    }
+}
+
+/* SEND_RESPONSE: writes a complete response to the client */
+static step_t send_response(loop_t *loop, conn_t *conn) {
+    struct iovec *iov = conn->out_iov;
+    while (conn->out_iovcnt > 0) {
+        ssize_t bytes_written = writev(conn->client.fd, iov, conn->out_iovcnt);
+        if (bytes_written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            set_events(loop, &conn->client, EPOLLOUT);
+            return STEP_WAIT;
+        }
+        if (bytes_written < 0) {
+            return STEP_CLOSE;
+        }
+        count_sent(loop, conn, bytes_written);
+
+        /* Drop the fully written entries, then skip into the partial one */
+        while (conn->out_iovcnt > 0 && (size_t) bytes_written >= iov->iov_len) {
+            bytes_written -= iov->iov_len;
+            iov[0] = iov[1];
+            conn->out_iovcnt--;
+        }
+        if (conn->out_iovcnt > 0) {
+            iov->iov_base = (uint8_t *) iov->iov_base + bytes_written;
+            iov->iov_len -= bytes_written;
+        }
+    }
+    set_events(loop, &conn->client, 0);
+    time_response(loop, conn);
+    return conn->keep_alive ? next_request(loop, conn) : STEP_CLOSE;
+}
+
+/* Runs the connection's state machine until it blocks or finishes */
+static void advance(loop_t *loop, conn_t *conn) {
+    step_t step = STEP_CONTINUE;
+    while (step == STEP_CONTINUE) {
+        switch (conn->state) {
+            case READ_REQUEST:
+                step = read_request(loop, conn);
+                break;
+            case RESOLVE_SERVER:
+                step = connect_server(loop, conn);
+                break;
+            case FOLLOW_FLIGHT:
+                step = follow_flight(loop, conn);
+                break;
+            case CONNECT_SERVER:
+                step = finish_connect(loop, conn);
+                break;
+            case SEND_REQUEST:
+                step = send_request(loop, conn);
+                break;
+            case RELAY_RESPONSE:
+                step = relay_response(loop, conn);
+                break;
+            case SPLICE_RESPONSE:
+                step = splice_response(loop, conn);
+                break;
+            case SEND_RESPONSE:
+                step = send_response(loop, conn);
+                break;
+        }
+    }
+    if (step == STEP_CLOSE) {
+        conn_close(loop, conn);
+    }
+    /* The whole request must arrive in time, but a response only has to keep
+     * moving */
+    else if (conn->state != READ_REQUEST) {
+        arm_timer(loop, conn);
+    }
+}
+
+/* Accepts every pending connection on the listening socket */
+static void accept_connections(loop_t *loop) {
+    while (true) {
+        int client_fd = accept4(loop->listen_fd, NULL, NULL, SOCK_NONBLOCK);
+        if (client_fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("Accept error");
+            }
+            return;
+        }
+
+        /* A client with as many connections open as it may have is turned
+         * away once its request has been read, so the answer isn't lost to
+         * a reset */
+        char key[CLIENT_KEY_SIZE];
+        bool limited = throttle_client_key(client_fd, key);
+        stats_add(loop->stats, STAT_CONNECTIONS, 1);
+        conn_t *conn = conn_create(client_fd);
+        arm_timer(loop, conn);
+        if (limited &&
+                !throttle_acquire(loop->throttle, THROTTLE_CLIENT, key)) {
+            conn->refused = true;
+        }
+        else if (limited) {
+            conn->limited = true;
+            strcpy(conn->client_key, key);
+        }
+        advance(loop, conn);
+    }
+}
+
+/* Retries every connection waiting on the resolver or a flight, after one of
+ * them made progress.  Those still waiting put themselves back on the
+ * list. */
+static void resume_waiting(loop_t *loop) {
+    uint64_t count;
+    if (read(loop->wake.fd, &count, sizeof(count)) < 0) {
+        return;
+    }
+
+    conn_t *conn = loop->waiting;
+    loop->waiting = NULL;
+    while (conn != NULL) {
+        conn_t *next = conn->next_waiting;
+        conn->waiting = false;
+        advance(loop, conn);
+        conn = next;
+    }
+}
+
+/* Closes every connection whose deadline has passed.  One still waiting for
+ * the server to start answering gets a 504 first.  One parked on the
+ * resolver or a flight is given more time instead, since those time out on
+ * their own and wake it. */
+static void expire_timers(loop_t *loop) {
+    while (loop->timers != NULL && loop->timers->deadline <= loop->now) {
+        conn_t *conn = loop->timers;
+        if (conn->waiting) {
+            arm_timer(loop, conn);
+            continue;
+        }
+
+        verbose_printf("Connection timed out\n");
+        bool awaiting_server = conn->state == CONNECT_SERVER ||
+            conn->state == SEND_REQUEST ||
+            (conn->state == RELAY_RESPONSE && !conn->head_parsed);
+        if (!awaiting_server) {
+            conn_close(loop, conn);
+            continue;
+        }
+        close_endpoint(loop, &conn->server);
+        conn_clear(loop, conn);
+        send_status(conn, "504 Gateway Timeout",
+            "The server did not respond in time.");
+        advance(loop, conn);
+    }
+}
+
+void run_event_loop(int listen_fd, proxy_context_t *ctx) {
+    loop_t loop;
+    loop.listen_fd = listen_fd;
+    loop.cache = ctx->cache;
+    loop.stats = ctx->stats;
+    loop.throttle = ctx->throttle;
+    loop.pool = ctx->pool;
+    loop.compress = ctx->compress;
+    loop.dns = ctx->dns;
+    loop.flights = ctx->flights;
+    loop.closed = NULL;
+    loop.waiting = NULL;
+    loop.timers = NULL;
+    loop.last_timer = NULL;
+    loop.now = stats_now();
+    loop.epoll_fd = epoll_create1(0);
+    if (loop.epoll_fd < 0) {
+        perror("epoll_create1 error");
+        exit(1);
+    }
+
+    loop.wake.conn = NULL;
+    loop.wake.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    loop.wake.events = 0;
+    if (loop.wake.fd < 0) {
+        perror("eventfd error");
+        exit(1);
+    }
+    set_events(&loop, &loop.wake, EPOLLIN);
+
+    /* Every loop waits on the same listening socket.  EPOLLEXCLUSIVE wakes
+     * just one of them per incoming connection. */
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLEXCLUSIVE;
+    event.data.ptr = NULL;
+    if (epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, listen_fd, &event) < 0) {
+        perror("epoll_ctl error");
+        exit(1);
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    while (true) {
+        /* Wake in time for the earliest deadline */
+        int timeout = -1;
+        if (loop.timers != NULL) {
+            uint64_t now = stats_now();
+            timeout = loop.timers->deadline <= now ? 0
+                : (int) ((loop.timers->deadline - now + 999) / 1000);
+        }
+        int num_events = epoll_wait(loop.epoll_fd, events, MAX_EVENTS, timeout);
+        loop.now = stats_now();
+        if (num_events < 0) {
+            if (errno != EINTR) {
+                perror("epoll_wait error");
+            }
+            continue;
+        }
+
+        for (int i = 0; i < num_events; i++) {
+            endpoint_t *endpoint = events[i].data.ptr;
+            if (endpoint == NULL) {
+                accept_connections(&loop);
+            }
+            else if (endpoint == &loop.wake) {
+                resume_waiting(&loop);
+            }
+            else if (!endpoint->conn->closed) {
+                advance(&loop, endpoint->conn);
+            }
+        }
+        expire_timers(&loop);
+
+        while (loop.closed != NULL) {
+            conn_t *conn = loop.closed;
+            loop.closed = conn->next_closed;
+            conn_free(&loop, conn);
+        }
+    }
+}
@@ -0,0 +1,336 @@
+#include "flight.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Number of hash bins */
+#define FLIGHT_BINS 256
+
+/* Largest body buffered for followers.  A response known to be bigger isn't
+ * shared at all (so the leader can splice it), and one that turns out to be
+ * bigger stops being shared as soon as it does, sending its followers to
+ * fetch it themselves. */
+#define MAX_SHARED_SIZE (1024 * 1024)
+
+struct flight_t {
+    flight_table_t *table;
+    char *key;
+    /* Whether the clients on the flight accept gzip */
+    bool gzip;
+    /* Whether the flight can still be found in the table */
+    bool in_table;
+    flight_t *next;
+
+    /* One reference belongs to the table while the flight is in it, and one
+     * to each leader or follower until flight_release() */
+    atomic_size_t refs;
+
+    /* Everything below is protected by lock.  changed is broadcast whenever
+     * the head or more of the body arrives, or the flight ends.  Followers
+     * are only handed the head of a response whose length isn't known once
+     * all of it has arrived, so they can still fetch it themselves if it
+     * turns out too big to share. */
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    bool head_ready;
+    bool shared;
+    bool finished;
+    bool complete;
+    buffer_t *head_data;
+    response_head_t head;
+    buffer_t *body;
+
+    /* Eventfds of event loops with a follower waiting for news */
+    int *notify_fds;
+    size_t num_notify;
+    size_t notify_capacity;
+};
+
+struct flight_table_t {
+    pthread_mutex_t lock;
+    flight_t *bins[FLIGHT_BINS];
+};
+
+/* Hash a key into a bin. */
+static size_t key_hash(char *key) {
+    size_t hash = 5381;
+    int c;
+    while ((c = *key++)) {
+        hash = ((hash << 5) + hash) + c;
+    }
+    return hash % FLIGHT_BINS;
+}
+
+flight_table_t *flight_table_create(void) {
+    flight_table_t *table = calloc(1, sizeof(*table));
+    assert(table != NULL);
+    pthread_mutex_init(&table->lock, NULL);
+    return table;
+}
+
+void flight_table_free(flight_table_t *table) {
+    if (table == NULL) {
+        return;
+    }
+
+    pthread_mutex_destroy(&table->lock);
+    free(table);
+}
+
+flight_t *flight_join(flight_table_t *table, char *key, bool accepts_gzip,
+        bool *leader) {
+    size_t bin = key_hash(key);
+    pthread_mutex_lock(&table->lock);
+    flight_t *flight = table->bins[bin];
+    while (flight != NULL &&
+            (flight->gzip != accepts_gzip || strcmp(flight->key, key) != 0)) {
+        flight = flight->next;
+    }
+    *leader = flight == NULL;
+    if (flight != NULL) {
+        atomic_fetch_add(&flight->refs, 1);
+        pthread_mutex_unlock(&table->lock);
+        return flight;
+    }
+
+    flight = calloc(1, sizeof(*flight));
+    assert(flight != NULL);
+    flight->table = table;
+    flight->key = strdup(key);
+    assert(flight->key != NULL);
+    flight->gzip = accepts_gzip;
+    flight->in_table = true;
+    atomic_init(&flight->refs, 2);
+    pthread_mutex_init(&flight->lock, NULL);
+    pthread_cond_init(&flight->changed, NULL);
+    flight->shared = true;
+    flight->next = table->bins[bin];
+    table->bins[bin] = flight;
+    pthread_mutex_unlock(&table->lock);
+    return flight;
+}
+
+void flight_release(flight_t *flight) {
+    if (atomic_fetch_sub(&flight->refs, 1) != 1) {
+        return;
+    }
+
+    pthread_cond_destroy(&flight->changed);
+    pthread_mutex_destroy(&flight->lock);
+    buffer_free(flight->head_data);
+    buffer_free(flight->body);
+    free(flight->notify_fds);
+    free(flight->key);
+    free(flight);
+}
+
+/* Unlinks the flight from its bin.  The caller must hold the table's lock,
+ * and drop the table's reference once it has let go of it. */
+static void unlink_flight(flight_t *flight) {
+    flight_t **link = &flight->table->bins[key_hash(flight->key)];
+    while (*link != flight) {
+        link = &(*link)->next;
+    }
+    *link = flight->next;
+    flight->in_table = false;
+}
+
+/* Takes the flight out of the table, so later misses on its key start a new
+ * one.  Does nothing if it has already been taken out. */
+static void detach(flight_t *flight) {
+    flight_table_t *table = flight->table;
+    pthread_mutex_lock(&table->lock);
+    if (!flight->in_table) {
+        pthread_mutex_unlock(&table->lock);
+        return;
+    }
+
+    unlink_flight(flight);
+    pthread_mutex_unlock(&table->lock);
+    flight_release(flight);
+}
+
+/* Takes the flight out of the table if nobody has joined it besides the
+ * leader, which is when only the table's and the leader's references are
+ * held.  Followers join with the table locked, so none can slip in between.
+ * Returns whether it was taken out. */
+static bool detach_unfollowed(flight_t *flight) {
+    flight_table_t *table = flight->table;
+    pthread_mutex_lock(&table->lock);
+    if (!flight->in_table || atomic_load(&flight->refs) != 2) {
+        pthread_mutex_unlock(&table->lock);
+        return false;
+    }
+
+    unlink_flight(flight);
+    pthread_mutex_unlock(&table->lock);
+    flight_release(flight);
+    return true;
+}
+
+/* Wakes every follower waiting for news.  The caller must hold the flight's
+ * lock. */
+static void announce(flight_t *flight) {
+    pthread_cond_broadcast(&flight->changed);
+    for (size_t i = 0; i < flight->num_notify; i++) {
+        /* Don't bother checking the result, since writing to an eventfd
+         * only fails if its counter is so full the loop wakes anyway */
+        uint64_t one = 1;
+        ssize_t written = write(flight->notify_fds[i], &one, sizeof(one));
+        (void) written;
+    }
+    flight->num_notify = 0;
+}
+
+/* Asks for notify_fd to be written to at the next news, unless it already
+ * is.  The caller must hold the flight's lock. */
+static void add_notify(flight_t *flight, int notify_fd) {
+    for (size_t i = 0; i < flight->num_notify; i++) {
+        if (flight->notify_fds[i] == notify_fd) {
+            return;
+        }
+    }
+    if (flight->num_notify == flight->notify_capacity) {
+        flight->notify_capacity = flight->notify_capacity > 0
+            ? flight->notify_capacity * 2 : 4;
+        flight->notify_fds = realloc(flight->notify_fds,
+            flight->notify_capacity * sizeof(int));
+        assert(flight->notify_fds != NULL);
+    }
+    flight->notify_fds[flight->num_notify++] = notify_fd;
+}
+
+bool flight_publish_head(flight_t *flight, uint8_t *head_data,
+        response_head_t *head) {
+    bool shared = head->cacheable && !head->sets_cookie &&
+        (!head->encoded || (head->gzip && flight->gzip)) &&
+        (head->framing != BODY_LENGTH ||
+            head->content_length <= MAX_SHARED_SIZE);
+    /* Nothing is copied for followers unless one has already joined, so a
+     * response nobody else asked for can be spliced */
+    if (!shared) {
+        detach(flight);
+    }
+    else if (detach_unfollowed(flight)) {
+        shared = false;
+    }
+
+    pthread_mutex_lock(&flight->lock);
+    flight->head_ready = true;
+    flight->shared = shared;
+    flight->head = *head;
+    if (shared) {
+        flight->head_data = buffer_create(head->header_length);
+        buffer_append_bytes(flight->head_data, head_data, head->header_length);
+        flight->body = buffer_create(head->framing == BODY_LENGTH
+            ? head->content_length + 1 : head->header_length);
+    }
+    announce(flight);
+    pthread_mutex_unlock(&flight->lock);
+    return shared;
+}
+
+/* Returns whether the follower can be handed the head of the flight's
+ * response yet.  The caller must hold the flight's lock. */
+static bool head_available(flight_t *flight) {
+    return flight->head_ready &&
+        (flight->head.framing == BODY_LENGTH || !flight->shared);
+}
+
+void flight_publish_body(flight_t *flight, uint8_t *data, size_t length) {
+    pthread_mutex_lock(&flight->lock);
+    if (!flight->shared || length == 0) {
+        pthread_mutex_unlock(&flight->lock);
+        return;
+    }
+
+    if (buffer_length(flight->body) + length <= MAX_SHARED_SIZE) {
+        buffer_append_bytes(flight->body, data, length);
+        /* Nobody reads the body before it is all there unless its length
+         * is known */
+        if (flight->head.framing == BODY_LENGTH) {
+            announce(flight);
+        }
+        pthread_mutex_unlock(&flight->lock);
+        return;
+    }
+    pthread_mutex_unlock(&flight->lock);
+
+    /* Too big to share: later misses start a flight of their own, and the
+     * followers (which have yet to be sent anything) fetch it themselves */
+    detach(flight);
+    pthread_mutex_lock(&flight->lock);
+    flight->shared = false;
+    buffer_free(flight->body);
+    flight->body = NULL;
+    announce(flight);
+    pthread_mutex_unlock(&flight->lock);
+}
+
+void flight_finish(flight_t *flight, bool complete) {
+    detach(flight);
+    pthread_mutex_lock(&flight->lock);
+    if (!flight->finished) {
+        flight->finished = true;
+        flight->complete = complete;
+        announce(flight);
+    }
+    pthread_mutex_unlock(&flight->lock);
+}
+
+int flight_get_head(flight_t *flight, buffer_t *head_data,
+        response_head_t *head, int notify_fd) {
+    pthread_mutex_lock(&flight->lock);
+    while (!head_available(flight) && !flight->finished) {
+        if (notify_fd >= 0) {
+            add_notify(flight, notify_fd);
+            pthread_mutex_unlock(&flight->lock);
+            return FLIGHT_PENDING;
+        }
+        pthread_cond_wait(&flight->changed, &flight->lock);
+    }
+
+    int result = FLIGHT_FAILED;
+    if (flight->head_ready && flight->shared &&
+            (flight->head.framing == BODY_LENGTH || flight->complete)) {
+        buffer_append_bytes(head_data, buffer_data(flight->head_data),
+            buffer_length(flight->head_data));
+        *head = flight->head;
+        result = 0;
+    }
+    pthread_mutex_unlock(&flight->lock);
+    return result;
+}
+
+ssize_t flight_read(flight_t *flight, size_t offset, uint8_t *buf,
+        size_t length, int notify_fd) {
+    pthread_mutex_lock(&flight->lock);
+    while (flight->shared && offset >= buffer_length(flight->body) &&
+            !flight->finished) {
+        if (notify_fd >= 0) {
+            add_notify(flight, notify_fd);
+            pthread_mutex_unlock(&flight->lock);
+            return FLIGHT_PENDING;
+        }
+        pthread_cond_wait(&flight->changed, &flight->lock);
+    }
+
+    ssize_t result;
+    if (!flight->shared) {
+        result = FLIGHT_FAILED;
+    }
+    else if (offset < buffer_length(flight->body)) {
+        size_t available = buffer_length(flight->body) - offset;
+        result = available < length ? available : length;
+        memcpy(buf, buffer_data(flight->body) + offset, result);
+    }
+    else {
+        result = flight->complete ? 0 : FLIGHT_FAILED;
+    }
+    pthread_mutex_unlock(&flight->lock);
+    return result;
+}
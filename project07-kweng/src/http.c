@@ -0,0 +1,1123 @@
+#define _GNU_SOURCE
+
+#include "http.h"
+#include <assert.h>
+#include <netdb.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "client_thread.h"
+
+/* A response without an explicit lifetime stays fresh for this share of the
+ * time since it was last modified, up to a day, or for a minute if it
+ * doesn't say when that was */
+#define HEURISTIC_PERCENT 10
+#define MAX_HEURISTIC_LIFETIME (24 * 60 * 60)
+#define DEFAULT_LIFETIME 60
+
+/* Largest number of seconds a Cache-Control directive or Age header may
+ * give */
+#define MAX_DELTA_SECONDS 2147483648L
+
+bool starts_with(char *str, char *prefix) {
+    return strncmp(str, prefix, strlen(prefix)) == 0;
+}
+
+request_status_t parse_request_line(char *line, char **full_host, char **path,
+        bool *keep_alive) {
+    *full_host = NULL;
+    *path = NULL;
+
+    /* We are expecting one of a few cases:
+     * GET http://<HOST>/[<PATH>[/]] HTTP/..
+     * GET http://<HOST>:#..#/[<PATH>[/]] HTTP/..
+     *
+     * We reject any other request (and terminate the connection),
+     * because we believe it to be malformed.
+     */
+    char *saveptr;
+    char *prefix  = strtok_r(line, " ", &saveptr);
+    char *url     = strtok_r(NULL, " ", &saveptr);
+    char *version = strtok_r(NULL, " ", &saveptr);
+
+    if (prefix == NULL || url == NULL || version == NULL || strtok_r(NULL, " ", &saveptr) != NULL) {
+        verbose_printf("Malformed request string: GET requests have"
+                       " three parts\n");
+        return REQUEST_MALFORMED;
+    }
+    if (strcmp(prefix, "GET") != 0) {
+        verbose_printf("Unsupported request string: This proxy only"
+               " handles GET requests\n");
+        return REQUEST_NOT_IMPLEMENTED;
+    }
+    if (!starts_with(version, "HTTP/")) {
+        verbose_printf("Malformed request string: The third part of the"
+               " GET request should be an HTTP version\n");
+        return REQUEST_MALFORMED;
+    }
+    if (!starts_with(url, "http://")) {
+        verbose_printf("Malformed request string: The URL of the request"
+               " should start with 'http://'\n");
+        return REQUEST_MALFORMED;
+    }
+    /* Only HTTP/1.0 (and older) clients close after every request unless
+     * told otherwise */
+    *keep_alive = !starts_with(version, "HTTP/1.0") &&
+        !starts_with(version, "HTTP/0.");
+
+    char *host = url + strlen("http://");
+    /* Allocate path separately so the caller can free the line.
+     * The path starts at the first '/' in the URL.
+     * If there is no '/' (e.g. "http://ucla.edu"), the path is just "/". */
+    char *path_start = strchr(host, '/');
+    *path = strdup(path_start == NULL ? "/" : path_start);
+    assert(*path != NULL);
+
+    /* Copy host, so that we have a separate copy for later */
+    if (path_start != NULL) {
+        *path_start = '\0';
+    }
+    *full_host = strdup(host);
+    assert(*full_host != NULL);
+    return REQUEST_OK;
+}
+
+char *make_cache_key(char *host, char *path) {
+    // the extra bit is for the null terminator
+    char *key = malloc(strlen(host) + strlen(path) + 1);
+    assert(key != NULL);
+    strcpy(key, host);
+    strcat(key, path);
+    return key;
+}
+
+bool split_host_port(char *full_host, int *port) {
+    char *port_str = strchr(full_host, ':');
+    if (port_str == NULL) {
+        *port = 80;
+        return true;
+    }
+
+    /* Host string was separated into hostname and port */
+    *port_str = '\0';
+    *port = atoi(port_str + 1);
+    if (*port <= 0 || *port > 65535) {
+        verbose_printf("Malformed request string: Invalid port\n");
+        return false;
+    }
+    return true;
+}
+
+char *dns_error_message(int err) {
+    switch (err) {
+        case EAI_FAIL:
+        case EAI_NONAME:
+            return "DNS could not resolve address.";
+        case EAI_AGAIN:
+            return "DNS temporarily could not resolve address.";
+        case EAI_NODATA:
+            return "DNS could has no network addresses for host.";
+        default:
+            return NULL;
+    }
+}
+
+/* Returns whether the header line of the given length is the header name
+ * and, if so, sets *value to the start of its value */
+static bool header_is(char *line, size_t length, char *name, char **value) {
+    size_t name_length = strlen(name);
+    if (length <= name_length || line[name_length] != ':' ||
+            strncasecmp(line, name, name_length) != 0) {
+        return false;
+    }
+    *value = line + name_length + 1;
+    while (*value < line + length && (**value == ' ' || **value == '\t')) {
+        (*value)++;
+    }
+    return true;
+}
+
+/* Returns the value of the first header called name in head_data, setting
+ * *length to its length, or NULL if there is no such header */
+static char *find_header(uint8_t *head_data, response_head_t *head, char *name,
+        size_t *length) {
+    char *line = (char *) head_data;
+    char *headers_end = (char *) head_data + head->header_length - 2;
+    while (line < headers_end) {
+        char *line_end = memmem(line, headers_end - line, "\r\n", 2);
+        char *value;
+        if (header_is(line, line_end - line, name, &value)) {
+            *length = line_end - value;
+            return value;
+        }
+        line = line_end + 2;
+    }
+    return NULL;
+}
+
+/* Returns whether the comma-separated header value running up to end contains
+ * token, ignoring case */
+static bool value_has_token(char *value, char *end, char *token) {
+    size_t token_length = strlen(token);
+    while (value < end) {
+        while (value < end && (*value == ' ' || *value == '\t' || *value == ',')) {
+            value++;
+        }
+        char *token_end = value;
+        while (token_end < end && *token_end != ',' && *token_end != ' ' &&
+                *token_end != '\t' && *token_end != '\r' && *token_end != '=' &&
+                *token_end != ';') {
+            token_end++;
+        }
+        if ((size_t) (token_end - value) == token_length &&
+                strncasecmp(value, token, token_length) == 0) {
+            return true;
+        }
+        value = token_end;
+        while (value < end && *value != ',') {
+            value++;
+        }
+    }
+    return false;
+}
+
+/* Parses the digits at the start of value (up to end) as a number of
+ * seconds, or returns -1 if there are none */
+static time_t parse_seconds(char *value, char *end) {
+    if (value == end || *value < '0' || *value > '9') {
+        return -1;
+    }
+    time_t seconds = 0;
+    for (; value < end && *value >= '0' && *value <= '9'; value++) {
+        if (seconds < MAX_DELTA_SECONDS) {
+            seconds = seconds * 10 + *value - '0';
+        }
+    }
+    return seconds < MAX_DELTA_SECONDS ? seconds : MAX_DELTA_SECONDS;
+}
+
+/* Returns the seconds given to the directive name (like max-age=60) in the
+ * comma-separated Cache-Control value running up to end, or -1 if it isn't
+ * there */
+static time_t directive_seconds(char *value, char *end, char *name) {
+    size_t name_length = strlen(name);
+    while (value < end) {
+        while (value < end && (*value == ' ' || *value == '\t' || *value == ',')) {
+            value++;
+        }
+        if ((size_t) (end - value) > name_length &&
+                strncasecmp(value, name, name_length) == 0 &&
+                value[name_length] == '=') {
+            char *digits = value + name_length + 1;
+            if (digits < end && *digits == '"') {
+                digits++;
+            }
+            return parse_seconds(digits, end);
+        }
+        while (value < end && *value != ',') {
+            value++;
+        }
+    }
+    return -1;
+}
+
+/* Parses an HTTP date running up to end, in the preferred format or either
+ * of the obsolete ones.  Returns -1 if it is none of them. */
+static time_t parse_http_date(char *value, char *end) {
+    char date[64];
+    size_t length = end - value;
+    if (length >= sizeof(date)) {
+        return -1;
+    }
+    memcpy(date, value, length);
+    date[length] = '\0';
+
+    char *formats[] = {
+        "%a, %d %b %Y %H:%M:%S GMT",  /* IMF-fixdate */
+        "%A, %d-%b-%y %H:%M:%S GMT",  /* RFC 850 */
+        "%a %b %d %H:%M:%S %Y"        /* asctime() */
+    };
+    for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+        struct tm tm = {0};
+        char *rest = strptime(date, formats[i], &tm);
+        if (rest != NULL && *rest == '\0') {
+            return timegm(&tm);
+        }
+    }
+    return -1;
+}
+
+/* Returns whether a response with the given status may be cached without
+ * explicit freshness information.  206 is left out, since only part of the
+ * body is sent. */
+static bool status_cacheable(int status) {
+    switch (status) {
+        case 200:
+        case 203:
+        case 300:
+        case 301:
+        case 308:
+        case 404:
+        case 410:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/* Returns whether a Content-Type header value running up to end is a text
+ * format, which typically compresses several times over */
+static bool type_compressible(char *value, char *end) {
+    char *type_end = value;
+    while (type_end < end && *type_end != ';' && *type_end != ' ') {
+        type_end++;
+    }
+    size_t length = type_end - value;
+    char *types[] = {
+        "application/json", "application/javascript", "application/xml",
+        "application/xhtml+xml", "image/svg+xml"
+    };
+    for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+        if (length == strlen(types[i]) &&
+                strncasecmp(value, types[i], length) == 0) {
+            return true;
+        }
+    }
+    return length > strlen("text/") && strncasecmp(value, "text/", 5) == 0;
+}
+
+/* Returns the end of the header value starting at value: its CRLF, or the
+ * end of the string if the line has none.  (The event loop front end filters
+ * headers in place, followed by the rest of the request.) */
+static char *value_end(char *value) {
+    char *end = strpbrk(value, "\r\n");
+    return end != NULL ? end : value + strlen(value);
+}
+
+/* Parses the digits from start up to end as a byte offset.  Returns 1 if
+ * successful, 0 if there are none, or -1 if there is anything else or the
+ * offset doesn't fit. */
+static int parse_offset(char *start, char *end, size_t *offset) {
+    if (start == end) {
+        return 0;
+    }
+    *offset = 0;
+    for (char *digit = start; digit < end; digit++) {
+        if (*digit < '0' || *digit > '9' ||
+                *offset > (SIZE_MAX - (*digit - '0')) / 10) {
+            return -1;
+        }
+        *offset = *offset * 10 + *digit - '0';
+    }
+    return 1;
+}
+
+/* Parses the value of a Range header running up to end into *range, which
+ * is left invalid unless it asks for a single range of bytes:
+ * 'bytes=first-last', 'bytes=first-' or 'bytes=-suffix' */
+static void parse_range(char *value, char *end, byte_range_t *range) {
+    range->requested = true;
+    range->valid = false;
+    range->suffix = false;
+    while (end > value && (end[-1] == ' ' || end[-1] == '\t')) {
+        end--;
+    }
+    if (end - value < 6 || strncasecmp(value, "bytes=", 6) != 0) {
+        return;
+    }
+    char *spec = value + 6;
+    char *dash = memchr(spec, '-', end - spec);
+    if (dash == NULL) {
+        return;
+    }
+    int has_first = parse_offset(spec, dash, &range->first);
+    int has_last = parse_offset(dash + 1, end, &range->last);
+    if (has_first < 0 || has_last < 0 || (!has_first && !has_last)) {
+        return;
+    }
+    if (!has_first) {
+        range->suffix = true;
+    }
+    else if (!has_last) {
+        range->last = SIZE_MAX;
+    }
+    else if (range->last < range->first) {
+        return;
+    }
+    range->valid = true;
+}
+
+/* Notes the validator in the value of an If-Range header running up to end,
+ * leaving it empty if it is too long to keep */
+static void parse_if_range(char *value, char *end, byte_range_t *range) {
+    while (end > value && (end[-1] == ' ' || end[-1] == '\t')) {
+        end--;
+    }
+    range->if_range = true;
+    size_t length = end - value;
+    if (length >= sizeof(range->validator)) {
+        length = 0;
+    }
+    memcpy(range->validator, value, length);
+    range->validator[length] = '\0';
+}
+
+/* Returns whether the If-Range validator of range matches the cached
+ * response with the given head.  Weak entity tags never do. */
+static bool if_range_matches(byte_range_t *range, uint8_t *head_data,
+        response_head_t *head, bool decompressed) {
+    char *validator = range->validator;
+    size_t length = strlen(validator);
+    if (length == 0) {
+        return false;
+    }
+    if (validator[0] == '"') {
+        size_t etag_length;
+        char *etag = find_header(head_data, head, "ETag", &etag_length);
+        if (etag == NULL || decompressed) {
+            return false;
+        }
+        char *end = etag + etag_length;
+        while (end > etag && (end[-1] == ' ' || end[-1] == '\t')) {
+            end--;
+        }
+        return (size_t) (end - etag) == length &&
+            memcmp(etag, validator, length) == 0;
+    }
+    time_t date = parse_http_date(validator, validator + length);
+    return date >= 0 && date == head->last_modified;
+}
+
+range_result_t resolve_range(byte_range_t *range, uint8_t *head_data,
+        response_head_t *head, bool decompressed, size_t total, size_t *first,
+        size_t *length) {
+    if (!range->valid || head->status != 200) {
+        return RANGE_NONE;
+    }
+    /* A stale If-Range asks for the whole of the current response instead */
+    if (range->if_range &&
+            !if_range_matches(range, head_data, head, decompressed)) {
+        return RANGE_NONE;
+    }
+    /* An empty body has no bytes to ask for */
+    if (total == 0) {
+        return RANGE_UNSATISFIABLE;
+    }
+    if (range->suffix) {
+        if (range->last == 0) {
+            return RANGE_UNSATISFIABLE;
+        }
+        *length = range->last < total ? range->last : total;
+        *first = total - *length;
+        return RANGE_PARTIAL;
+    }
+    if (range->first >= total) {
+        return RANGE_UNSATISFIABLE;
+    }
+    size_t last = range->last < total - 1 ? range->last : total - 1;
+    *first = range->first;
+    *length = last - range->first + 1;
+    return RANGE_PARTIAL;
+}
+
+/* Notes whether the value of the client's Connection or Proxy-Connection
+ * header line asks to close or keep its connection */
+static void note_client_connection(header_filter_t *filter, char *line) {
+    char *value = strchr(line, ':') + 1;
+    char *end = value_end(value);
+    filter->client_close |= value_has_token(value, end, "close");
+    filter->client_keep_alive |= value_has_token(value, end, "keep-alive");
+}
+
+char *filter_header(header_filter_t *filter, char *line) {
+    /* Header names are matched ignoring case, as clients may send them in
+     * any */
+    size_t length = value_end(line) - line;
+    char *value;
+
+    /* Remove Keep-Alive line */
+    if (header_is(line, length, "Keep-Alive", &value)) {
+        return NULL;
+    }
+
+    /* Deal with host line (if we recieve one) */
+    if (header_is(line, length, "Host", &value)) {
+        filter->sent_host_header = true;
+    }
+    /* Connection: * -> Connection: close */
+    else if (header_is(line, length, "Connection", &value)) {
+        note_client_connection(filter, line);
+        filter->sent_connection_header = true;
+        return filter->keep_alive ? "Connection: keep-alive\r\n"
+            : "Connection: close\r\n";
+    }
+    /* Proxy-Connection: * -> Proxy-Connection: close */
+    else if (header_is(line, length, "Proxy-Connection", &value)) {
+        note_client_connection(filter, line);
+        return filter->keep_alive ? NULL : "Proxy-Connection: close\r\n";
+    }
+    /* The answer to a conditional request may be a 304 only the client that
+     * sent it can make sense of */
+    else if (header_is(line, length, "If-None-Match", &value) ||
+            header_is(line, length, "If-Modified-Since", &value) ||
+            header_is(line, length, "If-Match", &value) ||
+            header_is(line, length, "If-Unmodified-Since", &value)) {
+        filter->conditional = true;
+    }
+    /* If-Range only decides whether a cached response's Range is served */
+    else if (header_is(line, length, "If-Range", &value)) {
+        parse_if_range(value, line + length, &filter->range);
+    }
+    /* Cached bodies stored compressed are only sent as they are to clients
+     * that can decompress them */
+    else if (header_is(line, length, "Accept-Encoding", &value)) {
+        char *end = line + length;
+        filter->accepts_gzip = value_has_token(value, end, "gzip") ||
+            value_has_token(value, end, "x-gzip");
+    }
+    /* The answer to a request with credentials may be meant only for the
+     * client that sent it */
+    else if (header_is(line, length, "Cookie", &value) ||
+            header_is(line, length, "Authorization", &value)) {
+        filter->credentials = true;
+    }
+    /* Ranges of cached responses are served by the proxy, and any others by
+     * the server, so the header is passed on too */
+    else if (header_is(line, length, "Range", &value)) {
+        parse_range(value, line + length, &filter->range);
+    }
+    return line;
+}
+
+void finish_headers(header_filter_t *filter, buffer_t *out, char *host) {
+    if (!filter->sent_host_header) {
+        buffer_append_bytes(out, (uint8_t *) "Host: ", strlen("Host: "));
+        buffer_append_bytes(out, (uint8_t *) host, strlen(host));
+        buffer_append_bytes(out, (uint8_t *) "\r\n", 2);
+    }
+    if (!filter->sent_connection_header) {
+        char *connection = filter->keep_alive ? "Connection: keep-alive\r\n"
+            : "Connection: close\r\n";
+        buffer_append_bytes(out, (uint8_t *) connection, strlen(connection));
+    }
+    buffer_append_bytes(out, (uint8_t *) "\r\n", 2);
+}
+
+int parse_response_head(uint8_t *data, size_t length, response_head_t *head) {
+    uint8_t *blank_line = memmem(data, length, "\r\n\r\n", 4);
+    if (blank_line == NULL) {
+        return 0;
+    }
+    head->header_length = blank_line + 4 - data;
+
+    /* Status line: HTTP/1.x <3 digit status> <reason> */
+    char *line = (char *) data;
+    char *line_end = memmem(line, head->header_length, "\r\n", 2);
+    if (line_end - line < 12 || !starts_with(line, "HTTP/1.") || line[8] != ' ') {
+        return -1;
+    }
+    bool http_1_0 = line[7] == '0';
+    head->status = 0;
+    for (int i = 9; i < 12; i++) {
+        if (line[i] < '0' || line[i] > '9') {
+            return -1;
+        }
+        head->status = head->status * 10 + line[i] - '0';
+    }
+
+    bool chunked = false, has_length = false;
+    bool connection_close = false, connection_keep_alive = false;
+    bool no_store = false, text = false;
+    time_t max_age = -1, s_maxage = -1;
+    head->content_length = 0;
+    head->no_cache = false;
+    head->expires = -1;
+    head->date = -1;
+    head->last_modified = -1;
+    head->age = 0;
+    head->sets_cookie = false;
+    head->encoded = false;
+    head->gzip = false;
+    char *headers_end = (char *) blank_line + 2;
+    for (line = line_end + 2; line < headers_end; line = line_end + 2) {
+        line_end = memmem(line, headers_end - line, "\r\n", 2);
+        size_t line_length = line_end - line;
+        char *value;
+        if (header_is(line, line_length, "Transfer-Encoding", &value)) {
+            chunked = value_has_token(value, line_end, "chunked");
+        }
+        /* Only plain digits will do, and every Content-Length must agree,
+         * or the body can't be told apart from what follows it */
+        else if (header_is(line, line_length, "Content-Length", &value)) {
+            char *end = line_end;
+            while (end > value && (end[-1] == ' ' || end[-1] == '\t')) {
+                end--;
+            }
+            size_t content_length;
+            if (parse_offset(value, end, &content_length) != 1 ||
+                    (has_length && content_length != head->content_length)) {
+                return -1;
+            }
+            has_length = true;
+            head->content_length = content_length;
+        }
+        else if (header_is(line, line_length, "Connection", &value)) {
+            connection_close |= value_has_token(value, line_end, "close");
+            connection_keep_alive |= value_has_token(value, line_end, "keep-alive");
+        }
+        else if (header_is(line, line_length, "Cache-Control", &value)) {
+            no_store |= value_has_token(value, line_end, "no-store") ||
+                value_has_token(value, line_end, "private");
+            head->no_cache |= value_has_token(value, line_end, "no-cache");
+            time_t seconds = directive_seconds(value, line_end, "max-age");
+            if (seconds >= 0) {
+                max_age = seconds;
+            }
+            seconds = directive_seconds(value, line_end, "s-maxage");
+            if (seconds >= 0) {
+                s_maxage = seconds;
+            }
+        }
+        else if (header_is(line, line_length, "Expires", &value)) {
+            /* An invalid date means the response has already expired */
+            head->expires = parse_http_date(value, line_end);
+            if (head->expires < 0) {
+                head->expires = 0;
+            }
+        }
+        else if (header_is(line, line_length, "Date", &value)) {
+            head->date = parse_http_date(value, line_end);
+        }
+        else if (header_is(line, line_length, "Last-Modified", &value)) {
+            head->last_modified = parse_http_date(value, line_end);
+        }
+        else if (header_is(line, line_length, "Age", &value)) {
+            time_t age = parse_seconds(value, line_end);
+            head->age = age >= 0 ? age : 0;
+        }
+        else if (header_is(line, line_length, "Content-Encoding", &value)) {
+            /* Only a body compressed with nothing but gzip can be
+             * decompressed by the proxy */
+            head->encoded = !value_has_token(value, line_end, "identity");
+            head->gzip = (value_has_token(value, line_end, "gzip") ||
+                value_has_token(value, line_end, "x-gzip")) &&
+                memchr(value, ',', line_end - value) == NULL;
+        }
+        else if (header_is(line, line_length, "Set-Cookie", &value)) {
+            head->sets_cookie = true;
+        }
+        else if (header_is(line, line_length, "Content-Type", &value)) {
+            text = type_compressible(value, line_end);
+        }
+        else if (header_is(line, line_length, "Vary", &value)) {
+            /* The response depends on more than the request's URL */
+            no_store |= value_has_token(value, line_end, "*");
+        }
+    }
+    /* A shared cache goes by s-maxage if there is one */
+    head->max_age = s_maxage >= 0 ? s_maxage : max_age;
+
+    if ((head->status >= 100 && head->status < 200) || head->status == 204 ||
+            head->status == 304) {
+        head->framing = BODY_NONE;
+    }
+    else if (chunked) {
+        head->framing = BODY_CHUNKED;
+    }
+    else if (has_length) {
+        head->framing = BODY_LENGTH;
+    }
+    else {
+        head->framing = BODY_CLOSE;
+    }
+
+    /* HTTP/1.1 connections persist unless closed explicitly, HTTP/1.0 ones
+     * only if the server opts in */
+    head->keep_alive = head->framing != BODY_CLOSE && !connection_close &&
+        (!http_1_0 || connection_keep_alive);
+    head->cacheable = status_cacheable(head->status) && !no_store;
+    head->compressible = text && !head->encoded;
+    return 1;
+}
+
+void body_reader_init(body_reader_t *body, response_head_t *head) {
+    body->framing = head->framing;
+    body->remaining = head->framing == BODY_LENGTH ? head->content_length : 0;
+    body->done = head->framing == BODY_NONE ||
+        (head->framing == BODY_LENGTH && head->content_length == 0);
+    body->chunk_state = CHUNK_SIZE;
+    body->chunk_size = 0;
+    body->chunk_size_seen = false;
+}
+
+/* Returns the value of a hex digit, or -1 if c isn't one */
+static int hex_value(uint8_t c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+/* Steps the chunk framing state machine over data.  See body_reader_feed(). */
+static ssize_t feed_chunked(body_reader_t *body, uint8_t *data, size_t length,
+        buffer_t *decoded) {
+    size_t i = 0;
+    while (i < length && body->chunk_state != CHUNK_DONE) {
+        uint8_t c = data[i];
+        switch (body->chunk_state) {
+            case CHUNK_SIZE:
+                if (hex_value(c) >= 0) {
+                    if (body->chunk_size > (SIZE_MAX >> 4)) {
+                        return -1;
+                    }
+                    body->chunk_size = body->chunk_size * 16 + hex_value(c);
+                    body->chunk_size_seen = true;
+                }
+                else if (!body->chunk_size_seen) {
+                    return -1;
+                }
+                else if (c == '\r') {
+                    body->chunk_state = CHUNK_SIZE_LF;
+                }
+                else {
+                    body->chunk_state = CHUNK_EXTENSION;
+                }
+                i++;
+                break;
+            case CHUNK_EXTENSION:
+                if (c == '\r') {
+                    body->chunk_state = CHUNK_SIZE_LF;
+                }
+                i++;
+                break;
+            case CHUNK_SIZE_LF:
+                if (c != '\n') {
+                    return -1;
+                }
+                body->chunk_state = body->chunk_size == 0 ? CHUNK_TRAILER
+                    : CHUNK_DATA;
+                i++;
+                break;
+            case CHUNK_DATA: {
+                size_t n = length - i;
+                if (n > body->chunk_size) {
+                    n = body->chunk_size;
+                }
+                if (decoded != NULL) {
+                    buffer_append_bytes(decoded, data + i, n);
+                }
+                body->chunk_size -= n;
+                if (body->chunk_size == 0) {
+                    body->chunk_state = CHUNK_DATA_CR;
+                }
+                i += n;
+                break;
+            }
+            case CHUNK_DATA_CR:
+                if (c != '\r') {
+                    return -1;
+                }
+                body->chunk_state = CHUNK_DATA_LF;
+                i++;
+                break;
+            case CHUNK_DATA_LF:
+                if (c != '\n') {
+                    return -1;
+                }
+                body->chunk_state = CHUNK_SIZE;
+                body->chunk_size_seen = false;
+                i++;
+                break;
+            case CHUNK_TRAILER:
+                /* Either the blank line ending the body or a trailer field */
+                body->chunk_state = c == '\r' ? CHUNK_TRAILER_LF
+                    : CHUNK_TRAILER_LINE;
+                i++;
+                break;
+            case CHUNK_TRAILER_LINE:
+                if (c == '\n') {
+                    body->chunk_state = CHUNK_TRAILER;
+                }
+                i++;
+                break;
+            case CHUNK_TRAILER_LF:
+                if (c != '\n') {
+                    return -1;
+                }
+                body->chunk_state = CHUNK_DONE;
+                i++;
+                break;
+            case CHUNK_DONE:
+                break;
+        }
+    }
+    body->done = body->chunk_state == CHUNK_DONE;
+    return i;
+}
+
+ssize_t body_reader_feed(body_reader_t *body, uint8_t *data, size_t length,
+        buffer_t *decoded) {
+    if (body->done) {
+        return 0;
+    }
+
+    switch (body->framing) {
+        case BODY_NONE:
+            return 0;
+        case BODY_LENGTH:
+            if (length > body->remaining) {
+                length = body->remaining;
+            }
+            body->remaining -= length;
+            body->done = body->remaining == 0;
+            break;
+        case BODY_CHUNKED:
+            return feed_chunked(body, data, length, decoded);
+        case BODY_CLOSE:
+            break;
+    }
+    if (decoded != NULL) {
+        buffer_append_bytes(decoded, data, length);
+    }
+    return length;
+}
+
+bool request_keep_alive(header_filter_t *filter, bool by_default) {
+    if (filter->client_close) {
+        return false;
+    }
+    return by_default || filter->client_keep_alive;
+}
+
+/* Appends the status line of head_data to out */
+static void append_status_line(buffer_t *out, uint8_t *head_data,
+        response_head_t *head) {
+    uint8_t *line_end = memmem(head_data, head->header_length, "\r\n", 2);
+    buffer_append_bytes(out, head_data, line_end + 2 - head_data);
+}
+
+/* Appends the headers of head_data (after its status line) to out, without
+ * the blank line and without the hop-by-hop headers, which only described
+ * the connection the response arrived on.  Unless keep_framing, the framing
+ * headers are dropped too, as is the Age header, which only holds as long as
+ * the response isn't stored.  Content-Encoding is dropped unless
+ * keep_encoding, and then a strong ETag is made weak, since it names the
+ * bytes of the body in its old coding. */
+static void append_headers(buffer_t *out, uint8_t *head_data,
+        response_head_t *head, bool keep_framing, bool keep_encoding) {
+    char *line = (char *) head_data;
+    char *headers_end = (char *) head_data + head->header_length - 2;
+    line = memmem(line, headers_end + 2 - line, "\r\n", 2) + 2;
+    while (line < headers_end) {
+        char *line_end = memmem(line, headers_end - line, "\r\n", 2) + 2;
+        size_t line_length = line_end - line;
+        char *value;
+        bool framing = header_is(line, line_length, "Transfer-Encoding", &value) ||
+            header_is(line, line_length, "Content-Length", &value);
+        bool age = header_is(line, line_length, "Age", &value);
+        bool encoding = header_is(line, line_length, "Content-Encoding",
+            &value);
+        bool skip = ((framing || age) && !keep_framing) ||
+            (encoding && !keep_encoding) ||
+            header_is(line, line_length, "Connection", &value) ||
+            header_is(line, line_length, "Keep-Alive", &value);
+        if (!keep_encoding && header_is(line, line_length, "ETag", &value) &&
+                *value == '"') {
+            buffer_append_bytes(out, (uint8_t *) "ETag: W/", 8);
+            buffer_append_bytes(out, (uint8_t *) value, line_end - value);
+        }
+        else if (!skip) {
+            buffer_append_bytes(out, (uint8_t *) line, line_length);
+        }
+        line = line_end;
+    }
+}
+
+/* Returns whether a header line of a 304 replaces the stored headers of the
+ * same name, which all of them do but for the framing and hop-by-hop
+ * headers, and Age.  Nor does ETag, which the 304 can only confirm, and
+ * which the stored copy has in weak form if the proxy compressed it. */
+static bool updates_stored(char *line, size_t length) {
+    char *value;
+    return memchr(line, ':', length) != NULL &&
+        !header_is(line, length, "Transfer-Encoding", &value) &&
+        !header_is(line, length, "Content-Length", &value) &&
+        !header_is(line, length, "Connection", &value) &&
+        !header_is(line, length, "Keep-Alive", &value) &&
+        !header_is(line, length, "Age", &value) &&
+        !header_is(line, length, "ETag", &value);
+}
+
+void response_freshness(response_head_t *head, time_t now, time_t *date,
+        time_t *expires) {
+    /* The response was at least as old as the server said when it arrived,
+     * or as far behind our clock as its Date is */
+    time_t age = head->age;
+    if (head->date >= 0 && now - head->date > age) {
+        age = now - head->date;
+    }
+    *date = now - age;
+
+    time_t lifetime;
+    time_t sent = head->date >= 0 ? head->date : now;
+    if (head->no_cache) {
+        lifetime = 0;
+    }
+    else if (head->max_age >= 0) {
+        lifetime = head->max_age;
+    }
+    else if (head->expires >= 0) {
+        lifetime = head->expires - sent;
+    }
+    else if (head->last_modified >= 0) {
+        lifetime = (sent - head->last_modified) * HEURISTIC_PERCENT / 100;
+        if (lifetime > MAX_HEURISTIC_LIFETIME) {
+            lifetime = MAX_HEURISTIC_LIFETIME;
+        }
+    }
+    else {
+        lifetime = DEFAULT_LIFETIME;
+    }
+    *expires = *date + (lifetime > 0 ? lifetime : 0);
+}
+
+buffer_t *make_client_head(uint8_t *head_data, response_head_t *head,
+        bool keep_alive, time_t age) {
+    buffer_t *out = buffer_create(head->header_length + 64);
+    append_status_line(out, head_data, head);
+    append_headers(out, head_data, head, true, true);
+    if (age >= 0) {
+        char age_header[sizeof("Age: 18446744073709551615\r\n")];
+        int length = sprintf(age_header, "Age: %lld\r\n", (long long) age);
+        buffer_append_bytes(out, (uint8_t *) age_header, length);
+    }
+    char *connection = keep_alive ? "Connection: keep-alive\r\n\r\n"
+        : "Connection: close\r\n\r\n";
+    buffer_append_bytes(out, (uint8_t *) connection, strlen(connection));
+    return out;
+}
+
+buffer_t *make_dechunked_head(uint8_t *head_data, response_head_t *head) {
+    buffer_t *out = buffer_create(head->header_length + 64);
+    append_status_line(out, head_data, head);
+    append_headers(out, head_data, head, false, true);
+
+    /* Age went with the framing headers, but still holds */
+    size_t age_length;
+    char *age = find_header(head_data, head, "Age", &age_length);
+    if (age != NULL) {
+        buffer_append_bytes(out, (uint8_t *) "Age: ", strlen("Age: "));
+        buffer_append_bytes(out, (uint8_t *) age, age_length);
+        buffer_append_bytes(out, (uint8_t *) "\r\n", 2);
+    }
+    char *connection = "Connection: close\r\n\r\n";
+    buffer_append_bytes(out, (uint8_t *) connection, strlen(connection));
+    return out;
+}
+
+/* Appends a Content-Length header of body_length and the blank line */
+static void append_content_length(buffer_t *out, size_t body_length) {
+    char content_length[sizeof("Content-Length: 18446744073709551615\r\n\r\n")];
+    int length = sprintf(content_length, "Content-Length: %zu\r\n\r\n",
+        body_length);
+    buffer_append_bytes(out, (uint8_t *) content_length, length);
+}
+
+buffer_t *make_decompressed_head(uint8_t *head_data, response_head_t *head,
+        bool keep_alive, time_t age, size_t body_length) {
+    buffer_t *out = buffer_create(head->header_length + 96);
+    append_status_line(out, head_data, head);
+    append_headers(out, head_data, head, false, false);
+    char age_header[sizeof("Age: 18446744073709551615\r\n")];
+    int length = sprintf(age_header, "Age: %lld\r\n", (long long) age);
+    buffer_append_bytes(out, (uint8_t *) age_header, length);
+    char *connection = keep_alive ? "Connection: keep-alive\r\n"
+        : "Connection: close\r\n";
+    buffer_append_bytes(out, (uint8_t *) connection, strlen(connection));
+    append_content_length(out, body_length);
+    return out;
+}
+
+buffer_t *make_partial_head(uint8_t *head_data, response_head_t *head,
+        bool keep_alive, time_t age, bool decompressed, size_t first,
+        size_t length, size_t total) {
+    buffer_t *out = buffer_create(head->header_length + 160);
+    char *status = "HTTP/1.1 206 Partial Content\r\n";
+    buffer_append_bytes(out, (uint8_t *) status, strlen(status));
+    append_headers(out, head_data, head, false, !decompressed);
+    char range_headers[sizeof("Content-Range: bytes -/\r\nAge: \r\n") +
+        4 * sizeof("18446744073709551615")];
+    int range_length = sprintf(range_headers,
+        "Content-Range: bytes %zu-%zu/%zu\r\nAge: %lld\r\n", first,
+        first + length - 1, total, (long long) age);
+    buffer_append_bytes(out, (uint8_t *) range_headers, range_length);
+    char *connection = keep_alive ? "Connection: keep-alive\r\n"
+        : "Connection: close\r\n";
+    buffer_append_bytes(out, (uint8_t *) connection, strlen(connection));
+    append_content_length(out, length);
+    return out;
+}
+
+buffer_t *make_cached_head(uint8_t *head_data, response_head_t *head,
+        size_t body_length) {
+    buffer_t *cached = buffer_create(head->header_length + 32);
+    append_status_line(cached, head_data, head);
+    append_headers(cached, head_data, head, false, true);
+    append_content_length(cached, body_length);
+    return cached;
+}
+
+buffer_t *make_compressed_head(uint8_t *head_data, response_head_t *head,
+        size_t body_length) {
+    buffer_t *cached = buffer_create(head->header_length + 96);
+    append_status_line(cached, head_data, head);
+    append_headers(cached, head_data, head, false, false);
+    char *encoding = "Content-Encoding: gzip\r\n";
+    buffer_append_bytes(cached, (uint8_t *) encoding, strlen(encoding));
+
+    /* Let caches downstream know the encoding depends on the request */
+    size_t vary_length;
+    if (find_header(head_data, head, "Vary", &vary_length) == NULL) {
+        char *vary = "Vary: Accept-Encoding\r\n";
+        buffer_append_bytes(cached, (uint8_t *) vary, strlen(vary));
+    }
+    append_content_length(cached, body_length);
+    return cached;
+}
+
+buffer_t *make_conditional_request(buffer_t *request, uint8_t *head_data,
+        response_head_t *head) {
+    size_t etag_length, modified_length;
+    char *etag = find_header(head_data, head, "ETag", &etag_length);
+    char *modified = find_header(head_data, head, "Last-Modified",
+        &modified_length);
+    if (etag == NULL && modified == NULL) {
+        return NULL;
+    }
+
+    /* Add the validators just before the blank line */
+    buffer_t *out = buffer_create(buffer_length(request) + 128);
+    buffer_append_bytes(out, buffer_data(request), buffer_length(request) - 2);
+    if (etag != NULL) {
+        /* If-None-Match compares tags weakly anyway, so the tag goes as the
+         * server sent it, even if the stored copy made it weak */
+        if (etag_length > 2 && strncmp(etag, "W/", 2) == 0) {
+            etag += 2;
+            etag_length -= 2;
+        }
+        char *name = "If-None-Match: ";
+        buffer_append_bytes(out, (uint8_t *) name, strlen(name));
+        buffer_append_bytes(out, (uint8_t *) etag, etag_length);
+        buffer_append_bytes(out, (uint8_t *) "\r\n", 2);
+    }
+    if (modified != NULL) {
+        char *name = "If-Modified-Since: ";
+        buffer_append_bytes(out, (uint8_t *) name, strlen(name));
+        buffer_append_bytes(out, (uint8_t *) modified, modified_length);
+        buffer_append_bytes(out, (uint8_t *) "\r\n", 2);
+    }
+    buffer_append_bytes(out, (uint8_t *) "\r\n", 2);
+    return out;
+}
+
+buffer_t *make_revalidated_head(uint8_t *head_data, response_head_t *head,
+        uint8_t *update_data, response_head_t *update) {
+    buffer_t *out = buffer_create(head->header_length + update->header_length);
+
+    /* The stored status line and the headers the 304 doesn't replace */
+    char *line = (char *) head_data;
+    char *headers_end = (char *) head_data + head->header_length - 2;
+    for (bool status_line = true; line < headers_end; status_line = false) {
+        char *line_end = memmem(line, headers_end - line, "\r\n", 2) + 2;
+        size_t line_length = line_end - line;
+        char *colon = memchr(line, ':', line_length);
+        bool replaced = false;
+        if (!status_line && colon != NULL &&
+                updates_stored(line, line_length)) {
+            char name[colon - line + 1];
+            memcpy(name, line, colon - line);
+            name[colon - line] = '\0';
+            size_t length;
+            replaced = find_header(update_data, update, name, &length) != NULL;
+        }
+        if (!replaced) {
+            buffer_append_bytes(out, (uint8_t *) line, line_length);
+        }
+        line = line_end;
+    }
+
+    /* The headers of the 304, after its status line */
+    line = (char *) update_data;
+    headers_end = (char *) update_data + update->header_length - 2;
+    line = memmem(line, headers_end + 2 - line, "\r\n", 2) + 2;
+    while (line < headers_end) {
+        char *line_end = memmem(line, headers_end - line, "\r\n", 2) + 2;
+        if (updates_stored(line, line_end - line)) {
+            buffer_append_bytes(out, (uint8_t *) line, line_end - line);
+        }
+        line = line_end;
+    }
+    buffer_append_bytes(out, (uint8_t *) "\r\n", 2);
+    return out;
+}
+
+buffer_t *make_text_response(buffer_t *body, bool keep_alive) {
+    char *format =
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Type: text/plain\r\n"
+        "Content-Length: %zu\r\n"
+        "Cache-Control: no-store\r\n"
+        "Connection: %s\r\n"
+        "\r\n";
+    char head[strlen(format) + 32];
+    int length = sprintf(head, format, buffer_length(body),
+        keep_alive ? "keep-alive" : "close");
+    buffer_t *response = buffer_create(length + buffer_length(body));
+    buffer_append_bytes(response, (uint8_t *) head, length);
+    buffer_append_bytes(response, buffer_data(body), buffer_length(body));
+    return response;
+}
+
+buffer_t *make_unsatisfiable_response(size_t total, bool keep_alive) {
+    char *format =
+        "HTTP/1.1 416 Range Not Satisfiable\r\n"
+        "Content-Range: bytes */%zu\r\n"
+        "Content-Length: 0\r\n"
+        "Connection: %s\r\n"
+        "\r\n";
+    char response[strlen(format) + 32];
+    int length = sprintf(response, format, total,
+        keep_alive ? "keep-alive" : "close");
+    buffer_t *out = buffer_create(length);
+    buffer_append_bytes(out, (uint8_t *) response, length);
+    return out;
+}
+
+buffer_t *make_status_response(char *status, char *msg) {
+    char *format =
+        "HTTP/1.0 %s\r\n"
+        "Content-Type: text/html\r\n"
+        "Connection: close\r\n"
+        "\r\n"
+        "<html>"
+            "<head><title>%s</title></head>"
+            "<body>%s</body>"
+        "</html>";
+
+    /* Fill out the response template */
+    char response[strlen(format) + 2 * strlen(status) + strlen(msg)];
+    int length = sprintf(response, format, status, status, msg);
+    buffer_t *buf = buffer_create(length);
+    buffer_append_bytes(buf, (uint8_t *) response, length);
+    return buf;
+}
@@ -0,0 +1,186 @@
+#include "idle_clients.h"
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "client_thread.h"
+
+/* Most events handled per epoll_wait() */
+#define MAX_EVENTS 64
+
+typedef struct idle_conn_t idle_conn_t;
+
+/* A parked connection.  Every connection gets the same timeout, so the list
+ * of them in the order they were parked is also in order of deadline. */
+struct idle_conn_t {
+    int fd;
+    uint64_t deadline;
+    idle_conn_t *prev;
+    idle_conn_t *next;
+};
+
+struct idle_clients_t {
+    conn_queue_t *queue;
+    uint64_t idle_timeout;  /* microseconds */
+    int epoll_fd;
+    pthread_t thread;
+
+    /* Protects the list of parked connections */
+    pthread_mutex_t lock;
+    idle_conn_t *oldest;
+    idle_conn_t *newest;
+};
+
+/* Unlinks conn from the list.  The caller must hold the lock. */
+static void unlink_conn(idle_clients_t *idle, idle_conn_t *conn) {
+    if (conn->prev != NULL) {
+        conn->prev->next = conn->next;
+    }
+    else {
+        idle->oldest = conn->next;
+    }
+    if (conn->next != NULL) {
+        conn->next->prev = conn->prev;
+    }
+    else {
+        idle->newest = conn->prev;
+    }
+}
+
+/* Stops watching conn and hands it back to the workers */
+static void resume(idle_clients_t *idle, idle_conn_t *conn) {
+    if (epoll_ctl(idle->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL) < 0) {
+        verbose_printf("epoll_ctl error: %s\n", strerror(errno));
+    }
+    conn_queue_push_resumed(idle->queue, conn->fd);
+    free(conn);
+}
+
+/* Returns how many milliseconds to wait for events before the oldest
+ * connection is due to time out.  A connection parked while waiting is due
+ * no sooner than a full timeout from now, so it is never missed. */
+static int wait_timeout(idle_clients_t *idle) {
+    pthread_mutex_lock(&idle->lock);
+    uint64_t now = stats_now();
+    uint64_t wait = idle->idle_timeout;
+    if (idle->oldest != NULL) {
+        wait = idle->oldest->deadline > now ? idle->oldest->deadline - now : 0;
+    }
+    pthread_mutex_unlock(&idle->lock);
+    /* Round up, so the wait doesn't end just before the deadline */
+    return (wait + 999) / 1000;
+}
+
+/* Watcher thread: hands back connections as they become readable or time
+ * out */
+static void *watch(void *arg) {
+    idle_clients_t *idle = (idle_clients_t *) arg;
+    struct epoll_event events[MAX_EVENTS];
+    while (true) {
+        int num_events = epoll_wait(idle->epoll_fd, events, MAX_EVENTS,
+            wait_timeout(idle));
+        if (num_events < 0 && errno != EINTR) {
+            perror("epoll_wait error");
+            exit(1);
+        }
+        for (int i = 0; i < num_events; i++) {
+            idle_conn_t *conn = events[i].data.ptr;
+            pthread_mutex_lock(&idle->lock);
+            unlink_conn(idle, conn);
+            pthread_mutex_unlock(&idle->lock);
+            resume(idle, conn);
+        }
+
+        /* Take the connections that timed out off the list first, since
+         * handing them back may block until the workers catch up */
+        uint64_t now = stats_now();
+        pthread_mutex_lock(&idle->lock);
+        idle_conn_t *expired = idle->oldest;
+        idle_conn_t *conn = expired;
+        while (conn != NULL && conn->deadline <= now) {
+            conn = conn->next;
+        }
+        if (conn == expired) {
+            expired = NULL;
+        }
+        else if (conn == NULL) {
+            idle->oldest = NULL;
+            idle->newest = NULL;
+        }
+        else {
+            conn->prev->next = NULL;
+            conn->prev = NULL;
+            idle->oldest = conn;
+        }
+        pthread_mutex_unlock(&idle->lock);
+
+        while (expired != NULL) {
+            idle_conn_t *next = expired->next;
+            if (shutdown(expired->fd, SHUT_RD) < 0) {
+                verbose_printf("shutdown error: %s\n", strerror(errno));
+            }
+            resume(idle, expired);
+            expired = next;
+        }
+    }
+    return NULL;
+}
+
+idle_clients_t *idle_clients_create(conn_queue_t *queue, int idle_timeout) {
+    idle_clients_t *idle = calloc(1, sizeof(*idle));
+    assert(idle != NULL);
+    idle->queue = queue;
+    idle->idle_timeout = idle_timeout * 1000000ULL;
+    idle->epoll_fd = epoll_create1(0);
+    if (idle->epoll_fd < 0) {
+        perror("epoll_create1 error");
+        exit(1);
+    }
+    pthread_mutex_init(&idle->lock, NULL);
+    if (pthread_create(&idle->thread, NULL, watch, idle) != 0) {
+        perror("Could not start thread");
+        exit(1);
+    }
+    return idle;
+}
+
+bool idle_clients_park(idle_clients_t *idle, int client_fd) {
+    idle_conn_t *conn = calloc(1, sizeof(*conn));
+    assert(conn != NULL);
+    conn->fd = client_fd;
+
+    /* Link the connection in before it is watched, so the watcher never
+     * sees an event for one that isn't on the list */
+    pthread_mutex_lock(&idle->lock);
+    conn->deadline = stats_now() + idle->idle_timeout;
+    conn->prev = idle->newest;
+    if (idle->newest != NULL) {
+        idle->newest->next = conn;
+    }
+    else {
+        idle->oldest = conn;
+    }
+    idle->newest = conn;
+
+    /* One-shot, so the connection is reported once however much it sends */
+    struct epoll_event event = {
+        .events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT,
+        .data.ptr = conn
+    };
+    bool watched = epoll_ctl(idle->epoll_fd, EPOLL_CTL_ADD, client_fd,
+        &event) == 0;
+    if (!watched) {
+        verbose_printf("epoll_ctl error: %s\n", strerror(errno));
+        unlink_conn(idle, conn);
+        free(conn);
+    }
+    pthread_mutex_unlock(&idle->lock);
+    return watched;
+}
@@ -0,0 +1,251 @@
+#include "origin_pool.h"
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Number of hash bins, each with its own lock */
+#define POOL_BINS 64
+
+typedef struct idle_conn_t idle_conn_t;
+typedef struct origin_t origin_t;
+
+/* An idle connection, in a per-origin stack with the most recently used on
+ * top, since it is the least likely to have been closed by the server */
+struct idle_conn_t {
+    int fd;
+    time_t idle_since;
+    idle_conn_t *next;
+};
+
+struct origin_t {
+    char *name;
+    size_t num_idle;
+    idle_conn_t *idle;
+    origin_t *next;
+};
+
+typedef struct {
+    pthread_mutex_t lock;
+    origin_t *origins;
+} pool_bin_t;
+
+struct origin_pool_t {
+    size_t max_idle;
+    int idle_timeout;
+    pool_bin_t bins[POOL_BINS];
+
+    /* The reaper thread sleeps on reaper_wake until it is time to sweep or
+     * the pool is being freed */
+    pthread_t reaper;
+    pthread_mutex_t reaper_lock;
+    pthread_cond_t reaper_wake;
+    bool stopping;
+};
+
+/* Hash an origin name into a bin. */
+static size_t origin_hash(char *name) {
+    size_t hash = 5381;
+    int c;
+    while ((c = *name++)) {
+        hash = ((hash << 5) + hash) + c;
+    }
+    return hash % POOL_BINS;
+}
+
+static time_t now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+/* Returns whether an idle connection is still usable: the server must not
+ * have closed it or sent anything unsolicited */
+static bool still_open(int fd) {
+    uint8_t c;
+    ssize_t result = recv(fd, &c, sizeof(c), MSG_PEEK | MSG_DONTWAIT);
+    return result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/* Closes the origin's connections that have been idle since before cutoff.
+ * The caller must hold the bin's lock. */
+static void close_expired(origin_t *origin, time_t cutoff) {
+    idle_conn_t **link = &origin->idle;
+    while (*link != NULL) {
+        idle_conn_t *conn = *link;
+        if (conn->idle_since < cutoff) {
+            *link = conn->next;
+            close(conn->fd);
+            free(conn);
+            origin->num_idle--;
+        }
+        else {
+            link = &conn->next;
+        }
+    }
+}
+
+/* Sweeps one bin, closing expired connections and forgetting origins with no
+ * idle connections left */
+static void sweep_bin(pool_bin_t *bin, time_t cutoff) {
+    pthread_mutex_lock(&bin->lock);
+    origin_t **link = &bin->origins;
+    while (*link != NULL) {
+        origin_t *origin = *link;
+        close_expired(origin, cutoff);
+        if (origin->num_idle == 0) {
+            *link = origin->next;
+            free(origin->name);
+            free(origin);
+        }
+        else {
+            link = &origin->next;
+        }
+    }
+    pthread_mutex_unlock(&bin->lock);
+}
+
+/* Periodically closes connections that have been idle too long, including
+ * those to origins nobody asks for anymore */
+static void *reap_idle(void *arg) {
+    origin_pool_t *pool = (origin_pool_t *) arg;
+    int interval = pool->idle_timeout > 1 ? pool->idle_timeout / 2 : 1;
+
+    pthread_mutex_lock(&pool->reaper_lock);
+    while (!pool->stopping) {
+        struct timespec wake_at;
+        clock_gettime(CLOCK_REALTIME, &wake_at);
+        wake_at.tv_sec += interval;
+        pthread_cond_timedwait(&pool->reaper_wake, &pool->reaper_lock, &wake_at);
+        if (pool->stopping) {
+            break;
+        }
+
+        time_t cutoff = now() - pool->idle_timeout;
+        for (size_t i = 0; i < POOL_BINS; i++) {
+            sweep_bin(&pool->bins[i], cutoff);
+        }
+    }
+    pthread_mutex_unlock(&pool->reaper_lock);
+    return NULL;
+}
+
+origin_pool_t *origin_pool_create(size_t max_idle, int idle_timeout) {
+    origin_pool_t *pool = malloc(sizeof(*pool));
+    assert(pool != NULL);
+    pool->max_idle = max_idle;
+    pool->idle_timeout = idle_timeout;
+    pool->stopping = false;
+    for (size_t i = 0; i < POOL_BINS; i++) {
+        pthread_mutex_init(&pool->bins[i].lock, NULL);
+        pool->bins[i].origins = NULL;
+    }
+    pthread_mutex_init(&pool->reaper_lock, NULL);
+    pthread_cond_init(&pool->reaper_wake, NULL);
+    if (max_idle > 0) {
+        pthread_create(&pool->reaper, NULL, reap_idle, pool);
+    }
+    return pool;
+}
+
+void origin_pool_free(origin_pool_t *pool) {
+    if (pool == NULL) {
+        return;
+    }
+
+    if (pool->max_idle > 0) {
+        pthread_mutex_lock(&pool->reaper_lock);
+        pool->stopping = true;
+        pthread_cond_signal(&pool->reaper_wake);
+        pthread_mutex_unlock(&pool->reaper_lock);
+        pthread_join(pool->reaper, NULL);
+    }
+    pthread_cond_destroy(&pool->reaper_wake);
+    pthread_mutex_destroy(&pool->reaper_lock);
+
+    for (size_t i = 0; i < POOL_BINS; i++) {
+        /* Every connection has expired by the end of time */
+        sweep_bin(&pool->bins[i], INT64_MAX);
+        pthread_mutex_destroy(&pool->bins[i].lock);
+    }
+    free(pool);
+}
+
+/* Finds the entry for an origin, creating it if create is set.  The caller
+ * must hold the bin's lock. */
+static origin_t *find_origin(pool_bin_t *bin, char *name, bool create) {
+    origin_t *origin = bin->origins;
+    while (origin != NULL && strcmp(origin->name, name) != 0) {
+        origin = origin->next;
+    }
+    if (origin == NULL && create) {
+        origin = malloc(sizeof(*origin));
+        assert(origin != NULL);
+        origin->name = strdup(name);
+        assert(origin->name != NULL);
+        origin->num_idle = 0;
+        origin->idle = NULL;
+        origin->next = bin->origins;
+        bin->origins = origin;
+    }
+    return origin;
+}
+
+int origin_pool_get(origin_pool_t *pool, char *origin_name) {
+    if (pool->max_idle == 0) {
+        return -1;
+    }
+
+    pool_bin_t *bin = &pool->bins[origin_hash(origin_name)];
+    time_t cutoff = now() - pool->idle_timeout;
+    int server_fd = -1;
+
+    pthread_mutex_lock(&bin->lock);
+    origin_t *origin = find_origin(bin, origin_name, false);
+    while (origin != NULL && origin->idle != NULL && server_fd < 0) {
+        idle_conn_t *conn = origin->idle;
+        origin->idle = conn->next;
+        origin->num_idle--;
+        if (conn->idle_since >= cutoff && still_open(conn->fd)) {
+            server_fd = conn->fd;
+        }
+        else {
+            close(conn->fd);
+        }
+        free(conn);
+    }
+    pthread_mutex_unlock(&bin->lock);
+    return server_fd;
+}
+
+void origin_pool_put(origin_pool_t *pool, char *origin_name, int server_fd) {
+    if (pool->max_idle == 0) {
+        close(server_fd);
+        return;
+    }
+
+    pool_bin_t *bin = &pool->bins[origin_hash(origin_name)];
+    pthread_mutex_lock(&bin->lock);
+    origin_t *origin = find_origin(bin, origin_name, true);
+    close_expired(origin, now() - pool->idle_timeout);
+    if (origin->num_idle >= pool->max_idle) {
+        pthread_mutex_unlock(&bin->lock);
+        close(server_fd);
+        return;
+    }
+
+    idle_conn_t *conn = malloc(sizeof(*conn));
+    assert(conn != NULL);
+    conn->fd = server_fd;
+    conn->idle_since = now();
+    conn->next = origin->idle;
+    origin->idle = conn;
+    origin->num_idle++;
+    pthread_mutex_unlock(&bin->lock);
+}
@@ -1,6 +1,10 @@
+#define _GNU_SOURCE
+
 #include <assert.h>
+#include <fcntl.h>
 #include <netinet/in.h>
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -12,11 +16,77 @@
 
 #include "client_thread.h"
 #include "cache.h"
+#include "conn_queue.h"
+#include "event_loop.h"
+#include "warmup.h"
 
 /* Maximum number of connections to queue up */
 #define LISTENQ 1024
 
-static int open_listen_fd(int port) {
+/* Number of independently locked cache shards, unless overridden with -s */
+#define DEFAULT_SHARDS 8
+#define MAX_SHARDS 256
+
+/* Size of the worker pool and of the queue of accepted connections waiting
+ * for a worker, unless overridden with -t and -q.  In epoll mode, -t is the
+ * number of event loop threads and defaults to one per CPU instead. */
+#define DEFAULT_WORKERS 32
+#define MAX_WORKERS 4096
+#define DEFAULT_QUEUE_DEPTH 1024
+#define MAX_QUEUE_DEPTH (1 << 20)
+
+/* Bytes the cache may hold, the size from which objects aren't cached, and
+ * how entries are evicted, unless overridden with -c, -o and -e */
+#define DEFAULT_CACHE_SIZE (1024 * 1024)
+#define DEFAULT_MAX_OBJECT_SIZE (100 * 1024)
+#define MAX_CACHE_SIZE (1L << 40)
+#define DEFAULT_POLICY CACHE_LRU
+
+/* Size of the disk tier enabled with -d, unless overridden with -D */
+#define DEFAULT_DISK_SIZE (256L * 1024 * 1024)
+
+/* Idle keep-alive connections kept per origin server and how many seconds
+ * they may sit idle, unless overridden with -p and -i */
+#define DEFAULT_POOL_SIZE 8
+#define MAX_POOL_SIZE 1024
+#define DEFAULT_IDLE_TIMEOUT 30
+#define MAX_IDLE_TIMEOUT 3600
+
+/* URLs of the list given with -w fetched at a time, unless overridden with
+ * -W */
+#define DEFAULT_WARMUP_FETCHES 8
+#define MAX_WARMUP_FETCHES 256
+
+/* Most connections or fetches one client or server may have at once, and
+ * requests per second it may make, as set with -l, -L, -u and -U.  None are
+ * limited by default. */
+#define MAX_THROTTLE_ACTIVE 1000000
+#define MAX_THROTTLE_RATE 1000000
+
+/* Threads running DNS lookups, and how many seconds their answers are
+ * remembered */
+#define DNS_THREADS 4
+#define DNS_TTL 60
+
+/* How connections are served, chosen with -m */
+typedef enum {
+    MODE_THREADS,  /* a worker thread blocks on each connection */
+    MODE_EPOLL     /* a few event loop threads multiplex non-blocking sockets */
+} serve_mode_t;
+
+/* State shared by every worker or event loop thread.  With -r, each thread
+ * accepting connections gets a copy with its own listen socket and the CPU
+ * it is pinned to. */
+typedef struct {
+    int listen_fd;
+    int cpu; /* -1 if the thread isn't pinned */
+    conn_queue_t *queue;
+    proxy_context_t context;
+} worker_args_t;
+
+/* Opens a socket listening on port.  With reuse_port, other sockets may
+ * listen on the same port, and the kernel spreads connections across them. */
+static int open_listen_fd(int port, bool reuse_port) {
     /* Create a socket descriptor */
     int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
     if (listen_fd < 0) {
@@ -28,6 +98,10 @@ static int open_listen_fd(int port) {
     if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &value, sizeof(value)) < 0) {
         return -1;
     }
+    if (reuse_port && setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &value,
+            sizeof(value)) < 0) {
+        return -1;
+    }
 
     /* listen_fd will be an endpoint for all requests to port
        on any IP address for this host */
@@ -48,6 +122,164 @@ static int open_listen_fd(int port) {
     return listen_fd;
 }
 
+/* Pins the calling thread to a CPU, unless cpu is -1 */
+static void pin_to_cpu(int cpu) {
+    if (cpu < 0) {
+        return;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (err != 0) {
+        verbose_printf("Could not pin thread to CPU %d: %s\n", cpu,
+            strerror(err));
+    }
+}
+
+/* Returns the index-th CPU in allowed, wrapping around once they run out */
+static int nth_cpu(cpu_set_t *allowed, long index) {
+    index %= CPU_COUNT(allowed);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, allowed) && index-- == 0) {
+            return cpu;
+        }
+    }
+    return -1;
+}
+
+/* Worker thread: serves connections from the accept queue forever */
+static void *worker(void *args) {
+    worker_args_t *worker_args = (worker_args_t *) args;
+    while (true) {
+        bool resumed;
+        int client_fd = conn_queue_pop(worker_args->queue, &resumed);
+        handle_request(client_fd, &worker_args->context, resumed);
+    }
+    return NULL;
+}
+
+/* Acceptor thread: accepts connections on its listen socket and hands them
+ * to the worker threads */
+static void *acceptor(void *args) {
+    worker_args_t *worker_args = (worker_args_t *) args;
+    pin_to_cpu(worker_args->cpu);
+    while (true) {
+        int client_fd = accept(worker_args->listen_fd, NULL, NULL);
+        if (client_fd == -1) {
+            perror("Accept error");
+            continue;
+        }
+
+        /* Every worker is busy and the queue is full, so shed the
+         * connection right away instead of letting it wait indefinitely */
+        if (!conn_queue_try_push(worker_args->queue, client_fd)) {
+            verbose_printf("Queue full, rejecting connection\n");
+            send_status_code(client_fd, "503 Service Unavailable",
+                "The proxy is overloaded. Try again later.");
+            close(client_fd);
+        }
+    }
+    return NULL;
+}
+
+/* Event loop thread: runs its own epoll loop on its listen socket, which
+ * every loop shares unless they were given one each */
+static void *event_loop_thread(void *args) {
+    worker_args_t *worker_args = (worker_args_t *) args;
+    pin_to_cpu(worker_args->cpu);
+    int flags = fcntl(worker_args->listen_fd, F_GETFL);
+    if (flags < 0 || fcntl(worker_args->listen_fd, F_SETFL,
+            flags | O_NONBLOCK) < 0) {
+        perror("fcntl error");
+        exit(1);
+    }
+    run_event_loop(worker_args->listen_fd, &worker_args->context);
+    return NULL;
+}
+
+/* Starts num_threads detached threads running start_routine.
+ * Returns whether successful */
+static bool start_threads(long num_threads, void *(*start_routine)(void *),
+        worker_args_t *args) {
+    for (long i = 0; i < num_threads; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, start_routine, args) != 0) {
+            perror("Could not start thread");
+            return false;
+        }
+        pthread_detach(tid);
+    }
+    return true;
+}
+
+/* Starts num_threads - 1 detached threads running start_routine, giving
+ * each its own SO_REUSEPORT listen socket on port and its own CPU to be
+ * pinned to.  The calling thread, which is to run start_routine too, keeps
+ * args->listen_fd and gets the first CPU.  Returns whether successful */
+static bool start_listener_threads(long num_threads,
+        void *(*start_routine)(void *), worker_args_t *args, int port) {
+    cpu_set_t allowed;
+    bool pin = sched_getaffinity(0, sizeof(allowed), &allowed) == 0 &&
+        CPU_COUNT(&allowed) > 0;
+    for (long i = 1; i < num_threads; i++) {
+        worker_args_t *thread_args = malloc(sizeof(*thread_args));
+        assert(thread_args != NULL);
+        *thread_args = *args;
+        thread_args->listen_fd = open_listen_fd(port, true);
+        if (thread_args->listen_fd < 0) {
+            perror("Listen error");
+            return false;
+        }
+        thread_args->cpu = pin ? nth_cpu(&allowed, i) : -1;
+
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, start_routine, thread_args) != 0) {
+            perror("Could not start thread");
+            return false;
+        }
+        pthread_detach(tid);
+    }
+    args->cpu = pin ? nth_cpu(&allowed, 0) : -1;
+    return true;
+}
+
+/* Accepts connections on num_acceptors threads (one of which is the calling
+ * thread), each with its own listen socket if there are several, and hands
+ * them to a fixed pool of worker threads */
+static void run_thread_pool(worker_args_t *args, long num_workers,
+        long queue_depth, long num_acceptors, int port) {
+    args->queue = conn_queue_create(queue_depth);
+    args->context.idle = idle_clients_create(args->queue, CLIENT_IDLE_TIMEOUT);
+
+    /* Start a fixed pool of workers up front instead of a thread per
+     * connection, so a burst of connections queues up rather than spawning
+     * thousands of threads */
+    if (!start_threads(num_workers, worker, args)) {
+        exit(1);
+    }
+
+    if (num_acceptors > 1 &&
+            !start_listener_threads(num_acceptors, acceptor, args, port)) {
+        exit(1);
+    }
+    acceptor(args);
+}
+
+/* Serves connections from num_loops event loops, one of which runs on the
+ * calling thread.  With reuse_port, each loop accepts on its own listen
+ * socket. */
+static void run_event_loops(worker_args_t *args, long num_loops, int port,
+        bool reuse_port) {
+    bool started = reuse_port
+        ? start_listener_threads(num_loops, event_loop_thread, args, port)
+        : start_threads(num_loops - 1, event_loop_thread, args);
+    if (!started) {
+        exit(1);
+    }
+    event_loop_thread(args);
+}
+
 static void cleanup(void) {
 }
 
@@ -57,27 +289,274 @@ static void sigint_handler(int sig) {
 }
 
 static void usage(char *program) {
-    printf("Usage: %s <port>\n", program);
+    printf("Usage: %s [-m threads|epoll] [-s shards] [-t threads] [-q depth]\n"
+           "       [-p connections] [-i seconds] [-c bytes] [-o bytes]\n"
+           "       [-e lru|slru|tinylfu] [-d directory] [-D bytes] [-r] [-z]\n"
+           "       [-w file] [-W fetches] [-l conns] [-L rate] [-u fetches]\n"
+           "       [-U rate] <port>\n",
+        program);
+    printf("  -m mode     serve each connection on a worker thread (threads, the\n"
+           "              default) or multiplex them on event loops (epoll)\n");
+    printf("  -s shards   number of cache shards (1-%d, default %d)\n",
+        MAX_SHARDS, DEFAULT_SHARDS);
+    printf("  -t threads  number of worker threads (1-%d, default %d), or of event\n"
+           "              loops in epoll mode (default one per CPU).  A client\n"
+           "              only holds a worker while a request is in progress,\n"
+           "              and has %d seconds to send each one\n",
+        MAX_WORKERS, DEFAULT_WORKERS, CLIENT_IDLE_TIMEOUT);
+    printf("  -q depth    accepted connections that may wait for a worker\n"
+           "              before new ones get a 503 (1-%d, default %d)\n",
+        MAX_QUEUE_DEPTH, DEFAULT_QUEUE_DEPTH);
+    printf("  -p conns    idle keep-alive connections kept per origin server\n"
+           "              (0-%d, default %d, 0 disables reuse)\n",
+        MAX_POOL_SIZE, DEFAULT_POOL_SIZE);
+    printf("  -i seconds  how long an idle origin connection is kept (1-%d,\n"
+           "              default %d)\n",
+        MAX_IDLE_TIMEOUT, DEFAULT_IDLE_TIMEOUT);
+    printf("  -c bytes    total size of the cache, with an optional K, M or G\n"
+           "              suffix (default 1M)\n");
+    printf("  -o bytes    size from which responses aren't cached (default 100K)\n");
+    printf("  -e policy   how the cache evicts: least recently used (lru, the\n"
+           "              default), segmented LRU (slru), or segmented LRU that\n"
+           "              only admits URLs requested more often than what they\n"
+           "              would evict (tinylfu)\n");
+    printf("  -d dir      keep entries evicted from memory in segment files in\n"
+           "              dir, and reload them from there on startup\n");
+    printf("  -D bytes    total size of the segment files (default 256M)\n");
+    printf("  -r          accept connections on one SO_REUSEPORT listen socket\n"
+           "              per event loop, or per CPU in threads mode, each on a\n"
+           "              thread pinned to its own CPU\n");
+    printf("  -z          store text bodies compressed with gzip, and decompress\n"
+           "              them for clients that don't accept gzip\n");
+    printf("  -w file     before serving, warm up the cache by fetching every URL\n"
+           "              listed in file, one per line, like tests/http-sites\n");
+    printf("  -W fetches  URLs fetched at a time while warming up (1-%d,\n"
+           "              default %d)\n",
+        MAX_WARMUP_FETCHES, DEFAULT_WARMUP_FETCHES);
+    printf("  -l conns    connections one client address may have open at once,\n"
+           "              beyond which it gets a 429 (default unlimited).  In\n"
+           "              threads mode, idle keep-alive ones don't count\n");
+    printf("  -L rate     requests per second one client address may make, in\n"
+           "              bursts of up to a second's worth (default unlimited)\n");
+    printf("  -u fetches  requests one server may be sent at once, beyond which\n"
+           "              clients get a 503 (default unlimited)\n");
+    printf("  -U rate     requests per second one server may be sent (default\n"
+           "              unlimited)\n");
     exit(1);
 }
 
+/* Parses a positive integer option argument no greater than max.
+ * Returns -1 if it is malformed or out of range. */
+static long parse_count(char *arg, long max) {
+    char *end;
+    long value = strtol(arg, &end, 10);
+    if (*arg == '\0' || *end != '\0' || value <= 0 || value > max) {
+        return -1;
+    }
+    return value;
+}
+
+/* Parses a positive byte count option argument, optionally followed by K, M
+ * or G, no greater than max.  Returns -1 if it is malformed or out of
+ * range. */
+static long parse_size(char *arg, long max) {
+    char *end;
+    long value = strtol(arg, &end, 10);
+    int shift = 0;
+    switch (*end) {
+        case 'K':
+        case 'k':
+            shift = 10;
+            break;
+        case 'M':
+        case 'm':
+            shift = 20;
+            break;
+        case 'G':
+        case 'g':
+            shift = 30;
+            break;
+    }
+    if (shift > 0) {
+        end++;
+    }
+    if (*arg == '\0' || *end != '\0' || value <= 0 || value > (max >> shift)) {
+        return -1;
+    }
+    return value << shift;
+}
+
 int main(int argc, char *argv[]) {
     /* Ignore broken pipes */
     signal(SIGPIPE, SIG_IGN);
     /* Stop process when CTRL+C is pressed */
     signal(SIGINT, sigint_handler);
 
-    if (argc != 2) {
+    serve_mode_t mode = MODE_THREADS;
+    long num_shards = DEFAULT_SHARDS;
+    long num_workers = -1;
+    long queue_depth = DEFAULT_QUEUE_DEPTH;
+    long pool_size = DEFAULT_POOL_SIZE;
+    long idle_timeout = DEFAULT_IDLE_TIMEOUT;
+    long cache_size = DEFAULT_CACHE_SIZE;
+    long max_object_size = DEFAULT_MAX_OBJECT_SIZE;
+    cache_policy_t policy = DEFAULT_POLICY;
+    char *disk_dir = NULL;
+    long disk_size = DEFAULT_DISK_SIZE;
+    bool reuse_port = false;
+    bool compress = false;
+    FILE *warmup_file = NULL;
+    long warmup_fetches = DEFAULT_WARMUP_FETCHES;
+    long client_conns = 0, client_rate = 0;
+    long origin_fetches = 0, origin_rate = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "m:s:t:q:p:i:c:o:e:d:D:rzw:W:l:L:u:U:"))
+            != -1) {
+        switch (opt) {
+            case 'm':
+                if (strcmp(optarg, "threads") == 0) {
+                    mode = MODE_THREADS;
+                }
+                else if (strcmp(optarg, "epoll") == 0) {
+                    mode = MODE_EPOLL;
+                }
+                else {
+                    usage(argv[0]);
+                }
+                break;
+            case 's':
+                num_shards = parse_count(optarg, MAX_SHARDS);
+                if (num_shards < 0) {
+                    usage(argv[0]);
+                }
+                break;
+            case 't':
+                num_workers = parse_count(optarg, MAX_WORKERS);
+                if (num_workers < 0) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'q':
+                queue_depth = parse_count(optarg, MAX_QUEUE_DEPTH);
+                if (queue_depth < 0) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'p':
+                /* 0 is allowed here, to turn pooling off */
+                pool_size = strcmp(optarg, "0") == 0 ? 0
+                    : parse_count(optarg, MAX_POOL_SIZE);
+                if (pool_size < 0) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'i':
+                idle_timeout = parse_count(optarg, MAX_IDLE_TIMEOUT);
+                if (idle_timeout < 0) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'c':
+                cache_size = parse_size(optarg, MAX_CACHE_SIZE);
+                if (cache_size < 0) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'o':
+                max_object_size = parse_size(optarg, MAX_CACHE_SIZE);
+                if (max_object_size < 0) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'e':
+                if (strcmp(optarg, "lru") == 0) {
+                    policy = CACHE_LRU;
+                }
+                else if (strcmp(optarg, "slru") == 0) {
+                    policy = CACHE_SLRU;
+                }
+                else if (strcmp(optarg, "tinylfu") == 0) {
+                    policy = CACHE_TINYLFU;
+                }
+                else {
+                    usage(argv[0]);
+                }
+                break;
+            case 'd':
+                disk_dir = optarg;
+                break;
+            case 'D':
+                disk_size = parse_size(optarg, MAX_CACHE_SIZE);
+                if (disk_size < 0) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'r':
+                reuse_port = true;
+                break;
+            case 'z':
+                compress = true;
+                break;
+            case 'w':
+                warmup_file = fopen(optarg, "r");
+                if (warmup_file == NULL) {
+                    perror("Could not open warm-up URLs");
+                    return 1;
+                }
+                break;
+            case 'W':
+                warmup_fetches = parse_count(optarg, MAX_WARMUP_FETCHES);
+                if (warmup_fetches < 0) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'l':
+                client_conns = parse_count(optarg, MAX_THROTTLE_ACTIVE);
+                if (client_conns < 0) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'L':
+                client_rate = parse_count(optarg, MAX_THROTTLE_RATE);
+                if (client_rate < 0) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'u':
+                origin_fetches = parse_count(optarg, MAX_THROTTLE_ACTIVE);
+                if (origin_fetches < 0) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'U':
+                origin_rate = parse_count(optarg, MAX_THROTTLE_RATE);
+                if (origin_rate < 0) {
+                    usage(argv[0]);
+                }
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (argc - optind != 1) {
         usage(argv[0]);
     }
 
-    int port = atoi(argv[1]);
+    if (num_workers < 0) {
+        num_workers = mode == MODE_EPOLL ? sysconf(_SC_NPROCESSORS_ONLN)
+            : DEFAULT_WORKERS;
+        if (num_workers < 1) {
+            num_workers = 1;
+        }
+    }
+
+    int port = atoi(argv[optind]);
     if (port <= 0 || port > 65535) {
         usage(argv[0]);
     }
 
     /* Open listen socket */
-    int listen_fd = open_listen_fd(port);
+    int listen_fd = open_listen_fd(port, reuse_port);
     if (listen_fd < 0) {
         perror("Listen error");
         return 1;
@@ -89,19 +568,53 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    printf("Proxy listening on port %d\n", port);
+    printf("Proxy listening on port %d (%ld cache shards, %ld %s)\n",
+        port, num_shards, num_workers,
+        mode == MODE_EPOLL ? "event loops" : "workers");
 
-	pthread_t tid;
-    while (true) {
-        int *cfd = malloc(sizeof(int));
-        assert(cfd != NULL);
-        *cfd = accept(listen_fd, NULL, NULL);
-        if (*cfd == -1) {
-            perror("Accept error");
-            free(cfd);
-            continue;
+    /* The disk tier, if any, warms up from what the last run left behind */
+    disk_cache_t *disk = NULL;
+    if (disk_dir != NULL) {
+        disk = disk_cache_create(disk_dir, disk_size);
+        if (disk == NULL) {
+            perror("Could not open disk cache");
+            return 1;
         }
-		pthread_create(&tid, NULL, handle_request, cfd);
-		pthread_detach(tid);
+    }
+
+    /* One cache, one pool of origin connections, one DNS cache and one table
+     * of fetches in flight are shared by every thread, which all update the
+     * same statistics and are held to the same limits */
+    worker_args_t args;
+    args.listen_fd = listen_fd;
+    args.cpu = -1;
+    args.queue = NULL;
+    args.context.cache = init_cache(num_shards, cache_size, max_object_size,
+        policy, disk);
+    args.context.pool = origin_pool_create(pool_size, idle_timeout);
+    args.context.dns = dns_cache_create(DNS_THREADS, DNS_TTL);
+    args.context.flights = flight_table_create();
+    args.context.stats = stats_create();
+    args.context.throttle = throttle_create();
+    throttle_set(args.context.throttle, THROTTLE_CLIENT, client_conns,
+        client_rate);
+    throttle_set(args.context.throttle, THROTTLE_ORIGIN, origin_fetches,
+        origin_rate);
+    args.context.compress = compress;
+    args.context.idle = NULL;
+
+    /* Connections wait in the listen socket's backlog until the cache is
+     * warm */
+    if (warmup_file != NULL) {
+        warm_cache(warmup_file, warmup_fetches, &args.context);
+    }
+
+    if (mode == MODE_EPOLL) {
+        run_event_loops(&args, num_workers, port, reuse_port);
+    }
+    else {
+        /* With -r, there is an acceptor per CPU */
+        long num_acceptors = reuse_port ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+        run_thread_pool(&args, num_workers, queue_depth, num_acceptors, port);
     }
 }
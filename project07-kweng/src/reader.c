@@ -0,0 +1,142 @@
+#define _GNU_SOURCE
+
+#include "reader.h"
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Size of each read() and the initial size of the buffer */
+#define READ_SIZE 16384
+
+/* Longest line we are willing to buffer */
+#define MAX_LINE_LENGTH (64 * 1024)
+
+struct reader_t {
+    int fd;
+    uint8_t *data;
+    size_t capacity;
+    /* Bytes in [start, end) have been read but not handed out yet */
+    size_t start;
+    size_t end;
+    /* The byte after the last line handed out was overwritten with a '\0'
+     * and must be put back before the buffer is used again */
+    bool has_saved;
+    size_t saved_index;
+    uint8_t saved;
+};
+
+reader_t *reader_create(int fd) {
+    reader_t *reader = malloc(sizeof(*reader));
+    assert(reader != NULL);
+    reader->fd = fd;
+    reader->capacity = READ_SIZE;
+    /* One extra byte so even a line filling the buffer can be terminated */
+    reader->data = malloc(reader->capacity + 1);
+    assert(reader->data != NULL);
+    reader->start = 0;
+    reader->end = 0;
+    reader->has_saved = false;
+    return reader;
+}
+
+void reader_free(reader_t *reader) {
+    if (reader == NULL) {
+        return;
+    }
+
+    free(reader->data);
+    free(reader);
+}
+
+/* Makes room after end for more data, by sliding the unread bytes to the
+ * front of the buffer or growing it.  Returns false if the unread bytes
+ * already fill the largest buffer we allow. */
+static bool reader_make_room(reader_t *reader) {
+    if (reader->end < reader->capacity) {
+        return true;
+    }
+    if (reader->start > 0) {
+        memmove(reader->data, reader->data + reader->start,
+            reader->end - reader->start);
+        reader->end -= reader->start;
+        reader->start = 0;
+        return true;
+    }
+    if (reader->capacity >= MAX_LINE_LENGTH) {
+        return false;
+    }
+    reader->capacity *= 2;
+    reader->data = realloc(reader->data, reader->capacity + 1);
+    assert(reader->data != NULL);
+    return true;
+}
+
+/* Puts back the byte overwritten to terminate the last line handed out */
+static void reader_restore(reader_t *reader) {
+    if (reader->has_saved) {
+        reader->data[reader->saved_index] = reader->saved;
+        reader->has_saved = false;
+    }
+}
+
+char *reader_read_line(reader_t *reader, size_t *length) {
+    reader_restore(reader);
+
+    /* Bytes from start that are known not to contain \r\n */
+    size_t scanned = 0;
+    while (true) {
+        /* Back up one byte in case a \r\n straddles the previous read */
+        size_t from = scanned > 0 ? scanned - 1 : 0;
+        uint8_t *newline = memmem(reader->data + reader->start + from,
+            reader->end - reader->start - from, "\r\n", 2);
+        if (newline != NULL) {
+            char *line = (char *) reader->data + reader->start;
+            *length = newline + 2 - (uint8_t *) line;
+            reader->start += *length;
+
+            reader->has_saved = true;
+            reader->saved_index = reader->start;
+            reader->saved = reader->data[reader->start];
+            reader->data[reader->start] = '\0';
+            return line;
+        }
+        scanned = reader->end - reader->start;
+
+        if (!reader_make_room(reader)) {
+            return NULL;
+        }
+        ssize_t bytes_read = read(reader->fd, reader->data + reader->end,
+            reader->capacity - reader->end);
+        if (bytes_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read <= 0) {
+            return NULL;
+        }
+        reader->end += bytes_read;
+    }
+}
+
+bool reader_wait(reader_t *reader) {
+    reader_restore(reader);
+    while (reader->start == reader->end) {
+        reader->start = 0;
+        reader->end = 0;
+        ssize_t bytes_read = read(reader->fd, reader->data, reader->capacity);
+        if (bytes_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read <= 0) {
+            return false;
+        }
+        reader->end = bytes_read;
+    }
+    return true;
+}
+
+bool reader_has_data(reader_t *reader) {
+    return reader->start < reader->end;
+}
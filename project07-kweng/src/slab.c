@@ -0,0 +1,252 @@
+#include "slab.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/* Size of the smallest chunks, and how much bigger each size class is than
+ * the one before it */
+#define MIN_CHUNK_SIZE 64
+#define GROWTH_PERCENT 125
+#define MAX_CLASSES 64
+
+/* Every chunk size is a multiple of this, so chunks stay aligned */
+#define CHUNK_ALIGN 16
+
+/* Size of a page, which is also the largest chunk carved out of one */
+#define PAGE_SIZE (16 * 1024)
+
+/* Page classes besides the size classes: a page not in use, the first page
+ * of a run handed out as one chunk, and the other pages of such a run */
+#define PAGE_UNUSED (-1)
+#define PAGE_RUN (-2)
+#define PAGE_RUN_REST (-3)
+
+typedef struct free_chunk_t free_chunk_t;
+typedef struct page_t page_t;
+
+/* A returned chunk, which stores the free list in itself */
+struct free_chunk_t {
+    free_chunk_t *next;
+};
+
+/* Bookkeeping for one page, kept outside the page itself */
+struct page_t {
+    int class_index;            /* size class, or one of the PAGE_ values */
+    size_t used;                /* chunks handed out, or pages in the run */
+    size_t carved;              /* chunks ever handed out since the page was
+                                 * given its class; the rest are untouched */
+    free_chunk_t *free_chunks;  /* chunks that were returned */
+
+    /* In the list of pages of its class with chunks left, or in the list of
+     * unused pages */
+    page_t *prev;
+    page_t *next;
+};
+
+typedef struct {
+    size_t chunk_size;
+    size_t per_page;
+    page_t *pages;              /* pages of this class with chunks left */
+} slab_class_t;
+
+struct slab_t {
+    pthread_mutex_t lock;
+    uint8_t *region;
+    size_t num_pages;
+    page_t *pages;
+    page_t *unused;
+    size_t num_classes;
+    slab_class_t classes[MAX_CLASSES];
+};
+
+static size_t round_up(size_t size, size_t align) {
+    return (size + align - 1) / align * align;
+}
+
+static void list_push(page_t **list, page_t *page) {
+    page->prev = NULL;
+    page->next = *list;
+    if (*list != NULL) {
+        (*list)->prev = page;
+    }
+    *list = page;
+}
+
+static void list_remove(page_t **list, page_t *page) {
+    if (page->prev != NULL) {
+        page->prev->next = page->next;
+    }
+    else {
+        *list = page->next;
+    }
+    if (page->next != NULL) {
+        page->next->prev = page->prev;
+    }
+    page->prev = NULL;
+    page->next = NULL;
+}
+
+slab_t *slab_create(size_t region_size) {
+    slab_t *slab = calloc(1, sizeof(*slab));
+    assert(slab != NULL);
+    pthread_mutex_init(&slab->lock, NULL);
+
+    slab->num_pages = round_up(region_size, PAGE_SIZE) / PAGE_SIZE;
+    if (slab->num_pages == 0) {
+        slab->num_pages = 1;
+    }
+    slab->region = malloc(slab->num_pages * PAGE_SIZE);
+    assert(slab->region != NULL);
+    slab->pages = calloc(slab->num_pages, sizeof(page_t));
+    assert(slab->pages != NULL);
+    for (size_t i = slab->num_pages; i-- > 0;) {
+        slab->pages[i].class_index = PAGE_UNUSED;
+        list_push(&slab->unused, &slab->pages[i]);
+    }
+
+    /* Size classes grow geometrically up to a whole page */
+    size_t size = MIN_CHUNK_SIZE;
+    while (size < PAGE_SIZE && slab->num_classes < MAX_CLASSES - 1) {
+        slab->classes[slab->num_classes++].chunk_size = size;
+        size = round_up(size * GROWTH_PERCENT / 100, CHUNK_ALIGN);
+    }
+    slab->classes[slab->num_classes++].chunk_size = PAGE_SIZE;
+    for (size_t i = 0; i < slab->num_classes; i++) {
+        slab_class_t *class = &slab->classes[i];
+        class->per_page = PAGE_SIZE / class->chunk_size;
+    }
+    return slab;
+}
+
+void slab_free(slab_t *slab) {
+    if (slab == NULL) {
+        return;
+    }
+
+    pthread_mutex_destroy(&slab->lock);
+    free(slab->pages);
+    free(slab->region);
+    free(slab);
+}
+
+/* Returns the first page of a run of num_pages unused pages, taking them out
+ * of the unused list, or NULL if there is no such run.  The caller must hold
+ * the lock. */
+static page_t *get_run(slab_t *slab, size_t num_pages) {
+    size_t start = 0;
+    for (size_t i = 0; i < slab->num_pages; i++) {
+        if (slab->pages[i].class_index != PAGE_UNUSED) {
+            start = i + 1;
+            continue;
+        }
+        if (i + 1 - start < num_pages) {
+            continue;
+        }
+
+        for (size_t j = start; j <= i; j++) {
+            list_remove(&slab->unused, &slab->pages[j]);
+            slab->pages[j].class_index = PAGE_RUN_REST;
+        }
+        page_t *page = &slab->pages[start];
+        page->class_index = PAGE_RUN;
+        page->used = num_pages;
+        return page;
+    }
+    return NULL;
+}
+
+void *slab_get(slab_t *slab, size_t size) {
+    /* Chunks bigger than a page take a run of whole pages, found by scanning
+     * for one, which is only worth it because such chunks are big */
+    if (size > PAGE_SIZE) {
+        pthread_mutex_lock(&slab->lock);
+        page_t *page = get_run(slab, round_up(size, PAGE_SIZE) / PAGE_SIZE);
+        pthread_mutex_unlock(&slab->lock);
+        return page != NULL
+            ? slab->region + (page - slab->pages) * PAGE_SIZE : NULL;
+    }
+
+    size_t index = 0;
+    while (slab->classes[index].chunk_size < size) {
+        index++;
+    }
+    slab_class_t *class = &slab->classes[index];
+
+    pthread_mutex_lock(&slab->lock);
+    page_t *page = class->pages;
+    if (page == NULL) {
+        /* Give the class an unused page, if there are any left */
+        page = slab->unused;
+        if (page == NULL) {
+            pthread_mutex_unlock(&slab->lock);
+            return NULL;
+        }
+        list_remove(&slab->unused, page);
+        page->class_index = index;
+        list_push(&class->pages, page);
+    }
+
+    void *chunk;
+    if (page->free_chunks != NULL) {
+        chunk = page->free_chunks;
+        page->free_chunks = page->free_chunks->next;
+    }
+    else {
+        chunk = slab->region + (page - slab->pages) * PAGE_SIZE +
+            page->carved * class->chunk_size;
+        page->carved++;
+    }
+    page->used++;
+    if (page->used == class->per_page) {
+        list_remove(&class->pages, page);
+    }
+    pthread_mutex_unlock(&slab->lock);
+    return chunk;
+}
+
+void slab_put(slab_t *slab, void *chunk) {
+    size_t index = ((uint8_t *) chunk - slab->region) / PAGE_SIZE;
+    assert(index < slab->num_pages);
+    page_t *page = &slab->pages[index];
+
+    pthread_mutex_lock(&slab->lock);
+    if (page->class_index == PAGE_RUN) {
+        for (size_t i = index + page->used; i-- > index;) {
+            slab->pages[i].class_index = PAGE_UNUSED;
+            slab->pages[i].used = 0;
+            list_push(&slab->unused, &slab->pages[i]);
+        }
+        pthread_mutex_unlock(&slab->lock);
+        return;
+    }
+
+    slab_class_t *class = &slab->classes[page->class_index];
+    free_chunk_t *free_chunk = chunk;
+    free_chunk->next = page->free_chunks;
+    page->free_chunks = free_chunk;
+    if (page->used == class->per_page) {
+        list_push(&class->pages, page);
+    }
+    page->used--;
+
+    /* Hand an empty page back, so any class can use it */
+    if (page->used == 0) {
+        list_remove(&class->pages, page);
+        page->class_index = PAGE_UNUSED;
+        page->carved = 0;
+        page->free_chunks = NULL;
+        list_push(&slab->unused, page);
+    }
+    pthread_mutex_unlock(&slab->lock);
+}
+
+size_t slab_chunk_size(slab_t *slab, void *chunk) {
+    size_t index = ((uint8_t *) chunk - slab->region) / PAGE_SIZE;
+    assert(index < slab->num_pages);
+    page_t *page = &slab->pages[index];
+    if (page->class_index == PAGE_RUN) {
+        return page->used * PAGE_SIZE;
+    }
+    return slab->classes[page->class_index].chunk_size;
+}
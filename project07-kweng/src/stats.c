@@ -0,0 +1,235 @@
+#include "stats.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Histograms keep 2^SUB_BUCKET_BITS buckets per power of two, so every
+ * latency is known to within about 6%, up to 2^MAX_EXPONENT microseconds */
+#define SUB_BUCKET_BITS 4
+#define SUB_BUCKETS (1 << SUB_BUCKET_BITS)
+#define MAX_EXPONENT 40
+#define NUM_BUCKETS (SUB_BUCKETS + (MAX_EXPONENT - SUB_BUCKET_BITS) * SUB_BUCKETS)
+
+typedef struct stats_thread_t stats_thread_t;
+
+/* Latencies in microseconds, counted in log-linear buckets */
+typedef struct {
+    _Atomic uint64_t counts[NUM_BUCKETS];
+    _Atomic uint64_t sum;
+    _Atomic uint64_t max;
+} histogram_t;
+
+/* One thread's copy of the statistics.  Only that thread writes it, but
+ * reports read it from other threads, so its fields are atomics, accessed
+ * with relaxed loads and stores. */
+struct stats_thread_t {
+    _Atomic uint64_t counters[NUM_STAT_COUNTERS];
+    histogram_t latencies[NUM_STAT_LATENCIES];
+    stats_thread_t *next;
+};
+
+/* The lock only guards the list of copies, which each thread joins the
+ * first time it updates anything */
+struct stats_t {
+    pthread_mutex_t lock;
+    stats_thread_t *threads;
+};
+
+/* The calling thread's copy.  Threads never exit while the proxy runs, so
+ * copies are never freed. */
+static _Thread_local stats_thread_t *local;
+
+stats_t *stats_create(void) {
+    stats_t *stats = calloc(1, sizeof(*stats));
+    assert(stats != NULL);
+    pthread_mutex_init(&stats->lock, NULL);
+    return stats;
+}
+
+/* Returns the calling thread's copy, adding it to the list if it's new */
+static stats_thread_t *local_copy(stats_t *stats) {
+    if (local == NULL) {
+        local = calloc(1, sizeof(*local));
+        assert(local != NULL);
+        pthread_mutex_lock(&stats->lock);
+        local->next = stats->threads;
+        stats->threads = local;
+        pthread_mutex_unlock(&stats->lock);
+    }
+    return local;
+}
+
+/* Adds delta to a value only the calling thread writes, which needs no
+ * atomic read-modify-write */
+static void bump(_Atomic uint64_t *value, uint64_t delta) {
+    atomic_store_explicit(value,
+        atomic_load_explicit(value, memory_order_relaxed) + delta,
+        memory_order_relaxed);
+}
+
+void stats_add(stats_t *stats, stat_counter_t counter, int64_t delta) {
+    /* Negative deltas wrap around, and wrap back once summed */
+    bump(&local_copy(stats)->counters[counter], (uint64_t) delta);
+}
+
+uint64_t stats_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/* Returns the bucket a latency of value microseconds is counted in: one per
+ * value below SUB_BUCKETS, then SUB_BUCKETS per power of two */
+static size_t bucket_index(uint64_t value) {
+    if (value < SUB_BUCKETS) {
+        return value;
+    }
+    int exponent = 63 - __builtin_clzll(value);
+    if (exponent >= MAX_EXPONENT) {
+        return NUM_BUCKETS - 1;
+    }
+    return SUB_BUCKETS + (exponent - SUB_BUCKET_BITS) * SUB_BUCKETS +
+        ((value >> (exponent - SUB_BUCKET_BITS)) - SUB_BUCKETS);
+}
+
+/* Returns the middle of the range of latencies counted in a bucket */
+static uint64_t bucket_value(size_t index) {
+    if (index < SUB_BUCKETS) {
+        return index;
+    }
+    int shift = (index - SUB_BUCKETS) / SUB_BUCKETS;
+    uint64_t low = (uint64_t) (SUB_BUCKETS + (index - SUB_BUCKETS) % SUB_BUCKETS)
+        << shift;
+    return low + ((uint64_t) 1 << shift) / 2;
+}
+
+void stats_record(stats_t *stats, stat_latency_t latency, uint64_t start) {
+    uint64_t now = stats_now();
+    uint64_t value = now > start ? now - start : 0;
+    histogram_t *histogram = &local_copy(stats)->latencies[latency];
+    bump(&histogram->counts[bucket_index(value)], 1);
+    bump(&histogram->sum, value);
+    if (value > atomic_load_explicit(&histogram->max, memory_order_relaxed)) {
+        atomic_store_explicit(&histogram->max, value, memory_order_relaxed);
+    }
+}
+
+bool stats_is_request(char *host, char *path) {
+    return strcmp(host, STATS_HOST) == 0 && strcmp(path, STATS_PATH) == 0;
+}
+
+/* Appends a formatted line to out */
+static void append_line(buffer_t *out, char *format, ...) {
+    char line[256];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if (length >= (int) sizeof(line)) {
+        length = sizeof(line) - 1;
+    }
+    buffer_append_bytes(out, (uint8_t *) line, length);
+}
+
+/* Appends a summary of a histogram merged from every thread's copy */
+static void append_histogram(buffer_t *out, char *name, uint64_t *counts,
+        uint64_t sum, uint64_t max) {
+    uint64_t total = 0;
+    for (size_t i = 0; i < NUM_BUCKETS; i++) {
+        total += counts[i];
+    }
+
+    double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+    char *labels[] = { "p50", "p90", "p99", "p999" };
+    uint64_t values[4] = {0};
+    size_t bucket = 0;
+    uint64_t seen = 0;
+    for (size_t q = 0; q < 4 && total > 0; q++) {
+        /* The smallest latency at least this share of requests had */
+        uint64_t rank = (uint64_t) (quantiles[q] * total + 0.999999);
+        while (bucket < NUM_BUCKETS && seen + counts[bucket] < rank) {
+            seen += counts[bucket++];
+        }
+        values[q] = bucket_value(bucket < NUM_BUCKETS ? bucket
+            : NUM_BUCKETS - 1);
+        if (values[q] > max) {
+            values[q] = max;
+        }
+    }
+
+    append_line(out, "%s_count %llu\n", name, (unsigned long long) total);
+    append_line(out, "%s_mean_us %llu\n", name,
+        (unsigned long long) (total > 0 ? sum / total : 0));
+    for (size_t q = 0; q < 4; q++) {
+        append_line(out, "%s_%s_us %llu\n", name, labels[q],
+            (unsigned long long) values[q]);
+    }
+    append_line(out, "%s_max_us %llu\n", name, (unsigned long long) max);
+}
+
+buffer_t *stats_report(stats_t *stats, cache_t *cache) {
+    uint64_t counters[NUM_STAT_COUNTERS] = {0};
+    uint64_t (*counts)[NUM_BUCKETS] = calloc(NUM_STAT_LATENCIES,
+        sizeof(*counts));
+    assert(counts != NULL);
+    uint64_t sums[NUM_STAT_LATENCIES] = {0};
+    uint64_t maxes[NUM_STAT_LATENCIES] = {0};
+
+    pthread_mutex_lock(&stats->lock);
+    for (stats_thread_t *thread = stats->threads; thread != NULL;
+            thread = thread->next) {
+        for (size_t i = 0; i < NUM_STAT_COUNTERS; i++) {
+            counters[i] += atomic_load_explicit(&thread->counters[i],
+                memory_order_relaxed);
+        }
+        for (size_t i = 0; i < NUM_STAT_LATENCIES; i++) {
+            histogram_t *histogram = &thread->latencies[i];
+            for (size_t j = 0; j < NUM_BUCKETS; j++) {
+                counts[i][j] += atomic_load_explicit(&histogram->counts[j],
+                    memory_order_relaxed);
+            }
+            sums[i] += atomic_load_explicit(&histogram->sum,
+                memory_order_relaxed);
+            uint64_t max = atomic_load_explicit(&histogram->max,
+                memory_order_relaxed);
+            if (max > maxes[i]) {
+                maxes[i] = max;
+            }
+        }
+    }
+    pthread_mutex_unlock(&stats->lock);
+
+    char *counter_names[NUM_STAT_COUNTERS] = {
+        [STAT_REQUESTS] = "requests",
+        [STAT_HITS] = "hits",
+        [STAT_MISSES] = "misses",
+        [STAT_REVALIDATED] = "revalidated",
+        [STAT_COALESCED] = "coalesced",
+        [STAT_CACHE_BYTES] = "bytes_from_cache",
+        [STAT_ORIGIN_BYTES] = "bytes_from_origin",
+        [STAT_CONNECTIONS] = "connections",
+        [STAT_THROTTLED] = "throttled"
+    };
+    char *latency_names[NUM_STAT_LATENCIES] = {
+        [LATENCY_FIRST_BYTE] = "first_byte",
+        [LATENCY_TOTAL] = "total"
+    };
+
+    buffer_t *out = buffer_create(2048);
+    for (size_t i = 0; i < NUM_STAT_COUNTERS; i++) {
+        append_line(out, "%s %llu\n", counter_names[i],
+            (unsigned long long) counters[i]);
+    }
+    append_line(out, "cache_used_bytes %zu\n", cache_size(cache));
+    append_line(out, "cache_evictions %zu\n", cache_evictions(cache));
+    for (size_t i = 0; i < NUM_STAT_LATENCIES; i++) {
+        append_histogram(out, latency_names[i], counts[i], sums[i], maxes[i]);
+    }
+    free(counts);
+    return out;
+}
@@ -0,0 +1,119 @@
+#include "throttle.h"
+#include <arpa/inet.h>
+#include <assert.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+
+#include "cache.h"
+#include "stats.h"
+
+/* Slots per kind of key.  A power of two, so a hash picks one with a mask */
+#define NUM_SLOTS 4096
+
+/* How far ahead of now a bucket may be drawn down, in microseconds, which
+ * makes bursts of up to a second's worth of requests */
+#define BURST_WINDOW 1000000
+
+typedef struct {
+    _Atomic uint32_t active;
+    /* The token bucket, kept as the time at which it would be empty if no
+     * more tokens were taken: each token moves it an interval later, and it
+     * is never earlier than now.  A token is left while it is less than
+     * BURST_WINDOW ahead of now. */
+    _Atomic uint64_t empty_at;
+} slot_t;
+
+typedef struct {
+    uint32_t max_active;    /* 0 if unlimited */
+    uint64_t interval;      /* microseconds per token, 0 if unlimited */
+    slot_t slots[NUM_SLOTS];
+} table_t;
+
+struct throttle_t {
+    table_t tables[NUM_THROTTLE_KINDS];
+};
+
+bool throttle_client_key(int client_fd, char *key) {
+    struct sockaddr_storage addr;
+    socklen_t length = sizeof(addr);
+    if (getpeername(client_fd, (struct sockaddr *) &addr, &length) < 0) {
+        return false;
+    }
+    if (addr.ss_family == AF_INET) {
+        struct sockaddr_in *in = (struct sockaddr_in *) &addr;
+        return inet_ntop(AF_INET, &in->sin_addr, key,
+            CLIENT_KEY_SIZE) != NULL;
+    }
+    if (addr.ss_family == AF_INET6) {
+        struct sockaddr_in6 *in6 = (struct sockaddr_in6 *) &addr;
+        return inet_ntop(AF_INET6, &in6->sin6_addr, key,
+            CLIENT_KEY_SIZE) != NULL;
+    }
+    return false;
+}
+
+throttle_t *throttle_create(void) {
+    throttle_t *throttle = calloc(1, sizeof(*throttle));
+    assert(throttle != NULL);
+    return throttle;
+}
+
+void throttle_set(throttle_t *throttle, throttle_kind_t kind, long max_active,
+        long rate) {
+    table_t *table = &throttle->tables[kind];
+    table->max_active = max_active;
+    table->interval = rate > 0 ? (BURST_WINDOW + rate - 1) / rate : 0;
+}
+
+static slot_t *slot_for(table_t *table, char *key) {
+    return &table->slots[hash(key) & (NUM_SLOTS - 1)];
+}
+
+bool throttle_acquire(throttle_t *throttle, throttle_kind_t kind, char *key) {
+    table_t *table = &throttle->tables[kind];
+    if (table->max_active == 0) {
+        return true;
+    }
+    slot_t *slot = slot_for(table, key);
+    uint32_t active = atomic_load_explicit(&slot->active,
+        memory_order_relaxed);
+    do {
+        if (active >= table->max_active) {
+            return false;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(&slot->active, &active,
+        active + 1, memory_order_relaxed, memory_order_relaxed));
+    return true;
+}
+
+void throttle_release(throttle_t *throttle, throttle_kind_t kind, char *key) {
+    table_t *table = &throttle->tables[kind];
+    if (table->max_active == 0) {
+        return;
+    }
+    atomic_fetch_sub_explicit(&slot_for(table, key)->active, 1,
+        memory_order_relaxed);
+}
+
+bool throttle_take(throttle_t *throttle, throttle_kind_t kind, char *key) {
+    table_t *table = &throttle->tables[kind];
+    if (table->interval == 0) {
+        return true;
+    }
+    slot_t *slot = slot_for(table, key);
+    uint64_t now = stats_now();
+    uint64_t empty_at = atomic_load_explicit(&slot->empty_at,
+        memory_order_relaxed);
+    uint64_t taken;
+    do {
+        /* A bucket that would have been empty in the past has refilled */
+        taken = (empty_at > now ? empty_at : now) + table->interval;
+        if (taken > now + BURST_WINDOW) {
+            return false;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(&slot->empty_at,
+        &empty_at, taken, memory_order_relaxed, memory_order_relaxed));
+    return true;
+}
@@ -0,0 +1,220 @@
+#include "warmup.h"
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "http.h"
+#include "stats.h"
+
+#define BUFFER_SIZE 8192
+
+/* Seconds a warm-up fetch may go without sending anything before it is left
+ * to finish in the background */
+#define WARMUP_TIMEOUT 10
+
+/* The URLs to warm up with, and how far the threads fetching them have got */
+typedef struct {
+    proxy_context_t *ctx;
+    char **urls;
+    size_t num_urls;
+
+    /* The next URL to fetch and what has been cached so far */
+    pthread_mutex_t lock;
+    size_t next;
+    size_t objects;
+    size_t bytes;
+} warmup_t;
+
+/* A warm-up request for handle_request() to serve */
+typedef struct {
+    int fd;
+    proxy_context_t *ctx;
+} fetch_t;
+
+/* Thread serving a warm-up request sent on a socket like any client's */
+static void *serve_fetch(void *args) {
+    fetch_t *fetch = (fetch_t *) args;
+    handle_request(fetch->fd, fetch->ctx, false);
+    free(fetch);
+    return NULL;
+}
+
+static int compare_urls(const void *a, const void *b) {
+    return strcmp(*(char **) a, *(char **) b);
+}
+
+/* Reads the URLs listed in file into *urls, sorted and without repeats, and
+ * sets *num_urls to how many there are.  The URLs and the array must be
+ * freed by the user. */
+static void read_urls(FILE *file, char ***urls, size_t *num_urls) {
+    size_t capacity = 64;
+    *urls = malloc(capacity * sizeof(char *));
+    assert(*urls != NULL);
+    *num_urls = 0;
+    char *line = NULL;
+    size_t line_capacity = 0;
+    while (getline(&line, &line_capacity, file) >= 0) {
+        char *url = line + strspn(line, " \t");
+        url[strcspn(url, " \t\r\n")] = '\0';
+        if (starts_with(url, "http://")) {
+            url += strlen("http://");
+        }
+        if (*url == '\0' || *url == '#') {
+            continue;
+        }
+        if (*num_urls == capacity) {
+            capacity *= 2;
+            *urls = realloc(*urls, capacity * sizeof(char *));
+            assert(*urls != NULL);
+        }
+        (*urls)[*num_urls] = strdup(url);
+        assert((*urls)[*num_urls] != NULL);
+        (*num_urls)++;
+    }
+    free(line);
+    fclose(file);
+
+    qsort(*urls, *num_urls, sizeof(char *), compare_urls);
+    size_t unique = 0;
+    for (size_t i = 0; i < *num_urls; i++) {
+        if (unique > 0 && strcmp((*urls)[i], (*urls)[unique - 1]) == 0) {
+            free((*urls)[i]);
+        }
+        else {
+            (*urls)[unique++] = (*urls)[i];
+        }
+    }
+    *num_urls = unique;
+}
+
+/* Requests url from the proxy's own request handling over a socket pair,
+ * throwing the response away, and adds it to the tally if it was cached */
+static void warm_url(warmup_t *warmup, char *url) {
+    char *format = "GET http://%s HTTP/1.0\r\n\r\n";
+    size_t request_length = strlen(format) - 2 + strlen(url);
+    char *request = malloc(request_length + 1);
+    assert(request != NULL);
+    sprintf(request, format, url);
+
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        verbose_printf("socketpair error: %s\n", strerror(errno));
+        free(request);
+        return;
+    }
+    fetch_t *fetch = malloc(sizeof(*fetch));
+    assert(fetch != NULL);
+    fetch->fd = fds[1];
+    fetch->ctx = warmup->ctx;
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, serve_fetch, fetch) != 0) {
+        verbose_printf("Could not start warm-up thread\n");
+        close(fds[0]);
+        close(fds[1]);
+        free(fetch);
+        free(request);
+        return;
+    }
+    pthread_detach(tid);
+
+    /* A stalled response is left to the thread serving it, which has the
+     * other end of the socket pair to itself once this one is closed */
+    struct timeval timeout = { .tv_sec = WARMUP_TIMEOUT, .tv_usec = 0 };
+    setsockopt(fds[0], SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    bool done = write(fds[0], request, request_length) ==
+        (ssize_t) request_length && shutdown(fds[0], SHUT_WR) == 0;
+    uint8_t discard[BUFFER_SIZE];
+    ssize_t bytes_read = -1;
+    while (done &&
+            (bytes_read = read(fds[0], discard, sizeof(discard))) > 0) {
+    }
+    close(fds[0]);
+    if (bytes_read < 0) {
+        verbose_printf("Warm-up of %s did not finish\n", url);
+        free(request);
+        return;
+    }
+
+    /* Look the URL up the way a client's request for it would be */
+    char *host, *path;
+    bool keep_alive;
+    request[strcspn(request, "\r")] = '\0';
+    if (parse_request_line(request, &host, &path, &keep_alive) == REQUEST_OK) {
+        char *key = make_cache_key(host, path);
+        node_t *node = cache_lookup(warmup->ctx->cache, key);
+        if (node != NULL) {
+            pthread_mutex_lock(&warmup->lock);
+            warmup->objects++;
+            warmup->bytes += node_head_length(node) + node_value_length(node);
+            pthread_mutex_unlock(&warmup->lock);
+            cache_release(node);
+        }
+        free(key);
+        free(host);
+        free(path);
+    }
+    free(request);
+}
+
+/* Warm-up thread: fetches URLs until there are none left */
+static void *warm_urls(void *args) {
+    warmup_t *warmup = (warmup_t *) args;
+    while (true) {
+        pthread_mutex_lock(&warmup->lock);
+        if (warmup->next == warmup->num_urls) {
+            pthread_mutex_unlock(&warmup->lock);
+            break;
+        }
+        char *url = warmup->urls[warmup->next++];
+        pthread_mutex_unlock(&warmup->lock);
+        warm_url(warmup, url);
+    }
+    return NULL;
+}
+
+void warm_cache(FILE *file, long parallelism, proxy_context_t *ctx) {
+    warmup_t warmup = {0};
+    read_urls(file, &warmup.urls, &warmup.num_urls);
+    warmup.ctx = ctx;
+    pthread_mutex_init(&warmup.lock, NULL);
+
+    uint64_t start = stats_now();
+    if (warmup.num_urls > 0 && (size_t) parallelism > warmup.num_urls) {
+        parallelism = warmup.num_urls;
+    }
+    pthread_t *tids = malloc(parallelism * sizeof(pthread_t));
+    assert(tids != NULL);
+    long started = 0;
+    for (; started < parallelism; started++) {
+        if (pthread_create(&tids[started], NULL, warm_urls, &warmup) != 0) {
+            perror("Could not start warm-up thread");
+            break;
+        }
+    }
+    /* Without any threads, fetch them all on this one */
+    if (started == 0) {
+        warm_urls(&warmup);
+    }
+    for (long i = 0; i < started; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    free(tids);
+
+    printf("Warmed up the cache with %zu of %zu URLs (%zu bytes) in %.1f "
+        "seconds\n", warmup.objects, warmup.num_urls, warmup.bytes,
+        (stats_now() - start) / 1e6);
+    fflush(stdout);
+    pthread_mutex_destroy(&warmup.lock);
+    for (size_t i = 0; i < warmup.num_urls; i++) {
+        free(warmup.urls[i]);
+    }
+    free(warmup.urls);
+}
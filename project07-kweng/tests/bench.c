@@ -0,0 +1,710 @@
+/* Load generator for the proxy.  Starts a local origin server and (unless
+ * told to use one already running) the proxy, then drives the proxy with
+ * concurrent clients through a series of scenarios, reporting throughput and
+ * latency percentiles for each.  Needs nothing but the loopback interface,
+ * so results can be compared from one change to the next offline.
+ *
+ *     bench [options] [scenario ...] [-- proxy options]
+ *
+ * Scenarios are cold (every request is for a URL never asked for before),
+ * hot (every request is for one of a set of URLs fetched beforehand) and
+ * mixed (mostly hot, with a share of cold ones).  All three run by default.
+ */
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BUFFER_SIZE 65536
+
+/* Seconds a client waits on the proxy before counting a request as failed */
+#define CLIENT_TIMEOUT 10
+
+/* Seconds to wait for a freshly started proxy to accept connections */
+#define STARTUP_TIMEOUT 5
+
+/* Histograms keep 2^SUB_BUCKET_BITS buckets per power of two, so every
+ * latency is known to within about 6%, up to 2^MAX_EXPONENT microseconds */
+#define SUB_BUCKET_BITS 4
+#define SUB_BUCKETS (1 << SUB_BUCKET_BITS)
+#define MAX_EXPONENT 40
+#define NUM_BUCKETS (SUB_BUCKETS + (MAX_EXPONENT - SUB_BUCKET_BITS) * SUB_BUCKETS)
+
+typedef enum {
+    SCENARIO_COLD,
+    SCENARIO_HOT,
+    SCENARIO_MIXED,
+    NUM_SCENARIOS
+} scenario_t;
+
+static char *scenario_names[NUM_SCENARIOS] = {
+    [SCENARIO_COLD] = "cold",
+    [SCENARIO_HOT] = "hot",
+    [SCENARIO_MIXED] = "mixed"
+};
+
+/* Settings, from the command line */
+typedef struct {
+    int clients;          /* concurrent client connections */
+    double seconds;       /* how long each scenario runs */
+    double rate;          /* requests per second for all clients, or 0 for
+                           * closed-loop clients that send as fast as they
+                           * get answers */
+    size_t object_size;   /* bytes in the body of every object */
+    int delay_ms;         /* how long the origin waits before answering */
+    int hot_objects;      /* distinct URLs the hot scenarios ask for */
+    int miss_percent;     /* share of cold requests in the mixed scenario */
+    int proxy_port;
+    bool spawn_proxy;
+    char *proxy_path;
+} settings_t;
+
+/* Latencies in microseconds, counted in log-linear buckets */
+typedef struct {
+    uint64_t counts[NUM_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+} histogram_t;
+
+/* What one client thread is told to do, and what it found */
+typedef struct {
+    settings_t *settings;
+    scenario_t scenario;
+    int origin_port;
+    int index;
+    uint64_t start;
+    uint64_t stop;
+    uint64_t errors;
+    histogram_t histogram;
+} client_t;
+
+/* The origin's canned response: headers followed by object_size bytes */
+static char *origin_response;
+static size_t origin_response_length;
+static int origin_delay_ms;
+
+/* Numbers the URLs of cold requests, so no two are ever the same */
+static _Atomic uint64_t next_cold_id;
+
+/* Returns the time on a monotonic clock, in microseconds */
+static uint64_t now_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static void sleep_us(uint64_t us) {
+    struct timespec duration = {
+        .tv_sec = us / 1000000,
+        .tv_nsec = (us % 1000000) * 1000
+    };
+    while (nanosleep(&duration, &duration) < 0 && errno == EINTR) {
+    }
+}
+
+/* Returns the bucket a latency of value microseconds is counted in: one per
+ * value below SUB_BUCKETS, then SUB_BUCKETS per power of two */
+static size_t bucket_index(uint64_t value) {
+    if (value < SUB_BUCKETS) {
+        return value;
+    }
+    int exponent = 63 - __builtin_clzll(value);
+    if (exponent >= MAX_EXPONENT) {
+        return NUM_BUCKETS - 1;
+    }
+    return SUB_BUCKETS + (exponent - SUB_BUCKET_BITS) * SUB_BUCKETS +
+        ((value >> (exponent - SUB_BUCKET_BITS)) - SUB_BUCKETS);
+}
+
+/* Returns the middle of the range of latencies counted in a bucket */
+static uint64_t bucket_value(size_t index) {
+    if (index < SUB_BUCKETS) {
+        return index;
+    }
+    int shift = (index - SUB_BUCKETS) / SUB_BUCKETS;
+    uint64_t low = (uint64_t) (SUB_BUCKETS + (index - SUB_BUCKETS) % SUB_BUCKETS)
+        << shift;
+    return low + ((uint64_t) 1 << shift) / 2;
+}
+
+static void histogram_record(histogram_t *histogram, uint64_t value) {
+    histogram->counts[bucket_index(value)]++;
+    histogram->total++;
+    if (value > histogram->max) {
+        histogram->max = value;
+    }
+}
+
+/* Returns the smallest latency at least a share quantile of requests had */
+static uint64_t histogram_quantile(histogram_t *histogram, double quantile) {
+    if (histogram->total == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t) (quantile * histogram->total + 0.999999);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < NUM_BUCKETS; i++) {
+        seen += histogram->counts[i];
+        if (seen >= rank) {
+            uint64_t value = bucket_value(i);
+            return value < histogram->max ? value : histogram->max;
+        }
+    }
+    return histogram->max;
+}
+
+/* Writes all length bytes of data to fd.  Returns whether successful. */
+static bool write_all(int fd, char *data, size_t length) {
+    while (length > 0) {
+        ssize_t bytes_written = write(fd, data, length);
+        if (bytes_written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_written <= 0) {
+            return false;
+        }
+        data += bytes_written;
+        length -= bytes_written;
+    }
+    return true;
+}
+
+/* Opens a connection to a port on the loopback interface, or returns -1 */
+static int connect_local(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    struct timeval timeout = { .tv_sec = CLIENT_TIMEOUT };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    return fd;
+}
+
+/* Answers every request on one origin connection with the canned response,
+ * until the proxy closes it */
+static void *serve_origin_connection(void *arg) {
+    int fd = (int) (intptr_t) arg;
+    char buf[BUFFER_SIZE];
+    size_t length = 0;
+    while (true) {
+        char *end;
+        while ((end = memmem(buf, length, "\r\n\r\n", 4)) == NULL) {
+            if (length == sizeof(buf)) {
+                goto DONE;
+            }
+            ssize_t bytes_read = read(fd, buf + length, sizeof(buf) - length);
+            if (bytes_read < 0 && errno == EINTR) {
+                continue;
+            }
+            if (bytes_read <= 0) {
+                goto DONE;
+            }
+            length += bytes_read;
+        }
+
+        if (origin_delay_ms > 0) {
+            sleep_us((uint64_t) origin_delay_ms * 1000);
+        }
+        if (!write_all(fd, origin_response, origin_response_length)) {
+            goto DONE;
+        }
+
+        /* Requests have no bodies, so the next one starts after the blank
+         * line */
+        size_t used = end + 4 - buf;
+        memmove(buf, buf + used, length - used);
+        length -= used;
+    }
+
+    DONE:
+    close(fd);
+    return NULL;
+}
+
+/* Accepts origin connections, serving each on its own thread */
+static void *run_origin(void *arg) {
+    int listen_fd = (int) (intptr_t) arg;
+    while (true) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, serve_origin_connection,
+                (void *) (intptr_t) fd) != 0) {
+            close(fd);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+    return NULL;
+}
+
+/* Starts the origin on an ephemeral loopback port, returning the port */
+static int start_origin(settings_t *settings) {
+    char head[256];
+    int head_length = snprintf(head, sizeof(head),
+        "HTTP/1.1 200 OK\r\n"
+        "Content-Type: application/octet-stream\r\n"
+        "Content-Length: %zu\r\n"
+        "Cache-Control: max-age=3600\r\n"
+        "\r\n", settings->object_size);
+    origin_response_length = head_length + settings->object_size;
+    origin_response = malloc(origin_response_length);
+    assert(origin_response != NULL);
+    memcpy(origin_response, head, head_length);
+    memset(origin_response + head_length, 'x', settings->object_size);
+    origin_delay_ms = settings->delay_ms;
+
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        perror("socket error");
+        exit(1);
+    }
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addr_length = sizeof(addr);
+    if (bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+            listen(listen_fd, SOMAXCONN) < 0 ||
+            getsockname(listen_fd, (struct sockaddr *) &addr,
+                &addr_length) < 0) {
+        perror("origin error");
+        exit(1);
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, run_origin,
+            (void *) (intptr_t) listen_fd) != 0) {
+        perror("pthread_create error");
+        exit(1);
+    }
+    pthread_detach(thread);
+    return ntohs(addr.sin_port);
+}
+
+/* Starts the proxy listening on settings->proxy_port with the given extra
+ * options, and waits until it accepts connections.  Returns its pid. */
+static pid_t start_proxy(settings_t *settings, int argc, char **argv) {
+    char port[16];
+    snprintf(port, sizeof(port), "%d", settings->proxy_port);
+    char **args = calloc(argc + 3, sizeof(*args));
+    assert(args != NULL);
+    args[0] = settings->proxy_path;
+    memcpy(args + 1, argv, argc * sizeof(*args));
+    args[argc + 1] = port;
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork error");
+        exit(1);
+    }
+    if (pid == 0) {
+        /* Keep the proxy's logging out of the report */
+        if (freopen("/dev/null", "w", stdout) == NULL) {
+            _exit(1);
+        }
+        execv(settings->proxy_path, args);
+        perror("exec error");
+        _exit(1);
+    }
+    free(args);
+
+    uint64_t deadline = now_us() + STARTUP_TIMEOUT * 1000000;
+    while (now_us() < deadline) {
+        int fd = connect_local(settings->proxy_port);
+        if (fd >= 0) {
+            close(fd);
+            return pid;
+        }
+        if (waitpid(pid, NULL, WNOHANG) == pid) {
+            break;
+        }
+        sleep_us(10000);
+    }
+    fprintf(stderr, "The proxy didn't start listening on port %d\n",
+        settings->proxy_port);
+    kill(pid, SIGKILL);
+    exit(1);
+}
+
+/* Sends one GET for path on the origin through the proxy over *fd,
+ * (re)connecting first if needed, and reads the whole response.  Closes and
+ * clears *fd if the connection can't be used again.  Returns whether a 200
+ * response arrived in full. */
+static bool fetch(settings_t *settings, int origin_port, int *fd, char *path) {
+    if (*fd < 0) {
+        *fd = connect_local(settings->proxy_port);
+        if (*fd < 0) {
+            return false;
+        }
+    }
+
+    char request[512];
+    int request_length = snprintf(request, sizeof(request),
+        "GET http://127.0.0.1:%d%s HTTP/1.1\r\n"
+        "Host: 127.0.0.1:%d\r\n"
+        "\r\n", origin_port, path, origin_port);
+    bool success = false, reusable = false;
+    if (!write_all(*fd, request, request_length)) {
+        goto DONE;
+    }
+
+    /* Read the status line and headers */
+    char buf[BUFFER_SIZE];
+    size_t length = 0;
+    char *end;
+    while ((end = memmem(buf, length, "\r\n\r\n", 4)) == NULL) {
+        if (length == sizeof(buf)) {
+            goto DONE;
+        }
+        ssize_t bytes_read = read(*fd, buf + length, sizeof(buf) - length);
+        if (bytes_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read <= 0) {
+            goto DONE;
+        }
+        length += bytes_read;
+    }
+
+    bool ok = length > 12 && strncmp(buf + 9, "200", 3) == 0;
+    bool has_length = false, close_after = false;
+    size_t content_length = 0;
+    char *line = strstr(buf, "\r\n") + 2;
+    while (line < end + 2) {
+        char *line_end = strstr(line, "\r\n");
+        if (strncasecmp(line, "Content-Length:", 15) == 0) {
+            has_length = true;
+            content_length = strtoull(line + 15, NULL, 10);
+        }
+        else if (strncasecmp(line, "Connection:", 11) == 0) {
+            close_after = memmem(line, line_end - line, "close", 5) != NULL;
+        }
+        line = line_end + 2;
+    }
+
+    /* Then skip the body, which ends at EOF if its length wasn't given */
+    size_t body = length - (end + 4 - buf);
+    while (!has_length || body < content_length) {
+        ssize_t bytes_read = read(*fd, buf, sizeof(buf));
+        if (bytes_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read == 0 && !has_length) {
+            break;
+        }
+        if (bytes_read <= 0) {
+            goto DONE;
+        }
+        body += bytes_read;
+    }
+    success = ok;
+    reusable = has_length && !close_after;
+
+    DONE:
+    if (!reusable) {
+        close(*fd);
+        *fd = -1;
+    }
+    return success;
+}
+
+/* Picks the path of a client's next request in a scenario */
+static void next_path(client_t *client, unsigned int *seed, char *path,
+        size_t size) {
+    bool cold = client->scenario == SCENARIO_COLD ||
+        (client->scenario == SCENARIO_MIXED &&
+            rand_r(seed) % 100 < client->settings->miss_percent);
+    if (cold) {
+        snprintf(path, size, "/cold/%llu",
+            (unsigned long long) atomic_fetch_add(&next_cold_id, 1));
+    }
+    else {
+        snprintf(path, size, "/hot/%d",
+            rand_r(seed) % client->settings->hot_objects);
+    }
+}
+
+/* Sends requests until the scenario's time is up.  Closed-loop clients send
+ * each request as soon as the last is answered.  Open-loop clients send on a
+ * fixed schedule, measuring latency from when each request was due, so a
+ * stalled proxy is charged for every request it held up. */
+static void *run_client(void *arg) {
+    client_t *client = arg;
+    settings_t *settings = client->settings;
+    unsigned int seed = client->index * 7919 + 1;
+    int fd = -1;
+
+    uint64_t interval = 0, due = client->start;
+    if (settings->rate > 0) {
+        interval = (uint64_t) (1000000.0 * settings->clients / settings->rate);
+        due += interval * client->index / settings->clients;
+    }
+    while (true) {
+        uint64_t now = now_us();
+        if (interval > 0) {
+            if (due >= client->stop) {
+                break;
+            }
+            if (now < due) {
+                sleep_us(due - now);
+            }
+        }
+        else {
+            if (now >= client->stop) {
+                break;
+            }
+            due = now;
+        }
+
+        char path[64];
+        next_path(client, &seed, path, sizeof(path));
+        if (fetch(settings, client->origin_port, &fd, path)) {
+            uint64_t done = now_us();
+            histogram_record(&client->histogram, done > due ? done - due : 0);
+        }
+        else {
+            client->errors++;
+        }
+        due += interval;
+    }
+
+    if (fd >= 0) {
+        close(fd);
+    }
+    return NULL;
+}
+
+/* Fetches every hot URL once, so the hot scenarios find them cached */
+static void warm_cache(settings_t *settings, int origin_port) {
+    int fd = -1;
+    uint64_t errors = 0;
+    for (int i = 0; i < settings->hot_objects; i++) {
+        char path[64];
+        snprintf(path, sizeof(path), "/hot/%d", i);
+        if (!fetch(settings, origin_port, &fd, path)) {
+            errors++;
+        }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    if (errors > 0) {
+        fprintf(stderr, "%llu of %d requests warming the cache failed\n",
+            (unsigned long long) errors, settings->hot_objects);
+    }
+}
+
+/* Runs one scenario with every client at once, then prints a line of results */
+static void run_scenario(settings_t *settings, int origin_port,
+        scenario_t scenario) {
+    client_t *clients = calloc(settings->clients, sizeof(*clients));
+    pthread_t *threads = calloc(settings->clients, sizeof(*threads));
+    assert(clients != NULL && threads != NULL);
+
+    uint64_t start = now_us();
+    uint64_t stop = start + (uint64_t) (settings->seconds * 1000000);
+    for (int i = 0; i < settings->clients; i++) {
+        clients[i].settings = settings;
+        clients[i].scenario = scenario;
+        clients[i].origin_port = origin_port;
+        clients[i].index = i;
+        clients[i].start = start;
+        clients[i].stop = stop;
+        if (pthread_create(&threads[i], NULL, run_client, &clients[i]) != 0) {
+            perror("pthread_create error");
+            exit(1);
+        }
+    }
+
+    histogram_t *merged = calloc(1, sizeof(*merged));
+    assert(merged != NULL);
+    uint64_t errors = 0;
+    for (int i = 0; i < settings->clients; i++) {
+        pthread_join(threads[i], NULL);
+        histogram_t *histogram = &clients[i].histogram;
+        for (size_t j = 0; j < NUM_BUCKETS; j++) {
+            merged->counts[j] += histogram->counts[j];
+        }
+        merged->total += histogram->total;
+        if (histogram->max > merged->max) {
+            merged->max = histogram->max;
+        }
+        errors += clients[i].errors;
+    }
+    double elapsed = (now_us() - start) / 1000000.0;
+
+    printf("%-8s %10llu %8llu %12.1f %10llu %10llu %10llu %10llu\n",
+        scenario_names[scenario], (unsigned long long) merged->total,
+        (unsigned long long) errors, merged->total / elapsed,
+        (unsigned long long) histogram_quantile(merged, 0.5),
+        (unsigned long long) histogram_quantile(merged, 0.99),
+        (unsigned long long) histogram_quantile(merged, 0.999),
+        (unsigned long long) merged->max);
+    fflush(stdout);
+    free(merged);
+    free(threads);
+    free(clients);
+}
+
+static void usage(char *name) {
+    fprintf(stderr,
+        "Usage: %s [options] [cold|hot|mixed ...] [-- proxy options]\n"
+        "  -c clients   concurrent client connections (default 16)\n"
+        "  -t seconds   how long each scenario runs (default 5)\n"
+        "  -r rate      total requests per second, sent on a schedule;\n"
+        "               0 sends each request once the last is answered\n"
+        "               (default 0)\n"
+        "  -s bytes     size of every object (default 16384)\n"
+        "  -d ms        origin delay before each response (default 0)\n"
+        "  -k objects   distinct URLs the hot requests ask for (default 1000)\n"
+        "  -m percent   share of cold requests in mixed (default 10)\n"
+        "  -p port      port the proxy listens on (default 18999)\n"
+        "  -x           use a proxy already listening on the port\n"
+        "  -b path      proxy binary to start (default bin/proxy)\n", name);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    settings_t settings = {
+        .clients = 16,
+        .seconds = 5,
+        .rate = 0,
+        .object_size = 16384,
+        .delay_ms = 0,
+        .hot_objects = 1000,
+        .miss_percent = 10,
+        .proxy_port = 18999,
+        .spawn_proxy = true,
+        .proxy_path = "bin/proxy"
+    };
+
+    int opt;
+    while ((opt = getopt(argc, argv, "+c:t:r:s:d:k:m:p:xb:")) != -1) {
+        switch (opt) {
+            case 'c':
+                settings.clients = atoi(optarg);
+                break;
+            case 't':
+                settings.seconds = atof(optarg);
+                break;
+            case 'r':
+                settings.rate = atof(optarg);
+                break;
+            case 's':
+                settings.object_size = strtoull(optarg, NULL, 10);
+                break;
+            case 'd':
+                settings.delay_ms = atoi(optarg);
+                break;
+            case 'k':
+                settings.hot_objects = atoi(optarg);
+                break;
+            case 'm':
+                settings.miss_percent = atoi(optarg);
+                break;
+            case 'p':
+                settings.proxy_port = atoi(optarg);
+                break;
+            case 'x':
+                settings.spawn_proxy = false;
+                break;
+            case 'b':
+                settings.proxy_path = optarg;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (settings.clients <= 0 || settings.seconds <= 0 || settings.rate < 0 ||
+            settings.hot_objects <= 0 || settings.miss_percent < 0 ||
+            settings.miss_percent > 100 || settings.delay_ms < 0) {
+        usage(argv[0]);
+    }
+
+    /* Scenario names come next, then (after "--") options for the proxy.
+     * getopt() has already skipped a "--" that came right after options. */
+    bool scenarios[NUM_SCENARIOS] = {false};
+    bool any = false;
+    int arg = optind;
+    if (strcmp(argv[arg - 1], "--") != 0) {
+        for (; arg < argc && strcmp(argv[arg], "--") != 0; arg++) {
+            bool found = false;
+            for (int i = 0; i < NUM_SCENARIOS; i++) {
+                if (strcmp(argv[arg], scenario_names[i]) == 0) {
+                    scenarios[i] = found = any = true;
+                }
+            }
+            if (!found) {
+                usage(argv[0]);
+            }
+        }
+        if (arg < argc) {
+            arg++;
+        }
+    }
+    if (!any) {
+        for (int i = 0; i < NUM_SCENARIOS; i++) {
+            scenarios[i] = true;
+        }
+    }
+
+    /* A client whose connection the proxy closed mustn't kill the bench */
+    signal(SIGPIPE, SIG_IGN);
+
+    int origin_port = start_origin(&settings);
+    pid_t proxy = settings.spawn_proxy
+        ? start_proxy(&settings, argc - arg, argv + arg) : -1;
+
+    printf("%d clients, %s, %zu byte objects, %d ms origin delay\n",
+        settings.clients, settings.rate > 0 ? "open loop" : "closed loop",
+        settings.object_size, settings.delay_ms);
+    if (settings.rate > 0) {
+        printf("%.1f requests/s offered\n", settings.rate);
+    }
+    printf("%-8s %10s %8s %12s %10s %10s %10s %10s\n", "scenario",
+        "requests", "errors", "requests/s", "p50_us", "p99_us", "p999_us",
+        "max_us");
+    for (int i = 0; i < NUM_SCENARIOS; i++) {
+        if (!scenarios[i]) {
+            continue;
+        }
+        if (i != SCENARIO_COLD) {
+            warm_cache(&settings, origin_port);
+        }
+        run_scenario(&settings, origin_port, i);
+    }
+
+    if (proxy > 0) {
+        kill(proxy, SIGINT);
+        waitpid(proxy, NULL, 0);
+    }
+    return 0;
+}
@@ -0,0 +1,70 @@
+#!/bin/bash
+# Checks that concurrent requests for the same URL share one fetch from the
+# server, unless they send credentials or conditions (in any case of header
+# name), whose answers may be meant only for their own client
+
+SERVER_PORT=8082
+server=localhost:$SERVER_PORT
+
+./tests/counting-http.py $SERVER_PORT &
+SERVER_PID=$!
+
+sleep 1
+
+PROXY_PORT=$(cs24-port)
+ANSWERS=$(mktemp -d)
+
+ERROR=false
+
+# Sends 4 concurrent requests for path with the given extra header, and
+# prints how many different answers they got
+distinct_answers() {
+    path=$1
+    header=$2
+    for i in 1 2 3 4; do
+        curl --proxy localhost:$PROXY_PORT --silent --max-time 10 \
+            ${header:+--header "$header"} \
+            --output $ANSWERS/$i http://$server$path &
+    done
+    wait
+    for i in 1 2 3 4; do
+        cat $ANSWERS/$i
+        echo
+    done | sort -u | grep -c .
+}
+
+check() {
+    mode=$1
+    path=$2
+    header=$3
+    expected=$4
+    answers=$(distinct_answers $path "$header")
+    if [ "$answers" != "$expected" ]; then
+        echo -e "\u001b[31mFailed $mode $path ($header): $answers fetches, expected $expected.\u001b[0m"
+        ERROR=true
+    fi
+}
+
+for mode in threads epoll; do
+    killall -9 proxy 2> /dev/null
+    ./bin/proxy -m $mode $PROXY_PORT &
+    sleep 1
+
+    check $mode /$mode/shared "" 1
+    check $mode /$mode/cookie "cookie: a=b" 4
+    check $mode /$mode/authorization "authorization: Basic YTpi" 4
+    check $mode /$mode/if-none-match 'if-none-match: "x"' 4
+    check $mode /$mode/if-modified-since \
+        "if-modified-since: Thu, 01 Jan 2026 00:00:00 GMT" 4
+    check $mode /$mode/range "range: bytes=0-0" 4
+done
+
+kill -9 $SERVER_PID > /dev/null
+killall -9 proxy > /dev/null
+rm -rf $ANSWERS
+
+if ! $ERROR; then
+    echo -e "\u001b[32;1mSuccess.\u001b[0m"
+else
+    exit 1
+fi
@@ -0,0 +1,31 @@
+#!/usr/bin/env python3
+# Answers each GET after a second with how many times its path has been
+# requested so far, so concurrent requests the proxy coalesces into one fetch
+# all get the same answer
+
+import sys
+import threading
+import time
+from http.server import ThreadingHTTPServer, BaseHTTPRequestHandler
+
+counts = {}
+lock = threading.Lock()
+
+class CountingRequestHandler(BaseHTTPRequestHandler):
+    def do_GET(self):
+        with lock:
+            counts[self.path] = counts.get(self.path, 0) + 1
+            body = str(counts[self.path]).encode()
+        time.sleep(1)
+        self.send_response(200)
+        self.send_header("Cache-Control", "max-age=60")
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+    def log_message(self, format, *args):
+        pass
+
+if __name__ == "__main__":
+    port = int(sys.argv[1]) if len(sys.argv) > 1 else 8082
+    ThreadingHTTPServer(("localhost", port), CountingRequestHandler).serve_forever()